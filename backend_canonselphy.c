@@ -684,7 +684,7 @@ static int canonselphy_read_parse(void *vctx, const void **vjob, int data_fd, in
 
 	/* The CP900 job *may* have a 4-byte null footer after the
 	   job contents.  Ignore it if it comes through here.. */
-	i = read(data_fd, rdbuf, 4);
+	i = dyesub_read_full(data_fd, rdbuf, 4);
 	if (i != 4) {
 		if (i == 0) {
 			canonselphy_cleanup_job(job);
@@ -704,7 +704,7 @@ static int canonselphy_read_parse(void *vctx, const void **vjob, int data_fd, in
 	}
 
 	/* Read the rest of the header.. */
-	i = read(data_fd, rdbuf + offset, MAX_HEADER - offset);
+	i = dyesub_read_full(data_fd, rdbuf + offset, MAX_HEADER - offset);
 	if (i != MAX_HEADER - offset) {
 		if (i == 0) {
 			canonselphy_cleanup_job(job);
@@ -763,47 +763,34 @@ static int canonselphy_read_parse(void *vctx, const void **vjob, int data_fd, in
 
 	/* Read in YELLOW plane */
 	remain = job->plane_len - (MAX_HEADER-ctx->printer->init_length);
-	while (remain > 0) {
-		i = read(data_fd, job->plane_y + (job->plane_len - remain), remain);
-		if (i < 0) {
-			canonselphy_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		remain -= i;
+	i = dyesub_read_full(data_fd, job->plane_y + (job->plane_len - remain), remain);
+	if (i != remain) {
+		canonselphy_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
 	}
 
 	/* Read in MAGENTA plane */
 	remain = job->plane_len;
-	while (remain > 0) {
-		i = read(data_fd, job->plane_m + (job->plane_len - remain), remain);
-		if (i < 0) {
-			canonselphy_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		remain -= i;
+	i = dyesub_read_full(data_fd, job->plane_m + (job->plane_len - remain), remain);
+	if (i != remain) {
+		canonselphy_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
 	}
 
 	/* Read in CYAN plane */
 	remain = job->plane_len;
-	while (remain > 0) {
-		i = read(data_fd, job->plane_c + (job->plane_len - remain), remain);
-		if (i < 0) {
-			canonselphy_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		remain -= i;
+	i = dyesub_read_full(data_fd, job->plane_c + (job->plane_len - remain), remain);
+	if (i != remain) {
+		canonselphy_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
 	}
 
 	/* Read in footer */
 	if (ctx->printer->foot_length) {
-		remain = ctx->printer->foot_length;
-		while (remain > 0) {
-			i = read(data_fd, job->footer + (ctx->printer->foot_length - remain), remain);
-			if (i < 0) {
-				canonselphy_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			remain -= i;
+		i = dyesub_read_full(data_fd, job->footer, ctx->printer->foot_length);
+		if (i != ctx->printer->foot_length) {
+			canonselphy_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
 		}
 	}
 
@@ -871,7 +858,7 @@ top:
 	}
 	last_state = state;
 
-	fflush(logger);
+	dyesub_log_flush();
 
 	switch(state) {
 	case S_IDLE:
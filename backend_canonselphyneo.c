@@ -244,7 +244,7 @@ static int selphyneo_read_parse(void *vctx, const void **vjob, int data_fd, int
 	job->common.copies = copies;
 
 	/* Read the header.. */
-	i = read(data_fd, &hdr, sizeof(hdr));
+	i = dyesub_read_full(data_fd, &hdr, sizeof(hdr));
 	if (i != sizeof(hdr)) {
 		if (i == 0) {
 			selphyneo_cleanup_job(job);
@@ -287,15 +287,12 @@ static int selphyneo_read_parse(void *vctx, const void **vjob, int data_fd, int
 	job->datalen += sizeof(hdr);
 
 	/* Read in data */
-	while (remain > 0) {
-		i = read(data_fd, job->databuf + job->datalen, remain);
-		if (i < 0) {
-			selphyneo_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		remain -= i;
-		job->datalen += i;
+	i = dyesub_read_full(data_fd, job->databuf + job->datalen, remain);
+	if (i != remain) {
+		selphyneo_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
 	}
+	job->datalen += i;
 
 	*vjob = job;
 
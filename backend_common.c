@@ -26,10 +26,21 @@
 
 #include "backend_common.h"
 #include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <signal.h>
 #include <strings.h>  /* For strncasecmp */
+#include <dirent.h>
+#include <utime.h>
+#ifndef _WIN32
+#include <sys/wait.h>
+#endif
+
+#if defined(USE_PTHREADS)
+#include <pthread.h>
+#endif
 
-#define BACKEND_VERSION "0.123"
+#define BACKEND_VERSION "0.137"
 
 #ifndef CORRTABLE_PATH
 #ifdef PACKAGE_DATA_DIR
@@ -42,6 +53,8 @@
 #define URB_XFER_SIZE  (64*1024)
 #define XFER_TIMEOUT    15000
 
+#define MAX_THREADS     16
+
 #define USB_SUBCLASS_PRINTER 0x1
 #define USB_INTERFACE_PROTOCOL_BIDIR 0x2
 #define USB_INTERFACE_PROTOCOL_IPP   0x4
@@ -58,11 +71,29 @@ int collate = 0;
 int test_mode = 0;
 int quiet = 0;
 int stats_only = 0;
+int max_threads = 0;
 FILE *logger;
 
 const char *corrtable_path = CORRTABLE_PATH;
+const char *cache_path = NULL;
+static size_t outcache_mem = 64;  /* MB */
+static size_t outcache_disk = 0;  /* MB, 0 to disable */
+static int combine_hold = 0;  /* Seconds, 0 to disable */
+static char *hold_uri = NULL;
+static char hold_fname[1024];  /* Set if we left a page for the next job */
+static char hold_parked[1024];  /* Where a page we picked up came from */
+static char hold_claimed[1100]; /* ..and where it is until it's printed */
+static char *pool_serno = NULL;  /* Printer picked from a pool */
+static int pool_level = CUPS_MARKER_UNKNOWN;
 static int max_xfer_size = URB_XFER_SIZE;
 static int xfer_timeout = XFER_TIMEOUT;
+static int stats_interval = 0;  /* Seconds, 0 for a single report */
+static int trace_fd = -1;  /* Binary log of all USB traffic */
+static int status_cache_ms = 5000;  /* 0 to disable */
+static double status_time = -1;
+static struct marker *status_markers = NULL;
+static int status_count = 0;
+static const char *stats_file = NULL;
 
 #ifdef OLD_URI
 static int old_uri = 1;
@@ -228,6 +259,201 @@ char *dict_find(const char *key, int dlen, struct deviceid_dict* dict)
 	return NULL;
 }
 
+/* Job metrics.  Each print job adds its numbers to a per-printer
+   tally in CACHE_PATH, which the resident stats mode reports. */
+#define METRICS_MAGIC   0x444d5344  /* "DSMD" */
+#define METRICS_BUCKETS 6
+
+enum {
+	PHASE_PARSE = 0,
+	PHASE_PRINT,
+	PHASE_JOB,
+	NUM_PHASES,
+};
+
+static const char *metrics_phase[NUM_PHASES] = { "parse", "print", "job" };
+static const int metrics_bound[METRICS_BUCKETS - 1] = { 1, 5, 15, 60, 300 };
+
+struct job_metrics {
+	uint32_t magic;
+	uint32_t jobs;
+	uint32_t job_errors;
+	uint32_t pages;
+	uint32_t usb_errors;
+	uint32_t reserved;
+	uint64_t usb_out;
+	uint64_t usb_in;
+	uint32_t count[NUM_PHASES];
+	uint32_t bucket[NUM_PHASES][METRICS_BUCKETS];
+	double sum[NUM_PHASES];
+};
+
+static struct job_metrics metrics;
+
+static double monotonic_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void metrics_observe(int phase, double start)
+{
+	double secs = monotonic_now() - start;
+	int i;
+
+	for (i = 0 ; i < METRICS_BUCKETS - 1 ; i++) {
+		if (secs <= metrics_bound[i])
+			break;
+	}
+	metrics.bucket[phase][i]++;
+	metrics.count[phase]++;
+	metrics.sum[phase] += secs;
+}
+
+/* Logging */
+#define LOGBUF_SIZE  16384
+#define LOG_BATCH_MS 250
+
+static char logbuf[LOGBUF_SIZE];
+static int loglen = 0;
+static double logtime;  /* When the oldest buffered message came in */
+#if defined(USE_PTHREADS)
+static pthread_mutex_t loglock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Call with loglock held */
+static void log_write(void)
+{
+	FILE *f = logger ? logger : stderr;
+
+	if (loglen) {
+		fwrite(logbuf, 1, loglen, f);
+		fflush(f);
+		loglen = 0;
+	}
+}
+
+static void log_done(int level)
+{
+	if (level >= DYESUB_LOG_INFO ||
+	    (monotonic_now() - logtime) * 1000 >= LOG_BATCH_MS)
+		log_write();
+}
+
+void dyesub_log(int level, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+#if defined(USE_PTHREADS)
+	pthread_mutex_lock(&loglock);
+#endif
+	if (!loglen)
+		logtime = monotonic_now();
+
+	va_start(ap, fmt);
+	len = vsnprintf(logbuf + loglen, LOGBUF_SIZE - loglen, fmt, ap);
+	va_end(ap);
+
+	if (len >= LOGBUF_SIZE - loglen) {
+		/* Didn't fit; make room and try again */
+		log_write();
+		logtime = monotonic_now();
+		va_start(ap, fmt);
+		if (len < LOGBUF_SIZE)
+			len = vsnprintf(logbuf, LOGBUF_SIZE, fmt, ap);
+		else
+			vfprintf(logger ? logger : stderr, fmt, ap);
+		va_end(ap);
+		if (len >= LOGBUF_SIZE)
+			len = 0;
+	}
+	if (len > 0)
+		loglen += len;
+
+	log_done(level);
+#if defined(USE_PTHREADS)
+	pthread_mutex_unlock(&loglock);
+#endif
+}
+
+/* Hex dump, sixteen bytes to a line */
+void dyesub_log_hex(const char *prefix, const uint8_t *buf, int len)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i = 0;
+
+	if (quiet)
+		return;
+
+#if defined(USE_PTHREADS)
+	pthread_mutex_lock(&loglock);
+#endif
+	if (!loglen)
+		logtime = monotonic_now();
+
+	do {
+		char *ptr;
+		int j;
+
+		/* Worst case is "DEBUG: " + prefix + 16 * "xx " + "\n" */
+		if (LOGBUF_SIZE - loglen < 64)
+			log_write();
+
+		ptr = logbuf + loglen;
+		ptr += snprintf(ptr, 16, "DEBUG: %.2s ", i ? "  " : prefix);
+		for (j = 0 ; j < 16 && i < len ; j++, i++) {
+			*ptr++ = hex[buf[i] >> 4];
+			*ptr++ = hex[buf[i] & 0xf];
+			*ptr++ = ' ';
+		}
+		*ptr++ = '\n';
+		loglen = ptr - logbuf;
+	} while (i < len);
+
+	log_done(DYESUB_LOG_DEBUG);
+#if defined(USE_PTHREADS)
+	pthread_mutex_unlock(&loglock);
+#endif
+}
+
+void dyesub_log_flush(void)
+{
+#if defined(USE_PTHREADS)
+	pthread_mutex_lock(&loglock);
+#endif
+	log_write();
+#if defined(USE_PTHREADS)
+	pthread_mutex_unlock(&loglock);
+#endif
+}
+
+/* USB_TRACE: every transfer, as a header followed by the raw data */
+struct usb_trace_hdr {
+	uint64_t usec;     /* Monotonic clock */
+	uint32_t len;
+	uint8_t  endp;     /* USB endpoint; 0x80 set for data from printer */
+	uint8_t  reserved[3];
+} __attribute__((packed));
+
+static void usb_trace(uint8_t endp, const uint8_t *buf, int len)
+{
+	struct usb_trace_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.usec = monotonic_now() * 1000000;
+	hdr.len = len;
+	hdr.endp = endp;
+	if (write(trace_fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(trace_fd, buf, len) != len) {
+		WARNING("Unable to write USB trace, disabling it\n");
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
 /* I/O functions */
 
 int read_data(struct dyesub_connection *conn, uint8_t *buf, int buflen, int *readlen)
@@ -245,29 +471,20 @@ int read_data(struct dyesub_connection *conn, uint8_t *buf, int buflen, int *rea
 
 	if (ret < 0) {
 		ERROR("Failure to receive data from printer (libusb error %d: (%d/%d from 0x%02x))\n", ret, *readlen, buflen, conn->endp_up);
+		metrics.usb_errors++;
 		goto done;
 	}
+	metrics.usb_in += *readlen;
+	if (trace_fd >= 0)
+		usb_trace(conn->endp_up, buf, *readlen);
 
 	if (dyesub_debug) {
 		DEBUG("Received %d bytes from printer\n", *readlen);
 	}
 
 	if ((dyesub_debug > 1 && *readlen < 4096) ||
-	    dyesub_debug > 2) {
-		int i = *readlen;
-
-		DEBUG("<- ");
-		while(i > 0) {
-			if ((*readlen-i) != 0 &&
-			    (*readlen-i) % 16 == 0) {
-				DEBUG2("\n");
-				DEBUG("   ");
-			}
-			DEBUG2("%02x ", buf[*readlen-i]);
-			i--;
-		}
-		DEBUG2("\n");
-	}
+	    dyesub_debug > 2)
+		dyesub_log_hex("<-", buf, *readlen);
 
 done:
 	return ret;
@@ -285,21 +502,8 @@ int send_data(struct dyesub_connection *conn, const uint8_t *buf, int len)
 		int len2 = (len > max_xfer_size) ? max_xfer_size: len;
 
 		if ((dyesub_debug > 1 && len2 < 4096) ||
-		    dyesub_debug > 2) {
-			int i = len2;
-
-			DEBUG("-> ");
-			while(i > 0) {
-				if ((len2-i) != 0 &&
-				    (len2-i) % 16 == 0) {
-					DEBUG2("\n");
-					DEBUG("   ");
-				}
-				DEBUG2("%02x ", buf[len2-i]);
-				i--;
-			}
-			DEBUG2("\n");
-		}
+		    dyesub_debug > 2)
+			dyesub_log_hex("->", buf, len2);
 
 		int ret = libusb_bulk_transfer(conn->dev, conn->endp_down,
 					       (uint8_t*) buf, len2,
@@ -307,8 +511,12 @@ int send_data(struct dyesub_connection *conn, const uint8_t *buf, int len)
 
 		if (ret < 0) {
 			ERROR("Failure to send data to printer (libusb error %d: (%d/%d to 0x%02x))\n", ret, num, len2, conn->endp_down);
+			metrics.usb_errors++;
 			return ret;
 		}
+		metrics.usb_out += num;
+		if (trace_fd >= 0)
+			usb_trace(conn->endp_down, buf, num);
 		len -= num;
 		buf += num;
 	}
@@ -316,6 +524,38 @@ int send_data(struct dyesub_connection *conn, const uint8_t *buf, int len)
 	return CUPS_BACKEND_OK;
 }
 
+/* Send a scatter-gather list, without first gathering it into one buffer */
+int send_seglist(struct dyesub_connection *conn, const struct dyesub_seglist *list)
+{
+	static uint8_t fillbuf[16384];
+	static int last_fill = -1;
+	int i, ret;
+
+	for (i = 0 ; i < list->num ; i++) {
+		const struct dyesub_seg *seg = &list->seg[i];
+		uint32_t len = seg->len;
+
+		if (seg->data) {
+			if ((ret = send_data(conn, seg->data, len)))
+				return ret;
+			continue;
+		}
+
+		if (last_fill != seg->fill) {
+			memset(fillbuf, seg->fill, sizeof(fillbuf));
+			last_fill = seg->fill;
+		}
+		while (len) {
+			uint32_t chunk = (len > sizeof(fillbuf)) ? sizeof(fillbuf) : len;
+			if ((ret = send_data(conn, fillbuf, chunk)))
+				return ret;
+			len -= chunk;
+		}
+	}
+
+	return CUPS_BACKEND_OK;
+}
+
 /* More stuff */
 #ifndef _WIN32
 static void sigterm_handler(int signum) {
@@ -401,6 +641,65 @@ static char *url_decode(char *str) {
 
 /* And now back to our regularly-scheduled programming */
 
+/* Finding a printer's serial number means opening it and talking to it,
+   which is slow and can disturb a printer that's in the middle of a job.
+   So remember what we found, keyed by where the device sits on the bus.
+   A device gets a new address every time it is (re)attached, so hotplug
+   events invalidate entries on their own. */
+static int usbmap_bypass = 0;
+
+static void usbmap_key(struct libusb_device *device,
+		       const struct libusb_device_descriptor *desc,
+		       char *key, int len)
+{
+	snprintf(key, len, "usb-%03d-%03d-%04x-%04x.serial",
+		 libusb_get_bus_number(device),
+		 libusb_get_device_address(device),
+		 desc->idVendor, desc->idProduct);
+}
+
+/* Returns a malloc()'d serial number, or NULL if we don't know it */
+static char *usbmap_lookup(struct libusb_device *device,
+			   const struct libusb_device_descriptor *desc)
+{
+	char key[64];
+	char *serial;
+	int len = 0;
+
+	if (usbmap_bypass)
+		return NULL;
+
+	usbmap_key(device, desc, key, sizeof(key));
+	serial = dyesub_cache_load(key, 1, &len);
+	if (serial)
+		serial[len] = 0;
+
+	return serial;
+}
+
+static void usbmap_store(struct libusb_device *device,
+			 const struct libusb_device_descriptor *desc,
+			 const char *serial)
+{
+	char key[64];
+	char *old;
+	int len = 0;
+
+	usbmap_key(device, desc, key, sizeof(key));
+	old = dyesub_cache_load(key, 1, &len);
+	if (old)
+		old[len] = 0;
+	if (!old || strcmp(old, serial))
+		dyesub_cache_store(key, serial, strlen(serial));
+	free(old);
+}
+
+#if defined(USE_PTHREADS)
+/* The backends' serial number queries were never written to run
+   concurrently, so only one of them runs at a time. */
+static pthread_mutex_t probe_serno_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static int probe_device(struct libusb_device *device,
 			struct libusb_device_descriptor *desc,
 			const char *make,
@@ -408,7 +707,8 @@ static int probe_device(struct libusb_device *device,
 			int found, int num_claim_attempts,
 			int scan_only, const char *match_serno,
 			struct dyesub_connection *conn,
-			struct dyesub_backend *backend)
+			struct dyesub_backend *backend,
+			FILE *out)
 {
 	struct libusb_device_handle *dev;
 	char buf[256];
@@ -638,7 +938,13 @@ skip_manuf_model:
 		c2.altset = altset;
 		c2.endp_up = endp_up;
 		c2.endp_down = endp_down;
+#if defined(USE_PTHREADS)
+		pthread_mutex_lock(&probe_serno_lock);
+#endif
 		backend->query_serno(&c2, buf, STR_LEN_MAX);
+#if defined(USE_PTHREADS)
+		pthread_mutex_unlock(&probe_serno_lock);
+#endif
 		serial = url_encode(buf);
 	}
 
@@ -649,11 +955,13 @@ skip_manuf_model:
 		WARNING("**** If you intend to use multiple printers of this type, you\n");
 		WARNING("**** must only plug one in at a time or unexpected behavior will occur!\n");
 		serial = strdup("NONE_UNKNOWN");
+	} else {
+		usbmap_store(device, desc, serial);
 	}
 
 	if (scan_only) {
 		if (!old_uri) {
-			fprintf(stdout, "direct %s://%s/%s \"%s\" \"%s\" \"%s\" \"\"\n",
+			fprintf(out, "direct %s://%s/%s \"%s\" \"%s\" \"%s\" \"\"\n",
 				uri_prefix, make, serial,
 				descr, descr,
 				ieee_id ? ieee_id : "");
@@ -668,7 +976,7 @@ skip_manuf_model:
 
 			strncpy(buf + k, product, sizeof(buf)-k);
 
-			fprintf(stdout, "direct %s://%s?serial=%s&backend=%s \"%s\" \"%s\" \"%s\" \"\"\n",
+			fprintf(out, "direct %s://%s?serial=%s&backend=%s \"%s\" \"%s\" \"%s\" \"\"\n",
 				uri_prefix, buf, serial, make,
 				descr, descr,
 				ieee_id? ieee_id : "");
@@ -774,6 +1082,205 @@ static struct dyesub_backend *backends[] = {
 	NULL,
 };
 
+/* Scanning probes every attached printer, and each one can take several
+   seconds to respond, so probe them all at once.  Output is collected
+   per device and printed in enumeration order.  A printer that hasn't
+   answered within PROBE_TIMEOUT seconds is left behind, so one wedged
+   device can't hold up the rest of the scan. */
+#define MAX_PROBE_THREADS 8
+#define PROBE_TIMEOUT     30  /* Seconds */
+
+static int probe_timeout = PROBE_TIMEOUT;
+static int probe_abandoned = 0;  /* A probe may still be using libusb */
+
+struct probe_job {
+	struct libusb_device *device;
+	struct libusb_device_descriptor desc;
+	const char *make;
+	const char *manuf_str;
+	struct dyesub_backend *backend;
+	int found;
+	char *out;
+	size_t outlen;
+	double start;    /* 0 until a worker picks it up */
+	int done;
+	int abandoned;
+};
+
+struct probe_pool {
+	struct probe_job *jobs;
+	int num;
+	int next;
+	int running;     /* Worker threads */
+	int stuck;       /* ..of which are on an abandoned probe */
+	const char *argv0;
+	int num_claim_attempts;
+#if defined(USE_PTHREADS)
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+static void probe_run(struct probe_pool *pool, struct probe_job *job)
+{
+	FILE *out = NULL;
+	int found;
+
+#ifndef _WIN32
+	out = open_memstream(&job->out, &job->outlen);
+#endif
+	found = probe_device(job->device, &job->desc, job->make,
+			     pool->argv0, job->manuf_str,
+			     job->found, pool->num_claim_attempts,
+			     1, NULL, NULL, job->backend,
+			     out ? out : stdout);
+	if (out)
+		fclose(out);
+
+#if defined(USE_PTHREADS)
+	pthread_mutex_lock(&pool->lock);
+#endif
+	job->found = found;
+	job->done = 1;
+#if defined(USE_PTHREADS)
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+#if defined(USE_PTHREADS)
+static void *probe_thread(void *vpool)
+{
+	struct probe_pool *pool = vpool;
+
+	while (1) {
+		int i;
+
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		if (i < pool->num) {
+			pool->jobs[i].start = monotonic_now();
+		} else {
+			pool->running--;
+			pthread_cond_signal(&pool->cond);
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= pool->num)
+			break;
+
+		probe_run(pool, &pool->jobs[i]);
+	}
+
+	return NULL;
+}
+
+/* Called with the pool locked */
+static int probe_spawn(struct probe_pool *pool)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, probe_thread, pool);
+	pthread_attr_destroy(&attr);
+	if (!ret)
+		pool->running++;
+
+	return ret;
+}
+#endif
+
+/* Returns the result of the last probe.  If any probe had to be
+   abandoned, its worker still owns 'pool', and so it must not be freed. */
+static int probe_all(struct probe_pool *pool)
+{
+	int i, found = -1;
+#if defined(USE_PTHREADS)
+	int num = pool->num;
+
+	if (num > MAX_PROBE_THREADS)
+		num = MAX_PROBE_THREADS;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0 ; i < num ; i++) {
+		if (probe_spawn(pool))
+			break;
+	}
+
+	while (1) {
+		double now = monotonic_now();
+		int pending = 0;
+		struct timespec ts;
+
+		for (i = 0 ; i < pool->num ; i++) {
+			struct probe_job *job = &pool->jobs[i];
+
+			if (job->done || job->abandoned)
+				continue;
+			if (job->start && probe_timeout > 0 &&
+			    now - job->start > probe_timeout) {
+				WARNING("No response from %04x:%04x after %d seconds, skipping it\n",
+					job->desc.idVendor, job->desc.idProduct, probe_timeout);
+				job->abandoned = 1;
+				pool->stuck++;
+				probe_abandoned = 1;
+				/* Its worker is stuck, so start another */
+				if (pool->next < pool->num)
+					probe_spawn(pool);
+				continue;
+			}
+			pending++;
+		}
+
+		if (!pending && pool->running <= pool->stuck)
+			break;
+
+		/* No workers at all?  Do the rest ourselves. */
+		if (pool->running <= pool->stuck && pool->next < pool->num) {
+			pool->running++;
+			pthread_mutex_unlock(&pool->lock);
+			probe_thread(pool);
+			pthread_mutex_lock(&pool->lock);
+			continue;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 250 * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&pool->cond, &pool->lock, &ts);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!pool->stuck) {
+		pthread_cond_destroy(&pool->cond);
+		pthread_mutex_destroy(&pool->lock);
+	}
+#else
+	for (i = 0 ; i < pool->num ; i++)
+		probe_run(pool, &pool->jobs[i]);
+#endif
+
+	for (i = 0 ; i < pool->num ; i++) {
+		if (pool->jobs[i].abandoned)
+			continue;
+		if (pool->jobs[i].out) {
+			fwrite(pool->jobs[i].out, 1, pool->jobs[i].outlen, stdout);
+			free(pool->jobs[i].out);
+		}
+		found = pool->jobs[i].found;
+	}
+
+	return found;
+}
+
 static int find_and_enumerate(const char *argv0,
 			      struct libusb_device ***list,
 			      const struct dyesub_backend *backend,
@@ -785,6 +1292,8 @@ static int find_and_enumerate(const char *argv0,
 	int num;
 	int i, j = 0, k;
 	int found = -1;
+	int skipped = 0;
+	struct probe_pool *pool = NULL;
 
 	if (test_mode >= TEST_MODE_NOATTACH && conn) {
 		found = 1;
@@ -800,6 +1309,20 @@ static int find_and_enumerate(const char *argv0,
 	/* Enumerate and find suitable device */
 	num = libusb_get_device_list(NULL, list);
 
+	if (scan_only && num > 0) {
+		pool = calloc(1, sizeof(*pool));
+		if (pool)
+			pool->jobs = malloc(num * sizeof(*pool->jobs));
+		if (pool && !pool->jobs) {
+			free(pool);
+			pool = NULL;
+		}
+	}
+	if (pool) {
+		pool->argv0 = argv0;
+		pool->num_claim_attempts = num_claim_attempts;
+	}
+
 	/* See if we can actually match on the supplied make! */
 	if (backend && make) {
 		int match = 0;
@@ -856,18 +1379,67 @@ static int find_and_enumerate(const char *argv0,
 		continue;
 
 	match:
+		/* Leave printers we already know aren't the one we want alone */
+		if (match_serno && !scan_only) {
+			char *serial = usbmap_lookup((*list)[i], &desc);
+			if (serial && strcmp(serial, match_serno)) {
+				DEBUG("Skipping %04X/%04X, cached serial '%s'\n",
+				      desc.idVendor, desc.idProduct, serial);
+				free(serial);
+				found = -1;
+				skipped++;
+				continue;
+			}
+			free(serial);
+		}
+
+		/* Scans get done in bulk afterwards */
+		if (pool) {
+			struct probe_job *job = &pool->jobs[pool->num++];
+			memset(job, 0, sizeof(*job));
+			job->device = (*list)[i];
+			job->desc = desc;
+			job->make = foundmake ? foundmake : make;
+			job->manuf_str = backends[k]->devices[j].manuf_str;
+			job->backend = backends[k];
+			job->found = found;
+			foundmake = NULL;
+			continue;
+		}
+
 		found = probe_device((*list)[i], &desc, (foundmake ? foundmake : make),
 				     argv0, backends[k]->devices[j].manuf_str,
 				     found, num_claim_attempts,
 				     scan_only, match_serno,
 				     conn,
-				     backends[k]);
+				     backends[k], stdout);
 		foundmake = NULL;
 		if (found != -1 && !scan_only)
 			break;
 	}
 
+	if (pool) {
+		if (pool->num)
+			found = probe_all(pool);
+		if (!pool->stuck) {
+			free(pool->jobs);
+			free(pool);
+		}
+	}
+
 	STATE("-org.gutenprint.searching-for-device\n");
+
+	/* If we came up empty, the cache may be wrong; try the hard way */
+	if (found == -1 && skipped) {
+		DEBUG("Cached device map may be stale, probing everything\n");
+		libusb_free_device_list(*list, 1);
+		*list = NULL;
+		usbmap_bypass = 1;
+		found = find_and_enumerate(argv0, list, backend, match_serno, make,
+					   scan_only, num_claim_attempts, conn);
+		usbmap_bypass = 0;
+	}
+
 	return found;
 }
 
@@ -897,63 +1469,497 @@ static struct dyesub_backend *find_backend(const char *uri_prefix)
 	return NULL;
 }
 
-static int query_markers(const struct dyesub_backend *backend, void *ctx, int full)
+static int dyesub_cache_fname(const char *key, char *fname, int len);
+
+/* Printer pools.  A serial number of the form "SN1,SN2,..." sends each
+   job to one of those printers.  With FAST_RETURN, this lets a single
+   queue keep several identical printers going at once.
+
+   Picking one must not disturb a printer that's busy with another job,
+   so nothing gets opened or claimed here.  Which printers are attached
+   comes from the cached USB map, and whether one is in use, and how much
+   media it had left, from the state each job leaves behind. */
+static void pool_note(const char *serno, int level, int busy)
 {
-	struct marker *markers = NULL;
-	int marker_count = 0;
-	int ret;
+	char key[128], buf[64];
+	int len;
 
-	if (!backend->query_markers)
-		return CUPS_BACKEND_OK;
+	snprintf(key, sizeof(key), "pool-%s.state", serno);
+	len = snprintf(buf, sizeof(buf), "%d %d %lld\n", level,
+		       busy ? (int)getpid() : 0, (long long)time(NULL));
+	dyesub_cache_store(key, buf, len);
+}
 
-	if (test_mode >= TEST_MODE_NOATTACH)
-		return CUPS_BACKEND_OK;
+/* Is 'serno' attached, going by the USB map?  1 yes, 0 no, -1 if
+   there's a printer attached that isn't in the map yet */
+static int pool_attached(const struct dyesub_backend *backend,
+			 struct libusb_device **devs, int num,
+			 const char *serno)
+{
+	int i, j, unknown = 0;
 
-	ret = backend->query_markers(ctx, &markers, &marker_count);
-	if (ret)
-		return ret;
+	if (test_mode >= TEST_MODE_NOATTACH)
+		return 1;
 
-	dump_markers(markers, marker_count, full);
+	for (i = 0 ; i < num ; i++) {
+		struct libusb_device_descriptor desc;
+		char *serial;
+
+		libusb_get_device_descriptor(devs[i], &desc);
+		serial = usbmap_lookup(devs[i], &desc);
+		if (!serial) {
+			for (j = 0 ; backend && backend->devices[j].vid ; j++) {
+				if (desc.idVendor == backend->devices[j].vid &&
+				    desc.idProduct == backend->devices[j].pid)
+					unknown = 1;
+			}
+			continue;
+		}
+		if (!strcmp(serial, serno)) {
+			free(serial);
+			return 1;
+		}
+		free(serial);
+	}
 
-	return CUPS_BACKEND_OK;
+	return unknown ? -1 : 0;
 }
 
-static void dump_stats(struct dyesub_backend *backend, struct printerstats *stats, int json)
+static char *pool_select(const char *argv0, const struct dyesub_backend *backend,
+			 const char *pool, const char *make)
 {
-	int i;
-	struct tm *tm;
-	char tmbuf[64];
-	tm = localtime(&stats->timestamp);
+	char *list = strdup(pool), *serno, *save = NULL;
+	struct libusb_device **devs = NULL;
+	char *best = NULL;
+	int best_level = CUPS_MARKER_UNKNOWN;
+	int best_busy = 0;
+	long long best_since = 0;
+	int num;
 
-	strftime(tmbuf, sizeof(tmbuf), "%Y-%m-%d %H:%M:%S", tm);
+	if (!list)
+		return NULL;
 
-	if (json) {
-		fprintf(stdout, "{\n");
-		fprintf(stdout, "\t\"backend\": \"%s\",\n", backend->name);
-		fprintf(stdout, "\t\"version\": \"%s / %s\",\n", BACKEND_VERSION, backend->version);
-		fprintf(stdout, "\t\"timestamp\": \"%s\",\n", tmbuf);
-		if (stats->mfg)
-			fprintf(stdout, "\t\"manufacturer\": \"%s\",\n", stats->mfg);
-		if (stats->model)
-			fprintf(stdout, "\t\"model\": \"%s\",\n", stats->model);
-		if (stats->serial)
-			fprintf(stdout, "\t\"serial\": \"%s\",\n", stats->serial);
-		if (stats->fwver)
-			fprintf(stdout, "\t\"firmware\": \"%s\",\n", stats->fwver);
+	num = libusb_get_device_list(NULL, &devs);
 
-		fprintf(stdout, "\t\"decks\": {\n");
-		for (i = 0 ; i < stats->decks ; i++) {
-			fprintf(stdout, "\t\t\"%s\": {\n", stats->name[i]);
-			if (stats->status[i])
-				fprintf(stdout, "\t\t\t\"status\": \"%s\",\n", stats->status[i]);
-			fprintf(stdout, "\t\t\t\"mediatype\": \"%s\",\n", stats->mediatype[i]);
-			switch (stats->levelnow[i]) {
-			case CUPS_MARKER_UNKNOWN:
-				fprintf(stdout, "\t\t\t\"medialevel\": \"Unknown\",\n");
-				break;
-			case CUPS_MARKER_UNAVAILABLE:
-				fprintf(stdout, "\t\t\t\"medialevel\": \"Unavailable\",\n");
-				break;
+	for (serno = strtok_r(list, ",", &save) ; serno ;
+	     serno = strtok_r(NULL, ",", &save)) {
+		long long since = 0;
+		int level = CUPS_MARKER_UNKNOWN;
+		int pid = 0, busy = 0;
+		int len = 0;
+		char key[128];
+		char *state;
+
+		switch (pool_attached(backend, devs, num, serno)) {
+		case 0:
+			DEBUG("Pool printer '%s' is not attached\n", serno);
+			continue;
+		case -1: {
+			/* Not in the map yet, so we have to look.  Probing it
+			   adds it to the map, so this only happens once. */
+			struct libusb_device **devs2 = NULL;
+			struct dyesub_connection conn;
+			int found = find_and_enumerate(argv0, &devs2, backend, serno, make,
+						       0, 1, &conn);
+			if (devs2)
+				libusb_free_device_list(devs2, 1);
+			if (found == -1) {
+				DEBUG("Pool printer '%s' is not available\n", serno);
+				continue;
+			}
+			break;
+		}
+		default:
+			break;
+		}
+
+		snprintf(key, sizeof(key), "pool-%s.state", serno);
+		state = dyesub_cache_load(key, 1, &len);
+		if (state) {
+			state[len] = 0;
+			sscanf(state, "%d %d %lld", &level, &pid, &since);
+			free(state);
+		}
+#ifndef _WIN32
+		/* Still being printed to by another backend? */
+		if (pid > 0 && pid != (int)getpid() &&
+		    (!kill(pid, 0) || errno == EPERM))
+			busy = 1;
+#endif
+		DEBUG("Pool printer '%s' media %d %s since %lld\n",
+		      serno, level, busy ? "busy" : "idle", since);
+
+		if (best) {
+			/* Out of media goes to the back of the line.. */
+			if ((level == 0) != (best_level == 0)) {
+				if (level == 0)
+					continue;
+			/* ..behind printers that are busy elsewhere.. */
+			} else if (busy != best_busy) {
+				if (busy)
+					continue;
+			/* ..then whichever has been idle longest, or if they're
+			   all busy, whichever started its job first and so
+			   should be the first to come free. */
+			} else if (since >= best_since) {
+				continue;
+			}
+		}
+		best = serno;
+		best_level = level;
+		best_busy = busy;
+		best_since = since;
+	}
+
+	if (devs)
+		libusb_free_device_list(devs, 1);
+
+	if (best) {
+		if (best_busy)
+			INFO("All printers in pool are busy, waiting for '%s'\n", best);
+		else
+			INFO("Using printer '%s' from pool\n", best);
+		best = strdup(best);
+		/* Mark it as in use right away, for the next job */
+		if (best)
+			pool_note(best, best_level, 1);
+	}
+	free(list);
+
+	return best;
+}
+
+/* Fold this job's metrics into the printer's running tally */
+static void metrics_save(const char *serno, int ret)
+{
+	struct job_metrics *old;
+	char key[128];
+	int len = 0, i, j;
+
+	if (!serno || !*serno)
+		return;
+
+	metrics.jobs++;
+	if (ret != CUPS_BACKEND_OK)
+		metrics.job_errors++;
+
+	snprintf(key, sizeof(key), "metrics-%s.state", serno);
+	old = dyesub_cache_load(key, 0, &len);
+	if (old && len == sizeof(*old) && old->magic == METRICS_MAGIC) {
+		metrics.jobs += old->jobs;
+		metrics.job_errors += old->job_errors;
+		metrics.pages += old->pages;
+		metrics.usb_errors += old->usb_errors;
+		metrics.usb_out += old->usb_out;
+		metrics.usb_in += old->usb_in;
+		for (i = 0 ; i < NUM_PHASES ; i++) {
+			metrics.count[i] += old->count[i];
+			metrics.sum[i] += old->sum[i];
+			for (j = 0 ; j < METRICS_BUCKETS ; j++)
+				metrics.bucket[i][j] += old->bucket[i][j];
+		}
+	}
+	free(old);
+
+	metrics.magic = METRICS_MAGIC;
+	dyesub_cache_store(key, &metrics, sizeof(metrics));
+}
+
+/* Prometheus label values need quotes, backslashes and newlines escaped */
+static void metrics_escape(char *dst, int len, const char *src)
+{
+	int i = 0;
+
+	for ( ; src && *src && i < len - 3 ; src++) {
+		if (*src == '"' || *src == '\\') {
+			dst[i++] = '\\';
+			dst[i++] = *src;
+		} else if (*src == '\n') {
+			dst[i++] = '\\';
+			dst[i++] = 'n';
+		} else {
+			dst[i++] = *src;
+		}
+	}
+	dst[i] = 0;
+}
+
+static void metrics_dump(FILE *f, const struct dyesub_backend *backend,
+			 const char *serno, const struct printerstats *stats,
+			 int up, int busy, uint32_t polls, uint32_t poll_errors)
+{
+	char lbl[256], val[128], deck[64], media[64];
+	struct job_metrics *jm;
+	char key[128];
+	int len = 0, i, j;
+
+	metrics_escape(val, sizeof(val), serno ? serno : "");
+	snprintf(lbl, sizeof(lbl), "serial=\"%s\",backend=\"%s\"",
+		 val, backend->name);
+
+	fprintf(f, "# TYPE dyesub_up gauge\n");
+	fprintf(f, "dyesub_up{%s} %d\n", lbl, up);
+	fprintf(f, "# TYPE dyesub_busy gauge\n");
+	fprintf(f, "dyesub_busy{%s} %d\n", lbl, busy);
+	fprintf(f, "# TYPE dyesub_polls_total counter\n");
+	fprintf(f, "dyesub_polls_total{%s} %u\n", lbl, polls);
+	fprintf(f, "# TYPE dyesub_poll_errors_total counter\n");
+	fprintf(f, "dyesub_poll_errors_total{%s} %u\n", lbl, poll_errors);
+
+	if (stats) {
+		fprintf(f, "# TYPE dyesub_prints_total counter\n");
+		for (i = 0 ; i < stats->decks ; i++) {
+			if (stats->cnt_life[i] < 0)
+				continue;
+			metrics_escape(deck, sizeof(deck), stats->name[i]);
+			fprintf(f, "dyesub_prints_total{%s,deck=\"%s\"} %d\n",
+				lbl, deck, stats->cnt_life[i]);
+		}
+		fprintf(f, "# TYPE dyesub_media_remaining gauge\n");
+		for (i = 0 ; i < stats->decks ; i++) {
+			if (stats->levelnow[i] < 0)
+				continue;
+			metrics_escape(deck, sizeof(deck), stats->name[i]);
+			metrics_escape(media, sizeof(media), stats->mediatype[i]);
+			fprintf(f, "dyesub_media_remaining{%s,deck=\"%s\",media=\"%s\"} %d\n",
+				lbl, deck, media, stats->levelnow[i]);
+		}
+		fprintf(f, "# TYPE dyesub_media_capacity gauge\n");
+		for (i = 0 ; i < stats->decks ; i++) {
+			if (stats->levelmax[i] <= 0)
+				continue;
+			metrics_escape(deck, sizeof(deck), stats->name[i]);
+			metrics_escape(media, sizeof(media), stats->mediatype[i]);
+			fprintf(f, "dyesub_media_capacity{%s,deck=\"%s\",media=\"%s\"} %d\n",
+				lbl, deck, media, stats->levelmax[i]);
+		}
+	}
+
+	/* And whatever the print jobs have recorded */
+	if (!serno || !*serno)
+		return;
+	snprintf(key, sizeof(key), "metrics-%s.state", serno);
+	jm = dyesub_cache_load(key, 0, &len);
+	if (!jm || len != sizeof(*jm) || jm->magic != METRICS_MAGIC) {
+		free(jm);
+		return;
+	}
+
+	fprintf(f, "# TYPE dyesub_jobs_total counter\n");
+	fprintf(f, "dyesub_jobs_total{%s} %u\n", lbl, jm->jobs);
+	fprintf(f, "# TYPE dyesub_job_errors_total counter\n");
+	fprintf(f, "dyesub_job_errors_total{%s} %u\n", lbl, jm->job_errors);
+	fprintf(f, "# TYPE dyesub_pages_total counter\n");
+	fprintf(f, "dyesub_pages_total{%s} %u\n", lbl, jm->pages);
+	fprintf(f, "# TYPE dyesub_usb_bytes_total counter\n");
+	fprintf(f, "dyesub_usb_bytes_total{%s,direction=\"out\"} %llu\n",
+		lbl, (unsigned long long)jm->usb_out);
+	fprintf(f, "dyesub_usb_bytes_total{%s,direction=\"in\"} %llu\n",
+		lbl, (unsigned long long)jm->usb_in);
+	fprintf(f, "# TYPE dyesub_usb_errors_total counter\n");
+	fprintf(f, "dyesub_usb_errors_total{%s} %u\n", lbl, jm->usb_errors);
+
+	fprintf(f, "# TYPE dyesub_phase_seconds histogram\n");
+	for (i = 0 ; i < NUM_PHASES ; i++) {
+		uint32_t total = 0;
+		for (j = 0 ; j < METRICS_BUCKETS ; j++) {
+			total += jm->bucket[i][j];
+			if (j < METRICS_BUCKETS - 1)
+				fprintf(f, "dyesub_phase_seconds_bucket{%s,phase=\"%s\",le=\"%d\"} %u\n",
+					lbl, metrics_phase[i], metrics_bound[j], total);
+			else
+				fprintf(f, "dyesub_phase_seconds_bucket{%s,phase=\"%s\",le=\"+Inf\"} %u\n",
+					lbl, metrics_phase[i], total);
+		}
+		fprintf(f, "dyesub_phase_seconds_sum{%s,phase=\"%s\"} %.3f\n",
+			lbl, metrics_phase[i], jm->sum[i]);
+		fprintf(f, "dyesub_phase_seconds_count{%s,phase=\"%s\"} %u\n",
+			lbl, metrics_phase[i], jm->count[i]);
+	}
+	free(jm);
+}
+
+static void stats_release(struct printerstats *stats)
+{
+	int i;
+
+	for (i = 0 ; i < stats->decks ; i++) {
+		free(stats->status[i]); // the only dynamic member..
+		stats->status[i] = NULL;
+	}
+}
+
+/* Resident stats mode: stay attached and report every STATS_INTERVAL
+   seconds.  The interface is only claimed for the duration of each poll,
+   and if a print job has the printer we skip that poll entirely. */
+static int stats_export(const struct dyesub_backend *backend, void *ctx,
+			struct dyesub_connection *conn, const char *serno)
+{
+	struct printerstats last;
+	uint32_t polls = 0, poll_errors = 0;
+	int claimed = 1, have = 0;
+
+	memset(&last, 0, sizeof(last));
+
+#ifndef _WIN32
+	signal(SIGTERM, sigterm_handler);
+#endif
+
+	while (!terminate) {
+		struct printerstats stats;
+		int busy = 0, ret = CUPS_BACKEND_OK;
+		FILE *f = stdout;
+		char tmpname[1040];
+
+		if (!claimed && test_mode < TEST_MODE_NOATTACH) {
+			if (libusb_claim_interface(conn->dev, conn->iface) ||
+			    (conn->altset &&
+			     libusb_set_interface_alt_setting(conn->dev, conn->iface, conn->altset)))
+				busy = 1;
+			else
+				claimed = 1;
+		}
+
+		if (!busy) {
+			memset(&stats, 0, sizeof(stats));
+			stats.timestamp = time(NULL);
+			polls++;
+			ret = backend->query_stats(ctx, &stats);
+			if (ret) {
+				poll_errors++;
+				stats_release(&stats);
+			} else {
+				stats_release(&last);
+				last = stats;
+				have = 1;
+			}
+		}
+
+		if (claimed && test_mode < TEST_MODE_NOATTACH) {
+			libusb_release_interface(conn->dev, conn->iface);
+			claimed = 0;
+		}
+
+		if (!serno && have)
+			serno = last.serial;
+
+		/* Write to a temporary file so collectors never see a partial one */
+		if (stats_file) {
+			snprintf(tmpname, sizeof(tmpname), "%s.%d", stats_file, (int)getpid());
+			f = fopen(tmpname, "w");
+			if (!f) {
+				ERROR("Unable to create '%s'\n", tmpname);
+				stats_release(&last);
+				return CUPS_BACKEND_FAILED;
+			}
+		}
+		metrics_dump(f, backend, serno, have ? &last : NULL,
+			     !busy && !ret, busy, polls, poll_errors);
+		if (stats_file) {
+			if (fclose(f) || rename(tmpname, stats_file)) {
+				WARNING("Unable to write '%s'\n", stats_file);
+				unlink(tmpname);
+			}
+		} else {
+			fprintf(f, "\n");
+			fflush(f);
+		}
+
+		sleep(stats_interval);
+	}
+
+	stats_release(&last);
+
+	return CUPS_BACKEND_OK;
+}
+
+/* Status cache.  Backends call this whenever a status read (typically
+   in main_loop) has brought their markers up to date, so the next
+   query_markers() can skip asking the printer again if it comes within
+   STATUS_CACHE_MS.  Each refresh is only good for one report. */
+void dyesub_status_touch(void)
+{
+	status_time = monotonic_now();
+}
+
+static int query_markers(const struct dyesub_backend *backend, void *ctx, int full)
+{
+	struct marker *markers = NULL;
+	int marker_count = 0;
+	int ret;
+
+	if (!backend->query_markers)
+		return CUPS_BACKEND_OK;
+
+	if (test_mode >= TEST_MODE_NOATTACH)
+		return CUPS_BACKEND_OK;
+
+	if (status_markers && status_time >= 0 &&
+	    (monotonic_now() - status_time) * 1000 < status_cache_ms) {
+		DEBUG("Using cached printer status\n");
+		markers = status_markers;
+		marker_count = status_count;
+	} else {
+		ret = backend->query_markers(ctx, &markers, &marker_count);
+		if (ret)
+			return ret;
+		status_markers = markers;
+		status_count = marker_count;
+	}
+	/* Refreshes that happened as part of this report don't count */
+	status_time = -1;
+
+	dump_markers(markers, marker_count, full);
+
+	/* Remember how much media a pooled printer has left */
+	if (pool_serno) {
+		int i;
+		pool_level = CUPS_MARKER_UNKNOWN;
+		for (i = 0 ; i < marker_count ; i++) {
+			if (markers[i].levelnow > pool_level)
+				pool_level = markers[i].levelnow;
+		}
+	}
+
+	return CUPS_BACKEND_OK;
+}
+
+static void dump_stats(struct dyesub_backend *backend, struct printerstats *stats, int json)
+{
+	int i;
+	struct tm *tm;
+	char tmbuf[64];
+	tm = localtime(&stats->timestamp);
+
+	strftime(tmbuf, sizeof(tmbuf), "%Y-%m-%d %H:%M:%S", tm);
+
+	if (json) {
+		fprintf(stdout, "{\n");
+		fprintf(stdout, "\t\"backend\": \"%s\",\n", backend->name);
+		fprintf(stdout, "\t\"version\": \"%s / %s\",\n", BACKEND_VERSION, backend->version);
+		fprintf(stdout, "\t\"timestamp\": \"%s\",\n", tmbuf);
+		if (stats->mfg)
+			fprintf(stdout, "\t\"manufacturer\": \"%s\",\n", stats->mfg);
+		if (stats->model)
+			fprintf(stdout, "\t\"model\": \"%s\",\n", stats->model);
+		if (stats->serial)
+			fprintf(stdout, "\t\"serial\": \"%s\",\n", stats->serial);
+		if (stats->fwver)
+			fprintf(stdout, "\t\"firmware\": \"%s\",\n", stats->fwver);
+
+		fprintf(stdout, "\t\"decks\": {\n");
+		for (i = 0 ; i < stats->decks ; i++) {
+			fprintf(stdout, "\t\t\"%s\": {\n", stats->name[i]);
+			if (stats->status[i])
+				fprintf(stdout, "\t\t\t\"status\": \"%s\",\n", stats->status[i]);
+			fprintf(stdout, "\t\t\t\"mediatype\": \"%s\",\n", stats->mediatype[i]);
+			switch (stats->levelnow[i]) {
+			case CUPS_MARKER_UNKNOWN:
+				fprintf(stdout, "\t\t\t\"medialevel\": \"Unknown\",\n");
+				break;
+			case CUPS_MARKER_UNAVAILABLE:
+				fprintf(stdout, "\t\t\t\"medialevel\": \"Unavailable\",\n");
+				break;
 			case CUPS_MARKER_UNKNOWN_OK:
 				fprintf(stdout, "\t\t\t\"medialevel\": \"OK\",\n");
 				break;
@@ -1026,6 +2032,7 @@ for more details.\n\
 You should have received a copy of the GNU General Public License\n\
 along with this program; if not, see <https://www.gnu.org/licenses/>.\n\n";
 
+	dyesub_log_flush();
 	fprintf(logger, "%s", license);
 }
 
@@ -1045,7 +2052,7 @@ void print_help(const char *argv0, const struct dyesub_backend *backend)
 	if (!backend) {
 		int i;
 		DEBUG("Environment variables:\n");
-		DEBUG(" DYESUB_DEBUG EXTRA_PID EXTRA_VID EXTRA_TYPE BACKEND SERIAL OLD_URI_SCHEME BACKEND_QUIET\n");
+		DEBUG(" DYESUB_DEBUG EXTRA_PID EXTRA_VID EXTRA_TYPE BACKEND SERIAL OLD_URI_SCHEME BACKEND_QUIET MAX_THREADS PROBE_TIMEOUT\n");
 		DEBUG("CUPS Usage:\n");
 		DEBUG("\tDEVICE_URI=someuri %s job user title num-copies options [ filename ]\n", ptr);
 		DEBUG("\n");
@@ -1134,6 +2141,446 @@ static int parse_cmdstream(struct dyesub_backend *backend, void *backend_ctx, in
 	return CUPS_BACKEND_OK;
 }
 
+/* Spool input buffering */
+#define DYESUB_READER_LEN (256*1024)
+
+static struct dyesub_reader {
+	int fd;
+	uint8_t *buf;
+	int pos;   /* Next unconsumed byte */
+	int len;   /* Valid bytes in buf */
+	uint64_t hash;   /* Of everything consumed since the last reset */
+	size_t consumed;
+	int recording;   /* Keep a copy of everything consumed in 'rec' */
+	uint8_t *rec;
+	size_t rec_len, rec_max;
+} reader = { -1, NULL, 0, 0, DYESUB_HASH_INIT, 0, 0, NULL, 0, 0 };
+
+static struct dyesub_reader *dyesub_reader_get(int fd)
+{
+	if (!reader.buf) {
+		reader.buf = malloc(DYESUB_READER_LEN);
+		if (!reader.buf) {
+			ERROR("Memory allocation failure\n");
+			return NULL;
+		}
+	}
+	/* Anything buffered from a different input is stale */
+	if (reader.fd != fd) {
+		reader.fd = fd;
+		reader.pos = reader.len = 0;
+		reader.hash = DYESUB_HASH_INIT;
+		reader.consumed = 0;
+		reader.recording = 0;
+		reader.rec_len = 0;
+	}
+
+	return &reader;
+}
+
+static void dyesub_reader_consume(struct dyesub_reader *rd, const void *data, int len)
+{
+	rd->hash = dyesub_hash(rd->hash, data, len);
+	rd->consumed += len;
+
+	if (!rd->recording)
+		return;
+
+	if (rd->rec_len + len > rd->rec_max) {
+		size_t max = rd->rec_max ? rd->rec_max : DYESUB_READER_LEN;
+		uint8_t *rec;
+
+		while (max < rd->rec_len + len)
+			max *= 2;
+		rec = realloc(rd->rec, max);
+		if (!rec) {
+			/* Give up; dyesub_reader_take() will return NULL */
+			free(rd->rec);
+			rd->rec = NULL;
+			rd->rec_len = rd->rec_max = 0;
+			rd->recording = 0;
+			return;
+		}
+		rd->rec = rec;
+		rd->rec_max = max;
+	}
+	memcpy(rd->rec + rd->rec_len, data, len);
+	rd->rec_len += len;
+}
+
+/* Start keeping a copy of everything consumed from 'fd' */
+static void dyesub_reader_record(int fd)
+{
+	struct dyesub_reader *rd = dyesub_reader_get(fd);
+
+	if (!rd)
+		return;
+
+	rd->recording = 1;
+	rd->rec_len = 0;
+}
+
+/* Hand over what was recorded (a malloc()'d buffer) and stop recording */
+static uint8_t *dyesub_reader_take(int fd, size_t *len)
+{
+	struct dyesub_reader *rd = dyesub_reader_get(fd);
+	uint8_t *rec;
+
+	*len = 0;
+	if (!rd || !rd->recording)
+		return NULL;
+
+	rec = rd->rec;
+	*len = rd->rec_len;
+	rd->rec = NULL;
+	rd->rec_len = rd->rec_max = 0;
+	rd->recording = 0;
+
+	return rec;
+}
+
+/* Returns the hash of everything consumed from 'fd' since the last
+   call, and how much that was */
+static uint64_t dyesub_reader_hash(int fd, size_t *len)
+{
+	struct dyesub_reader *rd = dyesub_reader_get(fd);
+	uint64_t hash;
+
+	if (!rd) {
+		*len = 0;
+		return 0;
+	}
+
+	hash = rd->hash;
+	*len = rd->consumed;
+	rd->hash = DYESUB_HASH_INIT;
+	rd->consumed = 0;
+
+	return hash;
+}
+
+static void dyesub_reader_release(void)
+{
+	free(reader.buf);
+	reader.buf = NULL;
+	free(reader.rec);
+	reader.rec = NULL;
+	reader.rec_len = reader.rec_max = 0;
+	reader.recording = 0;
+	reader.fd = -1;
+	reader.pos = reader.len = 0;
+}
+
+/* Top up the buffer so at least 'want' bytes are available (if possible)
+   Returns the number of bytes available, or < 0 on error */
+static int dyesub_reader_fill(struct dyesub_reader *rd, int want)
+{
+	if (want > DYESUB_READER_LEN)
+		want = DYESUB_READER_LEN;
+
+	if (rd->len - rd->pos >= want)
+		return rd->len - rd->pos;
+
+	/* Slide what's left to the front */
+	if (rd->pos) {
+		memmove(rd->buf, rd->buf + rd->pos, rd->len - rd->pos);
+		rd->len -= rd->pos;
+		rd->pos = 0;
+	}
+
+	while (rd->len < want) {
+		int ret = read(rd->fd, rd->buf + rd->len, DYESUB_READER_LEN - rd->len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (rd->len)
+				break;
+			return ret;
+		}
+		if (ret == 0)
+			break;
+		rd->len += ret;
+	}
+
+	return rd->len - rd->pos;
+}
+
+int dyesub_read(int fd, void *buf, int len)
+{
+	struct dyesub_reader *rd = dyesub_reader_get(fd);
+	int avail;
+
+	if (!rd)
+		return -1;
+	if (len <= 0)
+		return 0;
+
+	avail = rd->len - rd->pos;
+
+	/* Large reads with nothing buffered go straight to the caller */
+	if (!avail && len >= DYESUB_READER_LEN) {
+		int ret;
+		do {
+			ret = read(fd, buf, len);
+		} while (ret < 0 && errno == EINTR);
+		if (ret > 0)
+			dyesub_reader_consume(rd, buf, ret);
+		return ret;
+	}
+
+	if (!avail) {
+		avail = dyesub_reader_fill(rd, 1);
+		if (avail <= 0)
+			return avail;
+	}
+
+	if (avail > len)
+		avail = len;
+	memcpy(buf, rd->buf + rd->pos, avail);
+	dyesub_reader_consume(rd, buf, avail);
+	rd->pos += avail;
+
+	return avail;
+}
+
+/* Read exactly 'len' bytes unless we hit EOF first.
+   Returns the number of bytes read, or < 0 on error */
+int dyesub_read_full(int fd, void *buf, int len)
+{
+	int total = 0;
+
+	while (total < len) {
+		int ret = dyesub_read(fd, (uint8_t*)buf + total, len - total);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		total += ret;
+	}
+
+	return total;
+}
+
+/* Look at up to 'len' bytes without consuming them.  Returns the
+   number of bytes available, which is only short at EOF. */
+int dyesub_peek(int fd, const uint8_t **data, int len)
+{
+	struct dyesub_reader *rd = dyesub_reader_get(fd);
+	int avail;
+
+	if (!rd)
+		return -1;
+
+	avail = dyesub_reader_fill(rd, len);
+	if (avail < 0)
+		return avail;
+	*data = rd->buf + rd->pos;
+
+	return (avail < len) ? avail : len;
+}
+
+/* Consume 'len' bytes, returning a pointer straight into the buffer.
+   This is only valid until the next read, and 'len' must not exceed
+   the buffer size.  Returns NULL on a short read. */
+const uint8_t *dyesub_read_span(int fd, int len)
+{
+	struct dyesub_reader *rd = dyesub_reader_get(fd);
+	const uint8_t *ptr;
+
+	if (!rd || len > DYESUB_READER_LEN)
+		return NULL;
+	if (dyesub_reader_fill(rd, len) < len)
+		return NULL;
+
+	ptr = rd->buf + rd->pos;
+	dyesub_reader_consume(rd, ptr, len);
+	rd->pos += len;
+
+	return ptr;
+}
+
+static void outcache_release(void);
+
+/* Cross-job combining.  CUPS only hands us one job at a time, so a lone
+   page that could share a sheet is parked in CACHE_PATH for up to
+   COMBINE_HOLD seconds.  If the next job for this printer shows up in
+   time it prints the parked page along with its own; otherwise a
+   detached copy of the backend prints it by itself.
+
+   We can't stay around for the hold window ourselves, as CUPS won't
+   start the next job until we exit.  So the page is printed outside of
+   CUPS's control, which is why this is off unless explicitly enabled,
+   and why we say so in the job log every time. */
+static void hold_key(char *key, int len)
+{
+	snprintf(key, len, "held-%016llx.job",
+		 (unsigned long long)dyesub_hash(DYESUB_HASH_INIT, hold_uri, strlen(hold_uri)));
+}
+
+#define HOLD_RETRIES     10
+#define HOLD_RETRY_DELAY 30  /* Seconds */
+
+/* Returns an fd for a page parked by the previous job, or -1.  The
+   page stays on disk until hold_release() says it has been printed. */
+static int hold_claim(void)
+{
+	char key[64];
+	int fd;
+
+	hold_key(key, sizeof(key));
+	if (dyesub_cache_fname(key, hold_parked, sizeof(hold_parked)))
+		return -1;
+
+	/* Whoever renames it first owns it */
+	snprintf(hold_claimed, sizeof(hold_claimed), "%s.%d", hold_parked, (int)getpid());
+	if (rename(hold_parked, hold_claimed)) {
+		hold_claimed[0] = 0;
+		return -1;
+	}
+	fd = open(hold_claimed, O_RDONLY);
+	if (fd < 0) {
+		rename(hold_claimed, hold_parked);
+		hold_claimed[0] = 0;
+		return -1;
+	}
+
+	INFO("Picked up a page held over from the previous job\n");
+
+	return fd;
+}
+
+/* Once the page we picked up is printed (or is unusable) it can go.
+   Otherwise put it back, and make sure somebody prints it. */
+static void hold_release(int done)
+{
+	if (!hold_claimed[0])
+		return;
+
+	if (done) {
+		unlink(hold_claimed);
+	} else if (rename(hold_claimed, hold_parked)) {
+		ERROR("Unable to return held page, it is stuck in '%s'\n", hold_claimed);
+	} else {
+		WARNING("Returning the page held over from the previous job\n");
+		if (!hold_fname[0])
+			strcpy(hold_fname, hold_parked);
+	}
+	hold_claimed[0] = 0;
+}
+
+static int hold_park(const uint8_t *data, size_t len)
+{
+	char key[64];
+
+	hold_key(key, sizeof(key));
+	if (dyesub_cache_store(key, data, len))
+		return CUPS_BACKEND_FAILED;
+	if (dyesub_cache_fname(key, hold_fname, sizeof(hold_fname)))
+		return CUPS_BACKEND_FAILED;
+
+	WARNING("Holding the last page for up to %d seconds to pair it with the next job\n",
+		combine_hold);
+	WARNING("This job will complete now, but that page prints later, outside of CUPS; it can't be cancelled or held from CUPS and is not counted in this job\n");
+	WARNING("To cancel it, delete '%s'\n", hold_fname);
+
+	return CUPS_BACKEND_OK;
+}
+
+#ifndef _WIN32
+/* Wait out the hold window, then print the parked page ourselves if
+   nobody else has claimed it.  If that fails (eg another job has the
+   printer) the page is put back and we try again later.  Anything we
+   have to say goes into a log next to the page. */
+static void hold_spawn(char **argv)
+{
+	char exe[1024], claimed[1100], logname[1100];
+	char *args[7];
+	ssize_t len;
+	pid_t pid;
+	int fd, i, status;
+
+	len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (len <= 0) {
+		ERROR("Unable to find our own executable, held page is stuck in '%s'\n", hold_fname);
+		return;
+	}
+	exe[len] = 0;
+
+	/* Or the child would write it out all over again */
+	dyesub_log_flush();
+	pid = fork();
+	if (pid < 0)
+		ERROR("Unable to fork, held page is stuck in '%s'\n", hold_fname);
+	if (pid != 0)
+		return;
+
+	/* Let CUPS move on to the next job */
+	setsid();
+	fd = open("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+	snprintf(logname, sizeof(logname), "%s.log", hold_fname);
+	fd = open(logname, O_WRONLY|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR);
+	if (fd >= 0) {
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+
+	/* Same job arguments, but one copy, read from stdin, and don't
+	   hold again */
+	for (i = 0 ; i < 6 ; i++)
+		args[i] = argv[i];
+	args[4] = "1";
+	args[6] = NULL;
+	setenv("DEVICE_URI", hold_uri, 1);
+	setenv("COMBINE_HOLD", "0", 1);
+
+	for (i = 0 ; i < HOLD_RETRIES ; i++) {
+		sleep(i ? HOLD_RETRY_DELAY : combine_hold);
+
+		snprintf(claimed, sizeof(claimed), "%s.%d", hold_fname, (int)getpid());
+		if (rename(hold_fname, claimed)) {
+			unlink(logname);
+			_exit(0);  /* The next job took it */
+		}
+
+		dyesub_log_flush();
+		pid = fork();
+		if (pid == 0) {
+			fd = open(claimed, O_RDONLY);
+			if (fd < 0)
+				_exit(CUPS_BACKEND_FAILED);
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+			execv(exe, args);
+			_exit(CUPS_BACKEND_FAILED);
+		}
+		if (pid > 0 && waitpid(pid, &status, 0) == pid &&
+		    WIFEXITED(status) && WEXITSTATUS(status) == CUPS_BACKEND_OK) {
+			unlink(claimed);
+			unlink(logname);
+			_exit(0);
+		}
+
+		/* Put it back, where the next job can still pick it up */
+		if (rename(claimed, hold_fname)) {
+			ERROR("Unable to return held page, it is stuck in '%s'\n", claimed);
+			_exit(1);
+		}
+		WARNING("Unable to print held page (attempt %d), retrying in %d seconds\n",
+			i + 1, HOLD_RETRY_DELAY);
+	}
+
+	ERROR("Giving up on held page, it is still in '%s'\n", hold_fname);
+	dyesub_log_flush();
+	_exit(1);
+}
+#endif
+
 static int handle_input(struct dyesub_backend *backend, void *backend_ctx,
 			const char *fname, char *uri, char *type)
 {
@@ -1143,6 +2590,14 @@ static int handle_input(struct dyesub_backend *backend, void *backend_ctx,
 	int data_fd = fileno(stdin);
 	int read_page = 0, print_page = 0;
 	struct dyesub_joblist *jlist = NULL;
+	struct dyesub_job_common *held = NULL;
+	uint64_t held_hash = 0, hash;
+	size_t held_len = 0, hashlen;
+	int hold_fd = -1, hold_pages = 0, in_fd;
+	uint8_t *last_rec = NULL;
+	size_t last_len = 0;
+	const void *last_job = NULL;
+	double start;
 
 	if (!fname) {
 		if (uri && strlen(uri))
@@ -1204,23 +2659,67 @@ static int handle_input(struct dyesub_backend *backend, void *backend_ctx,
 	if (ret)
 		goto done;
 
+	/* Pick up anything the previous job left for us to pair with */
+	if (hold_uri && !(collate && ncopies > 1))
+		hold_fd = hold_claim();
+
 newpage:
 	/* Read in data */
 	for (i = 0 ; i < MAX_JOBS_FROM_READ_PARSE ; i++)
 		jobs[i] = NULL;
 
-	if ((ret = backend->read_parse(backend_ctx, jobs, data_fd, ncopies))) {
+	in_fd = (hold_fd >= 0) ? hold_fd : data_fd;
+	dyesub_reader_hash(in_fd, &hashlen);
+	if (hold_uri)
+		dyesub_reader_record(in_fd);
+	start = monotonic_now();
+	ret = backend->read_parse(backend_ctx, jobs, in_fd,
+				  (in_fd == hold_fd) ? 1 : ncopies);
+	if (ret) {
+		if (in_fd == hold_fd) {
+			/* Nothing usable in it means nothing to print later */
+			if (!hold_pages) {
+				WARNING("Discarding unreadable held page\n");
+				hold_release(1);
+			}
+			/* Carry on with our own input */
+			close(hold_fd);
+			hold_fd = -1;
+			goto newpage;
+		}
 		if (read_page)
 			goto done_multiple;
 		else
 			goto done;
 	}
+	metrics_observe(PHASE_PARSE, start);
+	if (in_fd == hold_fd)
+		hold_pages++;
+	hash = dyesub_reader_hash(in_fd, &hashlen);
+	if (hold_uri) {
+		free(last_rec);
+		last_rec = dyesub_reader_take(in_fd, &last_len);
+		last_job = jobs[1] ? NULL : jobs[0];
+	}
 
 	if (!jobs[0]) {
 		WARNING("No job returned by backend read_parse?\n");
 		goto newpage;
 	}
 
+	/* Applications often send N identical pages instead of asking
+	   for N copies; turn them back into copies so the printer can
+	   handle them (and we only have to process the image once) */
+	if (held && !jobs[1] && hash == held_hash && hashlen == held_len &&
+	    ((const struct dyesub_job_common *)jobs[0])->can_fold) {
+		held->copies += ((const struct dyesub_job_common *)jobs[0])->copies;
+		backend->cleanup_job(jobs[0]);
+		read_page++;
+		INFO("Parsed page %d (same as previous page, now %d copies)\n",
+		     read_page, held->copies);
+		goto newpage;
+	}
+
 	/* Create a joblist if needed */
 	if (!jlist) {
 		jlist = dyesub_joblist_create(backend, backend_ctx);
@@ -1231,10 +2730,24 @@ newpage:
 		goto done;
 	}
 
-	/* Stick jobs onto the end of the list */
-	for (i = 0 ; i < MAX_JOBS_FROM_READ_PARSE ; i++) {
-		if (jobs[i])
-			dyesub_joblist_appendjob(jlist, jobs[i]);
+	/* Anything held back can't be folded any further */
+	if (held) {
+		dyesub_joblist_appendjob(jlist, held);
+		held = NULL;
+	}
+
+	if (!jobs[1] && ((const struct dyesub_job_common *)jobs[0])->can_fold &&
+	    !((const struct dyesub_job_common *)jobs[0])->owns_input) {
+		/* Hang onto it until we see the next page */
+		held = (struct dyesub_job_common *) jobs[0];
+		held_hash = hash;
+		held_len = hashlen;
+	} else {
+		/* Stick jobs onto the end of the list */
+		for (i = 0 ; i < MAX_JOBS_FROM_READ_PARSE ; i++) {
+			if (jobs[i])
+				dyesub_joblist_appendjob(jlist, jobs[i]);
+		}
 	}
 	read_page++;
 
@@ -1246,10 +2759,15 @@ newpage:
 
 print_list:
 	/* Print the pagelist */
+	start = monotonic_now();
 	ret = dyesub_joblist_print(jlist, &print_page);
+	metrics_observe(PHASE_PRINT, start);
 	if (ret)
 		goto done;
 
+	/* Anything we picked up from the previous job is now printed */
+	hold_release(1);
+
 	dyesub_joblist_cleanup(jlist);
 	jlist = NULL;
 
@@ -1259,6 +2777,27 @@ print_list:
 	goto newpage;
 
 done_multiple:
+	if (held) {
+		if (!jlist)
+			jlist = dyesub_joblist_create(backend, backend_ctx);
+		if (!jlist)
+			goto done;
+		dyesub_joblist_appendjob(jlist, held);
+		held = NULL;
+	}
+
+	/* If all we have left is a page that could share a sheet with
+	   something from the next job, hold it over */
+	if (hold_uri && jlist && jlist->num_entries == 1 && jlist->copies == 1 &&
+	    jlist->entries[0] == last_job && last_rec) {
+		const struct dyesub_job_common *job = last_job;
+		if (job->can_combine && job->copies == 1 && !job->owns_input &&
+		    !hold_park(last_rec, last_len)) {
+			dyesub_joblist_cleanup(jlist);
+			jlist = NULL;
+		}
+	}
+
 	if (jlist)
 		goto print_list;
 
@@ -1267,7 +2806,13 @@ done_multiple:
 	ret = CUPS_BACKEND_OK;
 
 done:
+	if (held) backend->cleanup_job(held);
 	if (jlist) dyesub_joblist_cleanup(jlist);
+	if (hold_fd >= 0) close(hold_fd);
+	free(last_rec);
+	dyesub_reader_release();
+	outcache_release();
+	metrics.pages += print_page;
 
 	return ret;
 }
@@ -1292,6 +2837,7 @@ int main (int argc, char **argv)
 	char *use_serno = NULL;
 	const char *backend_str = NULL;
 	const char *argv0;
+	double job_start;
 
 	/* Work out path-less executable name */
 	argv0 = strrchr(argv[0], '/');
@@ -1301,6 +2847,7 @@ int main (int argc, char **argv)
 		argv0 = argv[0];
 
 	logger = stderr;
+	atexit(dyesub_log_flush);
 
 	/* Handle environment variables  */
 	if (getenv("BACKEND_QUIET"))
@@ -1325,12 +2872,40 @@ int main (int argc, char **argv)
 		max_xfer_size = atoi(getenv("MAX_XFER_SIZE"));
 	if (getenv("XFER_TIMEOUT"))
 		xfer_timeout = atoi(getenv("XFER_TIMEOUT"));
+	if (getenv("MAX_THREADS"))
+		max_threads = atoi(getenv("MAX_THREADS"));
+	if (getenv("PROBE_TIMEOUT"))
+		probe_timeout = atoi(getenv("PROBE_TIMEOUT"));
 	if (getenv("TEST_MODE"))
 		test_mode = atoi(getenv("TEST_MODE"));
 	if (getenv("OLD_URI_SCHEME"))
 		old_uri = atoi(getenv("OLD_URI_SCHEME"));
 	if (getenv("CORRTABLE_PATH"))
 		corrtable_path = getenv("CORRTABLE_PATH");
+	/* CUPS hands us a private TMPDIR that persists across jobs */
+	if (getenv("CACHE_PATH"))
+		cache_path = getenv("CACHE_PATH");
+	else if (getenv("TMPDIR"))
+		cache_path = getenv("TMPDIR");
+	if (cache_path && !*cache_path)
+		cache_path = NULL;
+	if (getenv("OUTPUT_CACHE_MEM"))
+		outcache_mem = atoi(getenv("OUTPUT_CACHE_MEM"));
+	if (getenv("OUTPUT_CACHE_DISK"))
+		outcache_disk = atoi(getenv("OUTPUT_CACHE_DISK"));
+	if (getenv("COMBINE_HOLD"))
+		combine_hold = atoi(getenv("COMBINE_HOLD"));
+	if (getenv("STATS_INTERVAL"))
+		stats_interval = atoi(getenv("STATS_INTERVAL"));
+	if (getenv("STATS_FILE"))
+		stats_file = getenv("STATS_FILE");
+	if (getenv("STATUS_CACHE_MS"))
+		status_cache_ms = atoi(getenv("STATUS_CACHE_MS"));
+	if (getenv("USB_TRACE")) {
+		trace_fd = open(getenv("USB_TRACE"), O_WRONLY|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR);
+		if (trace_fd < 0)
+			WARNING("Unable to open USB trace file '%s'\n", getenv("USB_TRACE"));
+	}
 
 	if (test_mode >= TEST_MODE_NOATTACH && (extra_vid == -1 || extra_pid == -1)) {
 		ERROR("Must specify EXTRA_VID, EXTRA_PID in test mode > 1!\n");
@@ -1357,6 +2932,11 @@ int main (int argc, char **argv)
 			ERROR("Insufficient arguments\n");
 			exit(1);
 		}
+#ifndef _WIN32
+		/* Parsing below chops up the URI, so keep a copy */
+		if (combine_hold > 0 && cache_path)
+			hold_uri = strdup(uri);
+#endif
 		if (argv[base])
 			jobid = atoi(argv[base]);
 		if (argv[base + 3])
@@ -1467,6 +3047,17 @@ int main (int argc, char **argv)
 	/* Enumerate devices */
 	STATE("+connecting-to-device\n");
 
+	if (use_serno && strchr(use_serno, ',')) {
+		pool_serno = pool_select(argv0, backend, use_serno, backend_str);
+		if (!pool_serno) {
+			ERROR("Printer open failure (No printers in pool available!)\n");
+			STATE("+offline-report\n");
+			ret = CUPS_BACKEND_RETRY;
+			goto done;
+		}
+		use_serno = pool_serno;
+	}
+
 	found = find_and_enumerate(argv0, &list, backend, use_serno, backend_str, 0, NUM_CLAIM_ATTEMPTS, &conn);
 
 	if (found == -1) {
@@ -1564,15 +3155,17 @@ bypass:
 		struct printerstats stats;
 		memset(&stats, 0, sizeof(stats));
 
+		if (stats_interval > 0) {
+			ret = stats_export(backend, backend_ctx, &conn, use_serno);
+			goto done_close;
+		}
+
 		stats.timestamp = time(NULL);
 		ret = backend->query_stats(backend_ctx, &stats);
 		if (ret)
 			goto done_claimed;
 		dump_stats(backend, &stats, stats_only -1);
-		for (int i = 0 ; i < stats.decks ; i++) {
-			if (stats.status[i])
-				free(stats.status[i]); // the only dynamic member..
-		}
+		stats_release(&stats);
 		goto done_claimed;
 	}
 
@@ -1591,7 +3184,13 @@ bypass:
 	}
 
 	/* Parse the file passed in */
+	job_start = monotonic_now();
 	ret = handle_input(backend, backend_ctx, fname, uri, type);
+	if (uri && strlen(uri) &&
+	    !(type && !strcmp("application/vnd.cups-command", type))) {
+		metrics_observe(PHASE_JOB, job_start);
+		metrics_save(use_serno, ret);
+	}
 
 done_claimed:
 	if (test_mode < TEST_MODE_NOATTACH)
@@ -1614,7 +3213,22 @@ done:
 	if (list)
 		libusb_free_device_list(list, 1);
 
-	libusb_exit(NULL);
+	/* An abandoned probe may still be using libusb */
+	if (!probe_abandoned)
+		libusb_exit(NULL);
+
+	if (pool_serno) {
+		pool_note(pool_serno, pool_level, 0);
+		free(pool_serno);
+	}
+
+	/* If we didn't get to print a page we picked up, pass it on */
+	hold_release(0);
+#ifndef _WIN32
+	if (hold_fname[0])
+		hold_spawn(argv);
+#endif
+	free(hold_uri);
 
 	return ret;
 }
@@ -1720,35 +3334,378 @@ minimal:
 	}
 }
 
-int dyesub_read_file(const char *filename, void *databuf, int datalen,
-		     int *actual_len)
+int dyesub_read_file(const char *filename, void *databuf, int datalen,
+		     int *actual_len)
+{
+	int len;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0) {
+		ERROR("Unable to open '%s'\n", filename);
+		return CUPS_BACKEND_FAILED;
+	}
+	len = read(fd, databuf, datalen);
+	if (len < 0) {
+		ERROR("Bad Read! (%d/%d)\n", len, errno);
+		close(fd);
+		return CUPS_BACKEND_FAILED;
+	}
+	if (!actual_len && (datalen != len)) {
+		ERROR("Read mismatch (%d vs %d)\n", len, datalen);
+		close(fd);
+		return CUPS_BACKEND_FAILED;
+	}
+	close(fd);
+
+	if (actual_len)
+		*actual_len = len;
+
+	return CUPS_BACKEND_OK;
+}
+
+static int dyesub_cache_fname(const char *key, char *fname, int len)
+{
+	int i, j;
+
+	if (!cache_path)
+		return -1;
+
+	i = snprintf(fname, len, "%s/dyesub-", cache_path);
+	if (i < 0 || i >= len)
+		return -1;
+
+	/* Keys are built from printer-supplied strings, so sanitize them */
+	for (j = 0 ; key[j] && i < len - 1 ; j++, i++) {
+		if ((key[j] >= '0' && key[j] <= '9') ||
+		    (key[j] >= 'a' && key[j] <= 'z') ||
+		    (key[j] >= 'A' && key[j] <= 'Z') ||
+		    key[j] == '.' || key[j] == '-')
+			fname[i] = key[j];
+		else
+			fname[i] = '_';
+	}
+	if (key[j])
+		return -1;
+	fname[i] = 0;
+
+	return 0;
+}
+
+/* Returns a malloc()'d buffer with 'extra' bytes of slack past the end,
+   or NULL if there is no usable cache entry */
+void *dyesub_cache_load(const char *key, int extra, int *len)
+{
+	char fname[1024];
+	struct stat st;
+	void *buf;
+
+	if (dyesub_cache_fname(key, fname, sizeof(fname)))
+		return NULL;
+	if (stat(fname, &st) || !S_ISREG(st.st_mode) ||
+	    st.st_size <= 0 || st.st_size > 256*1024*1024)
+		return NULL;
+
+	buf = malloc(st.st_size + extra);
+	if (!buf) {
+		ERROR("Memory allocation failure\n");
+		return NULL;
+	}
+	if (dyesub_read_file(fname, buf, st.st_size, NULL)) {
+		free(buf);
+		return NULL;
+	}
+	DEBUG("Loaded %d bytes from cache '%s'\n", (int)st.st_size, fname);
+	*len = st.st_size;
+
+	return buf;
+}
+
+int dyesub_cache_store(const char *key, const void *data, int len)
+{
+	char fname[1024];
+	char tmpname[1040];
+	int fd, ret;
+
+	if (dyesub_cache_fname(key, fname, sizeof(fname)))
+		return CUPS_BACKEND_OK;
+
+	/* Write it out under a temporary name so readers never see
+	   a partial file */
+	snprintf(tmpname, sizeof(tmpname), "%s.%d", fname, (int)getpid());
+	fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	if (fd < 0) {
+		WARNING("Unable to create cache file '%s'\n", tmpname);
+		return CUPS_BACKEND_FAILED;
+	}
+	ret = write(fd, data, len);
+	close(fd);
+	if (ret != len || rename(tmpname, fname)) {
+		WARNING("Unable to write cache file '%s'\n", fname);
+		unlink(tmpname);
+		return CUPS_BACKEND_FAILED;
+	}
+	DEBUG("Stored %d bytes in cache '%s'\n", len, fname);
+
+	return CUPS_BACKEND_OK;
+}
+
+/* 64-bit FNV-1a */
+uint64_t dyesub_hash(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+	size_t i;
+
+	for (i = 0 ; i < len ; i++) {
+		hash ^= ptr[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Mix in a file's identity (name, size and modification time) so that
+   anything derived from it goes stale once the file is replaced. */
+uint64_t dyesub_hash_file(uint64_t hash, const char *fname)
+{
+	struct stat st;
+	int64_t val;
+
+	if (!fname)
+		return hash;
+
+	hash = dyesub_hash(hash, fname, strlen(fname) + 1);
+	if (stat(fname, &st))
+		return hash;
+
+	val = st.st_size;
+	hash = dyesub_hash(hash, &val, sizeof(val));
+	val = st.st_mtime;
+	hash = dyesub_hash(hash, &val, sizeof(val));
+
+	return hash;
+}
+
+/* Likewise for the shared library that 'sym' was loaded from */
+uint64_t dyesub_hash_lib(uint64_t hash, void *dl_handle, void *sym)
+{
+#if defined(USE_DLOPEN)
+	Dl_info info;
+
+	UNUSED(dl_handle);
+	if (sym && dladdr(sym, &info) && info.dli_fname)
+		return dyesub_hash_file(hash, info.dli_fname);
+#elif defined(USE_LTDL)
+	const lt_dlinfo *info = dl_handle ? lt_dlgetinfo(dl_handle) : NULL;
+
+	UNUSED(sym);
+	if (info && info->filename)
+		return dyesub_hash_file(hash, info->filename);
+#else
+	UNUSED(dl_handle);
+	UNUSED(sym);
+#endif
+	/* Can't tell which one; the backend version will have to do */
+	return dyesub_hash(hash, BACKEND_VERSION, strlen(BACKEND_VERSION));
+}
+
+#define OUTCACHE_ENTRIES 8
+#define OUTCACHE_MAGIC   0x434f5344  /* "DSOC" */
+
+struct outcache_hdr {
+	uint32_t magic;
+	uint32_t len;
+	uint32_t extralen;
+	uint32_t pad;
+	uint64_t key;
+};
+
+struct outcache_entry {
+	uint64_t key;
+	uint8_t *data;  /* Payload followed by extra */
+	size_t len;
+	size_t extralen;
+};
+
+/* Most recently used first */
+static struct outcache_entry outcache[OUTCACHE_ENTRIES];
+
+static void outcache_mem_put(uint64_t key, const void *buf, size_t len,
+			     const void *extra, size_t extralen)
+{
+	struct outcache_entry ent;
+	size_t total = len + extralen;
+	int i;
+
+	if (total > outcache_mem * 1024 * 1024)
+		return;
+
+	ent.data = malloc(total);
+	if (!ent.data)
+		return;
+	memcpy(ent.data, buf, len);
+	if (extralen)
+		memcpy(ent.data + len, extra, extralen);
+	ent.key = key;
+	ent.len = len;
+	ent.extralen = extralen;
+
+	/* Insert at the front, then trim to fit the size cap */
+	free(outcache[OUTCACHE_ENTRIES-1].data);
+	memmove(&outcache[1], &outcache[0], sizeof(outcache[0]) * (OUTCACHE_ENTRIES - 1));
+	outcache[0] = ent;
+
+	for (i = 1 ; i < OUTCACHE_ENTRIES ; i++) {
+		if (!outcache[i].data)
+			continue;
+		if (total + outcache[i].len + outcache[i].extralen > outcache_mem * 1024 * 1024) {
+			free(outcache[i].data);
+			outcache[i].data = NULL;
+		} else {
+			total += outcache[i].len + outcache[i].extralen;
+		}
+	}
+}
+
+static void outcache_disk_prune(void)
+{
+	DIR *dir;
+	struct dirent *de;
+	char fname[1024];
+	size_t total;
+
+	/* Keep throwing out the oldest file until we fit */
+	do {
+		struct stat st;
+		char oldest[1024] = "";
+		time_t oldest_t = 0;
+
+		dir = opendir(cache_path);
+		if (!dir)
+			return;
+
+		total = 0;
+		while ((de = readdir(dir))) {
+			if (strncmp(de->d_name, "dyesub-out-", 11))
+				continue;
+			snprintf(fname, sizeof(fname), "%s/%s", cache_path, de->d_name);
+			if (stat(fname, &st) || !S_ISREG(st.st_mode))
+				continue;
+			total += st.st_size;
+			if (!oldest[0] || st.st_mtime < oldest_t) {
+				oldest_t = st.st_mtime;
+				strncpy(oldest, fname, sizeof(oldest) - 1);
+			}
+		}
+		closedir(dir);
+
+		if (total <= outcache_disk * 1024 * 1024 || !oldest[0])
+			break;
+		DEBUG("Pruning output cache file '%s'\n", oldest);
+		if (unlink(oldest))
+			break;
+	} while (1);
+}
+
+int dyesub_outcache_get(uint64_t key, void *buf, size_t len,
+			void *extra, size_t extralen)
 {
-	int len;
-	int fd = open(filename, O_RDONLY);
+	struct outcache_hdr *hdr;
+	char name[64];
+	uint8_t *data;
+	int i, datalen = 0;
+
+	for (i = 0 ; i < OUTCACHE_ENTRIES ; i++) {
+		struct outcache_entry ent = outcache[i];
+		if (!ent.data || ent.key != key ||
+		    ent.len != len || ent.extralen != extralen)
+			continue;
 
-	if (fd < 0) {
-		ERROR("Unable to open '%s'\n", filename);
-		return CUPS_BACKEND_FAILED;
+		memcpy(buf, ent.data, len);
+		if (extralen)
+			memcpy(extra, ent.data + len, extralen);
+
+		/* Move to the front */
+		memmove(&outcache[1], &outcache[0], sizeof(outcache[0]) * i);
+		outcache[0] = ent;
+		DEBUG("Output cache hit (%016llx)\n", (unsigned long long)key);
+		return CUPS_BACKEND_OK;
 	}
-	len = read(fd, databuf, datalen);
-	if (len < 0) {
-		ERROR("Bad Read! (%d/%d)\n", len, errno);
-		close(fd);
+
+	if (!outcache_disk || !cache_path)
 		return CUPS_BACKEND_FAILED;
-	}
-	if (!actual_len && (datalen != len)) {
-		ERROR("Read mismatch (%d vs %d)\n", len, datalen);
-		close(fd);
+
+	snprintf(name, sizeof(name), "out-%016llx.bin", (unsigned long long)key);
+	data = dyesub_cache_load(name, 0, &datalen);
+	if (!data)
+		return CUPS_BACKEND_FAILED;
+
+	hdr = (struct outcache_hdr *) data;
+	if ((size_t)datalen != sizeof(*hdr) + len + extralen ||
+	    hdr->magic != OUTCACHE_MAGIC || hdr->key != key ||
+	    hdr->len != len || hdr->extralen != extralen) {
+		free(data);
 		return CUPS_BACKEND_FAILED;
 	}
-	close(fd);
+	memcpy(buf, data + sizeof(*hdr), len);
+	if (extralen)
+		memcpy(extra, data + sizeof(*hdr) + len, extralen);
+	free(data);
 
-	if (actual_len)
-		*actual_len = len;
+	/* Bump its place in the LRU */
+	{
+		char fname[1024];
+		if (!dyesub_cache_fname(name, fname, sizeof(fname)))
+			utime(fname, NULL);
+	}
+
+	DEBUG("Output cache hit on disk (%016llx)\n", (unsigned long long)key);
+	outcache_mem_put(key, buf, len, extra, extralen);
 
 	return CUPS_BACKEND_OK;
 }
 
+void dyesub_outcache_put(uint64_t key, const void *buf, size_t len,
+			 const void *extra, size_t extralen)
+{
+	struct outcache_hdr hdr;
+	char name[64];
+	uint8_t *data;
+
+	outcache_mem_put(key, buf, len, extra, extralen);
+
+	if (!outcache_disk || !cache_path ||
+	    len + extralen > outcache_disk * 1024 * 1024)
+		return;
+
+	data = malloc(sizeof(hdr) + len + extralen);
+	if (!data)
+		return;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = OUTCACHE_MAGIC;
+	hdr.key = key;
+	hdr.len = len;
+	hdr.extralen = extralen;
+	memcpy(data, &hdr, sizeof(hdr));
+	memcpy(data + sizeof(hdr), buf, len);
+	if (extralen)
+		memcpy(data + sizeof(hdr) + len, extra, extralen);
+
+	snprintf(name, sizeof(name), "out-%016llx.bin", (unsigned long long)key);
+	if (!dyesub_cache_store(name, data, sizeof(hdr) + len + extralen))
+		outcache_disk_prune();
+	free(data);
+}
+
+static void outcache_release(void)
+{
+	int i;
+
+	for (i = 0 ; i < OUTCACHE_ENTRIES ; i++) {
+		free(outcache[i].data);
+		outcache[i].data = NULL;
+	}
+}
+
 uint16_t uint16_to_packed_bcd(uint16_t val)
 {
         uint16_t bcd;
@@ -1797,6 +3754,7 @@ struct dyesub_joblist *dyesub_joblist_create(const struct dyesub_backend *backen
 	list->backend = backend;
 	list->ctx = ctx;
 	list->num_entries = 0;
+	memset(list->prep, 0, sizeof(list->prep));
 
 	if (collate)
 		list->copies = ncopies;
@@ -1806,10 +3764,126 @@ struct dyesub_joblist *dyesub_joblist_create(const struct dyesub_backend *backen
 	return list;
 }
 
+/* Background job preparation.
+
+   Backends with expensive image processing can do it in prepare_job(),
+   which we kick off on a worker thread as soon as a job can no longer
+   change (ie it can't be combined with anything else) or, at the latest,
+   just before the previous job is handed to main_loop().  That way the
+   processing of one page overlaps with the printing of the one before.
+*/
+struct dyesub_prep {
+	const struct dyesub_backend *backend;
+	void *ctx;
+	const void *job;
+	int ret;
+#if defined(USE_PTHREADS)
+	pthread_t thread;
+	int started;
+#endif
+};
+
+#if defined(USE_PTHREADS)
+static pthread_mutex_t prep_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void dyesub_prepare_lock(void)
+{
+#if defined(USE_PTHREADS)
+	pthread_mutex_lock(&prep_mutex);
+#endif
+}
+
+void dyesub_prepare_unlock(void)
+{
+#if defined(USE_PTHREADS)
+	pthread_mutex_unlock(&prep_mutex);
+#endif
+}
+
+static void *dyesub_prep_thread(void *vprep)
+{
+	struct dyesub_prep *prep = vprep;
+
+	dyesub_prepare_lock();
+	prep->ret = prep->backend->prepare_job(prep->ctx, prep->job);
+	dyesub_prepare_unlock();
+
+	return NULL;
+}
+
+static int dyesub_joblist_needprep(const struct dyesub_joblist *list)
+{
+	if (!list->backend->prepare_job)
+		return 0;
+	if (test_mode >= TEST_MODE_NOPRINT &&
+	    !(list->backend->flags & BACKEND_FLAG_DUMMYPRINT))
+		return 0;
+	return 1;
+}
+
+/* Start preparing entry 'i', if we haven't already */
+static void dyesub_joblist_prepare(struct dyesub_joblist *list, int i)
+{
+	struct dyesub_prep *prep;
+
+	if (!dyesub_joblist_needprep(list) || !list->entries[i] || list->prep[i])
+		return;
+
+	prep = malloc(sizeof(*prep));
+	if (!prep)
+		return;  /* dyesub_joblist_prepared() will complain */
+
+	prep->backend = list->backend;
+	prep->ctx = list->ctx;
+	prep->job = list->entries[i];
+	prep->ret = CUPS_BACKEND_OK;
+	list->prep[i] = prep;
+
+#if defined(USE_PTHREADS)
+	prep->started = !pthread_create(&prep->thread, NULL, dyesub_prep_thread, prep);
+	if (prep->started)
+		return;
+#endif
+	dyesub_prep_thread(prep);
+}
+
+static void dyesub_prep_join(struct dyesub_prep *prep)
+{
+#if defined(USE_PTHREADS)
+	if (prep->started) {
+		pthread_join(prep->thread, NULL);
+		prep->started = 0;
+	}
+#else
+	UNUSED(prep);
+#endif
+}
+
+/* Wait for entry 'i' to be prepared, and return the result */
+static int dyesub_joblist_prepared(struct dyesub_joblist *list, int i)
+{
+	if (!dyesub_joblist_needprep(list))
+		return CUPS_BACKEND_OK;
+
+	dyesub_joblist_prepare(list, i);
+	if (!list->prep[i]) {
+		ERROR("Memory allocation failure!\n");
+		return CUPS_BACKEND_RETRY_CURRENT;
+	}
+	dyesub_prep_join(list->prep[i]);
+
+	return list->prep[i]->ret;
+}
+
 void dyesub_joblist_cleanup(const struct dyesub_joblist *list)
 {
 	int i;
 	for (i = 0; i < list->num_entries ; i++) {
+		if (list->prep[i]) {
+			dyesub_prep_join(list->prep[i]);
+			free(list->prep[i]);
+		}
 		if (list->entries[i])
 			list->backend->cleanup_job(list->entries[i]);
 	}
@@ -1830,6 +3904,7 @@ static int __dyesub_append_job(struct dyesub_joblist *list, const void **vjob, i
 {
 	struct dyesub_job_common *job, *combined;
 	const struct dyesub_job_common *oldjob;
+	int i, merged = 0;
 
 	/* Create writable copy of the new job */
 	job = malloc(((const struct dyesub_job_common *)*vjob)->jobsize);
@@ -1845,22 +3920,19 @@ static int __dyesub_append_job(struct dyesub_joblist *list, const void **vjob, i
 		return CUPS_BACKEND_OK;
 	}
 
-	/* Get the old job */
-	oldjob = dyesub_joblist_popjob(list);
-
-	/* If we can't combine with it, carry on as before */
-	if (oldjob && (oldjob->copies > 1 || !oldjob->can_combine)) {
-		__dyesub_joblist_addjob(list, oldjob);
-		oldjob = NULL;
-	}
-
-	if (oldjob) {
+	/* Only the most recent pending job is a candidate; pairing with
+	   anything further back would print this page ahead of the ones
+	   queued in between. */
+	i = list->num_entries - 1;
+	oldjob = (i >= 0) ? list->entries[i] : NULL;
+	if (oldjob && oldjob->copies == 1 && oldjob->can_combine) {
 		/* Try to combine first copy with old job */
 		combined = list->backend->combine_jobs(oldjob, job);
+		polarity = 0;
 		if (combined) {
 			INFO("Successfully combined two jobs\n");
-			/* Success, add it to the list */
-	                __dyesub_joblist_addjob(list, combined);
+			/* Success, it takes the old job's place in the list */
+			list->entries[i] = combined;
 			combined = NULL;
 
 			/* Clean up the old job */
@@ -1871,33 +3943,22 @@ static int __dyesub_append_job(struct dyesub_joblist *list, const void **vjob, i
 			if (job->copies == 0) {
 				/* Nope, we're done */
 				list->backend->cleanup_job(job);
-			} else if (job->copies == 1) {
-				/* Just one, shove it on the list */
-				__dyesub_joblist_addjob(list, job);
+				goto done;
 			}
-
-			goto done;
-		} else {
-			/* Failed to combine, restore old job and continue */
-			__dyesub_joblist_addjob(list, oldjob);
+			merged = 1;
 		}
-
-		polarity = 0;
 	}
 
 	/* If we have no work to do, just return */
-	if (job->copies == 1) {
-		free(job);
-		return CUPS_BACKEND_OK;
-	}
+	if (job->copies == 1)
+		goto leftover;
 
 	/* Attempt to combine multiple copies! */
 	combined = list->backend->combine_jobs(job, job);
 
 	if (!combined) {
 		/* Failed, so return */
-		free(job);
-		return CUPS_BACKEND_OK;
+		goto leftover;
 	}
 
 	INFO("Successfully combined multiple copies\n");
@@ -1920,6 +3981,16 @@ static int __dyesub_append_job(struct dyesub_joblist *list, const void **vjob, i
 	if (polarity) {
 		__dyesub_joblist_addjob(list, combined);
 	}
+	goto done;
+
+leftover:
+	/* Hand the job back to our caller as-is, unless one of its copies
+	   has already gone into a combined job */
+	if (!merged) {
+		free(job);
+		return CUPS_BACKEND_OK;
+	}
+	__dyesub_joblist_addjob(list, job);
 
 done:
 	/* Clean up */
@@ -1941,56 +4012,378 @@ int dyesub_joblist_appendjob(struct dyesub_joblist *list, const void *job)
 	if (job)
 		__dyesub_joblist_addjob(list, job);
 
+	/* Anything that can no longer be combined can be prepared now */
+	for (int i = 0 ; i < list->num_entries ; i++) {
+		const struct dyesub_job_common *entry = list->entries[i];
+		if (entry && (!entry->can_combine || entry->copies > 1))
+			dyesub_joblist_prepare(list, i);
+	}
+
 	return CUPS_BACKEND_OK;
 }
 
 const void *dyesub_joblist_popjob(struct dyesub_joblist *list)
 {
 	if (list->num_entries) {
-		return list->entries[--list->num_entries];
+		--list->num_entries;
+		if (list->prep[list->num_entries]) {
+			dyesub_prep_join(list->prep[list->num_entries]);
+			free(list->prep[list->num_entries]);
+			list->prep[list->num_entries] = NULL;
+		}
+		return list->entries[list->num_entries];
 	}
 
 	return NULL;
 }
 
+struct dyesub_buf {
+	int refcnt;
+	union {   /* Keep the payload suitably aligned */
+		uint64_t u;
+		double d;
+		void *p;
+	} data[];
+};
+
+#define DYESUB_BUF(__p) ((struct dyesub_buf *)((uint8_t *)(__p) - offsetof(struct dyesub_buf, data)))
+
+void *dyesub_buf_alloc(size_t len)
+{
+	struct dyesub_buf *buf = malloc(sizeof(*buf) + len);
+
+	if (!buf)
+		return NULL;
+
+	buf->refcnt = 1;
+	return buf->data;
+}
+
+void *dyesub_buf_realloc(void *ptr, size_t len)
+{
+	struct dyesub_buf *buf;
+
+	if (!ptr)
+		return dyesub_buf_alloc(len);
+
+	if (DYESUB_BUF(ptr)->refcnt != 1) {
+		ERROR("Can't resize a shared buffer!\n");
+		return NULL;
+	}
+
+	buf = realloc(DYESUB_BUF(ptr), sizeof(*buf) + len);
+	if (!buf)
+		return NULL;
+
+	return buf->data;
+}
+
+const void *dyesub_buf_ref(const void *ptr)
+{
+	if (ptr)
+		DYESUB_BUF(ptr)->refcnt++;
+
+	return ptr;
+}
+
+void dyesub_buf_free(const void *ptr)
+{
+	if (!ptr)
+		return;
+
+	if (--DYESUB_BUF(ptr)->refcnt == 0)
+		free(DYESUB_BUF(ptr));
+}
+
+int dyesub_seglist_add(struct dyesub_seglist *list, const uint8_t *data, uint32_t len)
+{
+	struct dyesub_seg *last = list->num ? &list->seg[list->num - 1] : NULL;
+
+	if (!len)
+		return CUPS_BACKEND_OK;
+
+	/* Coalesce with the previous segment if possible */
+	if (last && last->data && last->data + last->len == data) {
+		last->len += len;
+		list->len += len;
+		return CUPS_BACKEND_OK;
+	}
+
+	if (list->num >= DYESUB_MAX_SEGS) {
+		ERROR("Too many data segments!\n");
+		return CUPS_BACKEND_FAILED;
+	}
+
+	list->seg[list->num].data = data;
+	list->seg[list->num].len = len;
+	list->num++;
+	list->len += len;
+
+	return CUPS_BACKEND_OK;
+}
+
+int dyesub_seglist_fill(struct dyesub_seglist *list, uint8_t fill, uint32_t len)
+{
+	struct dyesub_seg *last = list->num ? &list->seg[list->num - 1] : NULL;
+
+	if (!len)
+		return CUPS_BACKEND_OK;
+
+	if (last && !last->data && last->fill == fill) {
+		last->len += len;
+		list->len += len;
+		return CUPS_BACKEND_OK;
+	}
+
+	if (list->num >= DYESUB_MAX_SEGS) {
+		ERROR("Too many data segments!\n");
+		return CUPS_BACKEND_FAILED;
+	}
+
+	list->seg[list->num].data = NULL;
+	list->seg[list->num].fill = fill;
+	list->seg[list->num].len = len;
+	list->num++;
+	list->len += len;
+
+	return CUPS_BACKEND_OK;
+}
+
+/* For when we really do need it all in one place */
+void dyesub_seglist_gather(const struct dyesub_seglist *list, uint8_t *dst)
+{
+	int i;
+
+	for (i = 0 ; i < list->num ; i++) {
+		if (list->seg[i].data)
+			memcpy(dst, list->seg[i].data, list->seg[i].len);
+		else
+			memset(dst, list->seg[i].fill, list->seg[i].len);
+		dst += list->seg[i].len;
+	}
+}
+
+/* All panels but the last are max_rows tall, and each one starts
+   overlap_rows before the previous one ends.  The panel count is the
+   fewest that will hold src_rows; '*numpanels' is updated to match. */
+int dyesub_pano_panel_rows(uint16_t src_rows, uint8_t *numpanels,
+			   uint16_t overlap_rows, uint16_t max_rows,
+			   uint16_t panel_rows[3])
+{
+	int i;
+	int num;
+	int last_rows;
+
+	if (overlap_rows >= max_rows || src_rows <= max_rows) {
+		ERROR("Invalid panorama layout (%d rows, %d overlap)\n",
+		      src_rows, overlap_rows);
+		return CUPS_BACKEND_CANCEL;
+	}
+
+	num = 1 + (src_rows - overlap_rows - 1) / (max_rows - overlap_rows);
+	if (num > 3) {
+		ERROR("Invalid panorama row count (%d rows, %d panels)\n",
+		      src_rows, num);
+		return CUPS_BACKEND_CANCEL;
+	}
+	if (num != *numpanels)
+		DEBUG("Panorama needs %d panels, not %d\n", num, *numpanels);
+	*numpanels = num;
+
+	last_rows = src_rows - (num - 1) * (max_rows - overlap_rows);
+	for (i = 0 ; i < num - 1 ; i++)
+		panel_rows[i] = max_rows;
+	panel_rows[i] = last_rows;
+
+	return CUPS_BACKEND_OK;
+}
+
+struct dyesub_pano_blend {
+	uint8_t **panels;
+	const uint16_t *panel_rows;
+	uint8_t numpanels;
+	uint16_t overlap_rows;
+	uint32_t rowlen;
+};
+
+/* Screen the row against white, ie out = 255 - (255 - in) * weight.
+   Kept trivial so the compiler can vectorize it. */
+static void dyesub_pano_fade_row(uint8_t *row, uint32_t len, uint16_t weight)
+{
+	uint32_t i;
+
+	for (i = 0 ; i < len ; i++)
+		row[i] = 255 - (uint8_t)(((uint16_t)(255 - row[i]) * weight + 128) >> 8);
+}
+
+static void dyesub_pano_blend_band(void *arg, uint32_t start, uint32_t end)
+{
+	struct dyesub_pano_blend *pb = arg;
+	uint32_t row;
+	int i;
+
+	for (row = start ; row < end ; row++) {
+		/* The upper panel fades out linearly across the overlap
+		   while the lower one fades in, so they always sum to 1 */
+		uint16_t weight = 128;
+		if (pb->overlap_rows > 1)
+			weight = (256 * (pb->overlap_rows - 1 - row) + (pb->overlap_rows - 1) / 2) / (pb->overlap_rows - 1);
+
+		for (i = 0 ; i < pb->numpanels - 1 ; i++) {
+			uint8_t *upper = pb->panels[i] + (pb->panel_rows[i] - pb->overlap_rows + row) * pb->rowlen;
+			uint8_t *lower = pb->panels[i + 1] + row * pb->rowlen;
+
+			dyesub_pano_fade_row(upper, pb->rowlen, weight);
+			dyesub_pano_fade_row(lower, pb->rowlen, 256 - weight);
+		}
+	}
+}
+
+/* Split a packed RGB image into overlapping panels, and feather the
+   overlapping regions so the seams don't show once printed. */
 int dyesub_pano_split_rgb8(const uint8_t *src, uint16_t cols,
 			   uint16_t src_rows, uint8_t numpanels,
 			   uint16_t overlap_rows, uint16_t max_rows,
 			   uint8_t *panels[3],
 			   uint16_t panel_rows[3])
 {
+	struct dyesub_pano_blend pb;
+	uint32_t rowlen = cols * 3;
+	uint32_t src_row = 0;
+	int i, ret;
+
 	/* Do nothing if there's no point */
 	if (numpanels < 2 || src_rows <= max_rows)
 		return CUPS_BACKEND_OK;
 
 	/* Work out panel sizes if not specified */
 	if (panel_rows[0] == 0) {
-		panel_rows[0] = max_rows;
-		panel_rows[1] = src_rows - panel_rows[0] + overlap_rows;
-		if (numpanels > 2)
-			panel_rows[2] = src_rows - panel_rows[0] - panel_rows[1] + overlap_rows*2;
+		ret = dyesub_pano_panel_rows(src_rows, &numpanels, overlap_rows,
+					     max_rows, panel_rows);
+		if (ret)
+			return ret;
 	}
 
 	/* Copy panel data */
-	memcpy(panels[0], src, cols * panel_rows[0] * 3);
-	memcpy(panels[1], src + (panel_rows[0] - overlap_rows) * 3, cols * panel_rows[1] * 3);
-	if (numpanels > 2)
-		memcpy(panels[2], src + (panel_rows[0] - overlap_rows + panel_rows[1] - overlap_rows) * 3, cols * panel_rows[2] * 3);
+	for (i = 0 ; i < numpanels ; i++) {
+		memcpy(panels[i], src + src_row * rowlen, panel_rows[i] * rowlen);
+		src_row += panel_rows[i] - overlap_rows;
+	}
+
+	/* And blend the overlaps */
+	pb.panels = panels;
+	pb.panel_rows = panel_rows;
+	pb.numpanels = numpanels;
+	pb.overlap_rows = overlap_rows;
+	pb.rowlen = rowlen;
+
+	return dyesub_process_bands(overlap_rows, 64, dyesub_pano_blend_band, &pb);
+}
+
+#if defined(USE_PTHREADS)
+struct dyesub_band {
+	dyesub_band_fn fn;
+	void *arg;
+	uint32_t start;
+	uint32_t end;
+};
+
+static void *dyesub_band_thread(void *vband)
+{
+	struct dyesub_band *band = vband;
+
+	band->fn(band->arg, band->start, band->end);
+
+	return NULL;
+}
+#endif
+
+/* Split 'rows' into contiguous bands and run 'fn' over each of them,
+   in parallel if possible.  Bands never overlap, and each is at least
+   'min_band_rows' long (other than possibly the last one). */
+int dyesub_process_bands(uint32_t rows, uint32_t min_band_rows,
+			 dyesub_band_fn fn, void *arg)
+{
+#if defined(USE_PTHREADS)
+	pthread_t threads[MAX_THREADS];
+	struct dyesub_band bands[MAX_THREADS];
+	int started[MAX_THREADS];
+	int num = max_threads;
+	uint32_t band_rows;
+	int i;
+
+	if (num <= 0)
+		num = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num > MAX_THREADS)
+		num = MAX_THREADS;
+	if (min_band_rows && rows / min_band_rows < (uint32_t) num)
+		num = rows / min_band_rows;
+	if (num <= 1)
+		goto serial;
+
+	band_rows = (rows + num - 1) / num;
+
+	for (i = 0 ; i < num ; i++) {
+		bands[i].fn = fn;
+		bands[i].arg = arg;
+		bands[i].start = i * band_rows;
+		bands[i].end = bands[i].start + band_rows;
+		if (bands[i].end > rows)
+			bands[i].end = rows;
+		started[i] = 0;
+	}
+
+	/* The first band is handled by the calling thread */
+	for (i = 1 ; i < num ; i++) {
+		if (bands[i].start >= bands[i].end)
+			continue;
+		if (!pthread_create(&threads[i], NULL, dyesub_band_thread, &bands[i]))
+			started[i] = 1;
+	}
+
+	dyesub_band_thread(&bands[0]);
+
+	for (i = 1 ; i < num ; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else if (bands[i].start < bands[i].end)
+			dyesub_band_thread(&bands[i]);  /* Thread creation failed */
+	}
+
+	return CUPS_BACKEND_OK;
+
+serial:
+#else
+	UNUSED(min_band_rows);
+#endif
+	fn(arg, 0, rows);
 
 	return CUPS_BACKEND_OK;
 }
 
 int dyesub_joblist_canwait(struct dyesub_joblist *list)
 {
-	if (list->num_entries == DYESUB_MAX_JOB_ENTRIES)
+	const struct dyesub_job_common *job;
+
+	/* Make sure there's room for whatever the next read_parse returns */
+	if (list->num_entries + MAX_JOBS_FROM_READ_PARSE > DYESUB_MAX_JOB_ENTRIES)
 		return 0;
 	if (!list->num_entries)
 		return 1;
 
-	return ((const struct dyesub_job_common *)(list->entries[list->num_entries - 1]))->can_combine;
+	job = list->entries[list->num_entries - 1];
+
+	/* A job still reading its own data off the input must be
+	   printed before we can read anything more */
+	if (job->owns_input)
+		return 0;
+
+	/* Wait if the most recent job could still be combined; nothing
+	   further back gets paired up (see __dyesub_append_job) */
+	return (job->can_combine && job->copies == 1);
 }
 
-int dyesub_joblist_print(const struct dyesub_joblist *list, int *pagenum)
+int dyesub_joblist_print(struct dyesub_joblist *list, int *pagenum)
 {
 	int i, j;
 	int ret;
@@ -2005,6 +4398,12 @@ int dyesub_joblist_print(const struct dyesub_joblist *list, int *pagenum)
 			if (list->entries[j]) {
 				int copies = ((const struct dyesub_job_common *)(list->entries[j]))->copies;
 
+				/* Streamed input can only be sent once */
+				if (i && ((const struct dyesub_job_common *)(list->entries[j]))->owns_input) {
+					ERROR("Can't print a streamed job more than once!\n");
+					return CUPS_BACKEND_CANCEL;
+				}
+
 				INFO("Printing page %d (%d copies)\n", ++(*pagenum), copies);
 				if (test_mode >= TEST_MODE_NOPRINT )
 					WARNING("**** TEST MODE, bypassing printing!\n");
@@ -2012,6 +4411,14 @@ int dyesub_joblist_print(const struct dyesub_joblist *list, int *pagenum)
 				/* Print this page */
 				if (test_mode < TEST_MODE_NOPRINT ||
 				    list->backend->flags & BACKEND_FLAG_DUMMYPRINT) {
+					ret = dyesub_joblist_prepared(list, j);
+					if (ret)
+						return ret;
+
+					/* Get a head start on the next page */
+					if (j + 1 < list->num_entries)
+						dyesub_joblist_prepare(list, j + 1);
+
 					ret = list->backend->main_loop(list->ctx, list->entries[j], wait_on_return);
 					if (ret)
 						return ret;
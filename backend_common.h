@@ -50,15 +50,29 @@
 #endif
 
 #define STR_LEN_MAX 64
-#define STATE( ... ) do { if (!quiet) fprintf(logger, "STATE: " __VA_ARGS__ ); } while(0)
-#define ATTR( ... ) do { if (!quiet) fprintf(logger, "ATTR: " __VA_ARGS__ ); } while(0)
-#define PAGE( ... ) do { if (!quiet) fprintf(logger, "PAGE: " __VA_ARGS__ ); } while(0)
-#define DEBUG( ... ) do { if (!quiet) fprintf(logger, "DEBUG: " __VA_ARGS__ ); } while(0)
-#define DEBUG2( ... ) do { if (!quiet) fprintf(logger, __VA_ARGS__ ); } while(0)
-#define INFO( ... )  do { if (!quiet) fprintf(logger, "INFO: " __VA_ARGS__ ); } while(0)
-#define WARNING( ... )  do { fprintf(logger, "WARNING: " __VA_ARGS__ ); } while(0)
-#define ERROR( ... ) do { fprintf(logger, "ERROR: " __VA_ARGS__ ); sleep(1); } while (0)
-#define PPD( ... ) do { fprintf(logger, "PPD: " __VA_ARGS__ ); } while (0)
+/* Logging.  Messages are collected in a buffer and written out in
+   batches; anything at INFO or above flushes it straight away, so CUPS
+   sees status and errors promptly.  Only DEBUG output is held back. */
+enum {
+	DYESUB_LOG_DEBUG = 0,
+	DYESUB_LOG_INFO,
+	DYESUB_LOG_WARNING,
+	DYESUB_LOG_ERROR,
+};
+
+void dyesub_log(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void dyesub_log_hex(const char *prefix, const uint8_t *buf, int len);
+void dyesub_log_flush(void);
+
+#define STATE( ... ) do { if (!quiet) dyesub_log(DYESUB_LOG_INFO, "STATE: " __VA_ARGS__ ); } while(0)
+#define ATTR( ... ) do { if (!quiet) dyesub_log(DYESUB_LOG_INFO, "ATTR: " __VA_ARGS__ ); } while(0)
+#define PAGE( ... ) do { if (!quiet) dyesub_log(DYESUB_LOG_INFO, "PAGE: " __VA_ARGS__ ); } while(0)
+#define DEBUG( ... ) do { if (!quiet) dyesub_log(DYESUB_LOG_DEBUG, "DEBUG: " __VA_ARGS__ ); } while(0)
+#define DEBUG2( ... ) do { if (!quiet) dyesub_log(DYESUB_LOG_DEBUG, __VA_ARGS__ ); } while(0)
+#define INFO( ... )  do { if (!quiet) dyesub_log(DYESUB_LOG_INFO, "INFO: " __VA_ARGS__ ); } while(0)
+#define WARNING( ... )  do { dyesub_log(DYESUB_LOG_WARNING, "WARNING: " __VA_ARGS__ ); } while(0)
+#define ERROR( ... ) do { dyesub_log(DYESUB_LOG_ERROR, "ERROR: " __VA_ARGS__ ); } while (0)
+#define PPD( ... ) do { dyesub_log(DYESUB_LOG_INFO, "PPD: " __VA_ARGS__ ); } while (0)
 
 #if (__BYTE_ORDER == __LITTLE_ENDIAN)
 #define le16_to_cpu(__x) __x
@@ -216,7 +230,11 @@ struct dyesub_connection {
 	int type; /* P_XXXX */
 };
 
-#define DYESUB_MAX_JOB_ENTRIES 3
+#define MAX_JOBS_FROM_READ_PARSE 3
+/* Room for a few pending pages to combine with, plus one more read_parse */
+#define DYESUB_MAX_JOB_ENTRIES (3 + MAX_JOBS_FROM_READ_PARSE)
+
+struct dyesub_prep;
 
 struct dyesub_joblist {
 	// TODO: mutex/lock
@@ -225,18 +243,47 @@ struct dyesub_joblist {
 	int num_entries;
 	int copies;
 	const void *entries[DYESUB_MAX_JOB_ENTRIES];
+	struct dyesub_prep *prep[DYESUB_MAX_JOB_ENTRIES]; /* prepare_job state */
 };
-#define MAX_JOBS_FROM_READ_PARSE 3
 
 /* This MUST be the start of every per-printer job struct! */
 struct dyesub_job_common {
 	size_t jobsize;
 	int copies;
 	int can_combine;
+	int can_fold;  /* Identical follow-on jobs may be added to 'copies' */
+	int owns_input; /* The rest of this job is still unread on the input,
+			   and main_loop will read it; nothing else may be
+			   read until this job has been printed */
+};
+
+/* Reference-counted buffers, so combined jobs can share image data
+   with the jobs they were built from instead of copying it */
+void *dyesub_buf_alloc(size_t len);
+void *dyesub_buf_realloc(void *buf, size_t len); /* Unshared buffers only */
+const void *dyesub_buf_ref(const void *buf);
+void dyesub_buf_free(const void *buf);
+
+/* Scatter-gather list of data to send */
+#define DYESUB_MAX_SEGS 32
+struct dyesub_seg {
+	const uint8_t *data; /* NULL means 'len' copies of 'fill' */
+	uint32_t len;
+	uint8_t fill;
+};
+struct dyesub_seglist {
+	int num;
+	uint32_t len;
+	struct dyesub_seg seg[DYESUB_MAX_SEGS];
 };
 
+int dyesub_seglist_add(struct dyesub_seglist *list, const uint8_t *data, uint32_t len);
+int dyesub_seglist_fill(struct dyesub_seglist *list, uint8_t fill, uint32_t len);
+void dyesub_seglist_gather(const struct dyesub_seglist *list, uint8_t *dst);
+
 /* Exported functions */
 int send_data(struct dyesub_connection *conn, const uint8_t *buf, int len);
+int send_seglist(struct dyesub_connection *conn, const struct dyesub_seglist *list);
 int read_data(struct dyesub_connection *conn,
 	       uint8_t *buf, int buflen, int *readlen);
 
@@ -248,6 +295,37 @@ void print_help(const char *argv0, const struct dyesub_backend *backend);
 int dyesub_read_file(const char *filename, void *databuf, int datalen,
 		     int *actual_len);
 
+/* Buffered reads from the spool data.  These behave like read(2) on
+   the given fd, but pull data in large chunks behind the scenes, so
+   parsers can ask for a few bytes at a time without a syscall each.
+   All reads from an input fd must go through these. */
+int dyesub_read(int fd, void *buf, int len);
+int dyesub_read_full(int fd, void *buf, int len);
+int dyesub_peek(int fd, const uint8_t **data, int len);
+const uint8_t *dyesub_read_span(int fd, int len);
+
+/* Persistent cache for data that is slow to fetch from the printer */
+void *dyesub_cache_load(const char *key, int extra, int *len);
+int dyesub_cache_store(const char *key, const void *data, int len);
+
+/* Content-addressed cache of processed print data, so repeated images
+   (collated copies, reprints) skip the image processing library.
+   Keys are built with dyesub_hash() over the input image and every
+   parameter that affects the output, plus dyesub_hash_file() and
+   dyesub_hash_lib() for the tables and library that produce it.  Kept in RAM, and optionally in
+   CACHE_PATH.  Only call these with the prepare lock held. */
+#define DYESUB_HASH_INIT 0xcbf29ce484222325ULL
+uint64_t dyesub_hash(uint64_t hash, const void *data, size_t len);
+uint64_t dyesub_hash_file(uint64_t hash, const char *fname);
+uint64_t dyesub_hash_lib(uint64_t hash, void *dl_handle, void *sym);
+int dyesub_outcache_get(uint64_t key, void *buf, size_t len,
+			void *extra, size_t extralen);
+void dyesub_outcache_put(uint64_t key, const void *buf, size_t len,
+			 const void *extra, size_t extralen);
+
+/* Note that the backend's markers were just refreshed from the printer */
+void dyesub_status_touch(void);
+
 uint16_t uint16_to_packed_bcd(uint16_t val);
 uint32_t packed_bcd_to_uint32(const char *in, int len);
 
@@ -262,13 +340,26 @@ int backend_claim_interface(struct libusb_device_handle *dev, int iface,
 struct dyesub_joblist *dyesub_joblist_create(const struct dyesub_backend *backend, void *ctx);
 int dyesub_joblist_appendjob(struct dyesub_joblist *list, const void *job);
 void dyesub_joblist_cleanup(const struct dyesub_joblist *list);
-int dyesub_joblist_print(const struct dyesub_joblist *list, int *pagenum);
+int dyesub_joblist_print(struct dyesub_joblist *list, int *pagenum);
 const void *dyesub_joblist_popjob(struct dyesub_joblist *list);
 int dyesub_joblist_canwait(struct dyesub_joblist *list);
 
+/* prepare_job() calls never overlap one another.  Anything in main_loop()
+   that changes state prepare_job() relies on must hold this lock. */
+void dyesub_prepare_lock(void);
+void dyesub_prepare_unlock(void);
+
 #define BACKEND_FLAG_BADISERIAL 0x00000001
 #define BACKEND_FLAG_DUMMYPRINT 0x00000002
 
+/* Image processing helpers */
+typedef void (*dyesub_band_fn)(void *arg, uint32_t start_row, uint32_t end_row);
+int dyesub_process_bands(uint32_t rows, uint32_t min_band_rows,
+			 dyesub_band_fn fn, void *arg);
+
+int dyesub_pano_panel_rows(uint16_t src_rows, uint8_t *numpanels,
+			   uint16_t overlap_rows, uint16_t max_rows,
+			   uint16_t panel_rows[3]);
 int dyesub_pano_split_rgb8(const uint8_t *src, uint16_t cols,
 			   uint16_t src_rows, uint8_t numpanels,
 			   uint16_t overlap_rows, uint16_t max_rows,
@@ -291,6 +382,7 @@ struct dyesub_backend {
 	void *(*combine_jobs)(const void *job1, const void *job2);
 	int  (*job_polarity)(void *ctx);
 	int  (*main_loop)(void *ctx, const void *job, int wait_on_return);
+	int  (*prepare_job)(void *ctx, const void *job); /* Optional, runs on a worker thread */
 	int  (*query_serno)(struct dyesub_connection *conn, char *buf, int buf_len); /* Optional */
 	int  (*query_markers)(void *ctx, struct marker **markers, int *count);
 	int  (*query_stats)(void *ctx, struct printerstats *stats); /* Optional */
@@ -309,8 +401,10 @@ extern int collate;
 extern int test_mode;
 extern int quiet;
 extern const char *corrtable_path;
+extern const char *cache_path;
 extern FILE *logger;
 extern int stats_only;
+extern int max_threads;
 
 enum {
 	TEST_MODE_NONE = 0,
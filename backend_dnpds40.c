@@ -58,9 +58,20 @@ struct dnpds40_printjob {
 	int fullcut;
 	int printspeed;
 	int can_rewind;
+	uint32_t media;  /* What was loaded when we parsed the job */
+	int type;        /* And which printer it was parsed for */
 
 	int buf_needed;
 	int cut_paper;
+
+	int buflen;
+	int in_fd;     /* Where the rest comes from, if common.owns_input */
+	uint32_t stream_remain; /* Unread payload of the last parsed command */
+
+	/* Combined jobs are sent from here, which references our own
+	   databuf as well as the source jobs' */
+	struct dyesub_seglist segs;
+	const void *shared[2];
 };
 
 #define MFG_DNP 0
@@ -80,6 +91,7 @@ struct dnpds40_ctx {
 	int ver_minor;
 
 	/* State */
+	const void *streamed; /* Last job whose input was streamed out */
 	uint32_t media;
 	uint32_t media_subtype;
 
@@ -222,18 +234,173 @@ static int legacy_qw410_read_parse(struct dnpds40_printjob *job, int data_fd, in
 static void dnpds40_cleanup_job(const void *vjob);
 static int dnpds40_query_markers(void *vctx, struct marker **markers, int *count);
 
+/* Ways of putting two prints onto one sheet.  'first' ends up at the
+   start of the plane data.  Sizes are at 300dpi. */
+static const struct dnp_imposition {
+	uint32_t first;
+	uint32_t second;
+	uint32_t multicut;
+	uint16_t cols;
+	uint16_t rows;
+	int16_t gap;  /* Rows between the two images; negative overlaps */
+} dnp_impositions[] = {
+	{ MULTICUT_5x3_5, MULTICUT_5x3_5, MULTICUT_5x3_5X2, 1920, 2176, 0 },
+	{ MULTICUT_6x4, MULTICUT_6x4, MULTICUT_6x4X2, 1920, 2498, 18 },
+	{ MULTICUT_6x4_5, MULTICUT_6x4_5, MULTICUT_6x4_5X2, 1920, 2802, 30 },
+	{ MULTICUT_8x4, MULTICUT_8x4, MULTICUT_8x4X2, 2560, 2502, 30 },
+	{ MULTICUT_8x5, MULTICUT_8x5, MULTICUT_8x5X2, 2560, 3102, 30 },
+	{ MULTICUT_8x6, MULTICUT_8x6, MULTICUT_8x6X2, 2560, 3702, 30 },
+	{ MULTICUT_A4x5, MULTICUT_A4x5, MULTICUT_A4x5X2, 2560, 3102, 30 },
+	{ MULTICUT_A5, MULTICUT_A5, MULTICUT_A5X2, 2560, 3598, 30 },
+	/* Mixed 8" sizes */
+	{ MULTICUT_8x5, MULTICUT_8x4, MULTICUT_8x5_8x4, 2560, 2802, 30 },
+	{ MULTICUT_8x6, MULTICUT_8x4, MULTICUT_8x6_8x4, 2560, 3102, 30 },
+	{ MULTICUT_8x6, MULTICUT_8x5, MULTICUT_8x6_8x5, 2560, 3402, 30 },
+	{ MULTICUT_8x8, MULTICUT_8x4, MULTICUT_8x8_8x4, 2560, 3702, 30 },
+	{ MULTICUT_8x4X2, MULTICUT_8x4, MULTICUT_8x4X3, 2560, 3768, 30 },
+};
+
+/* 6x4 prints with 2" cuts get their middle borders chopped off instead */
+static const struct dnp_imposition dnp_imposition_6x4_2inch =
+	{ MULTICUT_6x4, MULTICUT_6x4, MULTICUT_6x8, 1920, 2436, -44 };
+
+/* 8x8 (including 8x4*2) leaves room for an 8x4 on 8x12 media */
+static int dnp_can_stack(uint32_t media, uint32_t multicut)
+{
+	return media == 510 &&
+		(multicut == MULTICUT_8x8 || multicut == MULTICUT_8x4X2);
+}
+
+/* Returns a reference to the job's complete data stream.  Combined
+   jobs only have it as a segment list, so that has to be gathered. */
+static const uint8_t *dnp_job_data(const struct dnpds40_printjob *job, int *len)
+{
+	uint8_t *buf;
+
+	if (!job->segs.num) {
+		*len = job->datalen;
+		return dyesub_buf_ref(job->databuf);
+	}
+
+	buf = dyesub_buf_alloc(job->segs.len);
+	if (!buf) {
+		ERROR("Memory allocation failure!\n");
+		return NULL;
+	}
+	dyesub_seglist_gather(&job->segs, buf);
+	*len = job->segs.len;
+
+	return buf;
+}
+
+/* Locate the data block for the plane named 'which' (ie 'Y'PLANE) */
+static const uint8_t *dnp_find_plane(const uint8_t *data, int len, uint8_t which, int *pixlen)
+{
+	const uint8_t *ptr = data;
+	char buf[9];
+
+	buf[8] = 0;
+	while (ptr + 32 <= data + len) {
+		int i;
+		memcpy(buf, ptr + 24, 8);
+		i = atoi(buf) + 32;
+		if (ptr[8] == which && !memcmp("PLANE", ptr + 9, 5)) {
+			*pixlen = i - 32 - 1088;
+			return ptr;
+		}
+		ptr += i;
+	}
+
+	return NULL;
+}
+
 #define JOB_EQUIV(__x)  if (job1->__x != job2->__x) goto done
 
 /* NOTE:  Does _not_ free the input jobs */
+/* Figure out the number of printer buffers a job needs */
+static int dnpds40_bufs_needed(int type, uint32_t dpi, int matte, uint32_t multicut)
+{
+	int bufs = 1;
+
+	if (dpi != 600)
+		return bufs;
+
+	switch(type) {
+	case P_DNP_DS620:
+		if (multicut == MULTICUT_6x9 ||
+		    multicut == MULTICUT_6x4_5X2)
+			bufs = 2;
+		break;
+	case P_DNP_DS80:  /* DS80/CX-W */
+		if (matte && (multicut == MULTICUT_8xA4LEN ||
+			      multicut == MULTICUT_8x4X3 ||
+			      multicut == MULTICUT_8x8_8x4 ||
+			      multicut == MULTICUT_8x6X2 ||
+			      multicut == MULTICUT_8x12))
+			bufs = 2;
+		break;
+	case P_DNP_DS80D:
+		if (matte) {
+			int mcut = multicut;
+
+			if (mcut > MULTICUT_S_BACK)
+				mcut -= MULTICUT_S_BACK;
+			else if (mcut > MULTICUT_S_FRONT)
+				mcut -= MULTICUT_S_FRONT;
+
+			if (mcut == MULTICUT_8xA4LEN ||
+			    mcut == MULTICUT_8x4X3 ||
+			    mcut == MULTICUT_8x8_8x4 ||
+			    mcut == MULTICUT_8x6X2 ||
+			    mcut == MULTICUT_8x12)
+				bufs = 2;
+
+			if (mcut == MULTICUT_S_8x12 ||
+			    mcut == MULTICUT_S_8x6X2 ||
+			    mcut == MULTICUT_S_8x4X3)
+				bufs = 2;
+		}
+		break;
+	case P_DNP_DS820:
+		// Nothing; all sizes only need 1 buffer
+		break;
+	case P_CITIZEN_CW01:
+		bufs = 2;
+		break;
+	default: /* DS40/CX/RX1/CY/everything else */
+		if (matte) {
+			if (multicut == MULTICUT_6x8 ||
+			    multicut == MULTICUT_6x9 ||
+			    multicut == MULTICUT_6x4X2 ||
+			    multicut == MULTICUT_5x7 ||
+			    multicut == MULTICUT_5x3_5X2)
+				bufs = 2;
+
+		} else {
+			if (multicut == MULTICUT_6x8 ||
+			    multicut == MULTICUT_6x9 ||
+			    multicut == MULTICUT_6x4X2)
+				bufs = 1;
+		}
+		break;
+	}
+
+	return bufs;
+}
+
 static void *dnp_combine_jobs(const void *vjob1,
 			      const void *vjob2)
 {
 	const struct dnpds40_printjob *job1 = vjob1;
 	const struct dnpds40_printjob *job2 = vjob2;
 	struct dnpds40_printjob *newjob = NULL;
-	uint32_t new_multicut;
+	const struct dnp_imposition *imp = NULL;
+	const uint8_t *data1, *data2;
+	int len1, len2;
+	int swap = 0;
 	uint16_t new_w, new_h;
 	int32_t gap_bytes;
+	int i;
 
 	/* Sanity check */
 	if (!job1 || !job2)
@@ -244,8 +411,6 @@ static void *dnp_combine_jobs(const void *vjob1,
 	JOB_EQUIV(matte);
 	JOB_EQUIV(cutter);
 	JOB_EQUIV(fullcut);
-	JOB_EQUIV(multicut);  // TODO:  Support fancier modes for 8" models (eg 8x4+8x6, etc)
-	JOB_EQUIV(datalen); // <-- cheating a little?
 	// JOV_EQUIV(printspeed); <-- does it matter?
 
 	/* Any fancy cutter action means we pass */
@@ -257,72 +422,38 @@ static void *dnp_combine_jobs(const void *vjob1,
 		goto done;
 
 	/* Make sure we can combine these two prints */
-	switch (job1->multicut) {
-	case MULTICUT_5x3_5:
-		new_multicut = MULTICUT_5x3_5X2;
-		new_w = 1920;
-		new_h = 2176;
-		gap_bytes = 0;
-		break;
-	case MULTICUT_6x4:
-		if (job1->cutter == 120) {
-			new_multicut = MULTICUT_6x8;
-			new_h = 2436;
-			gap_bytes = -44;  /* Chop out the middle 44 rows */
-		} else {
-			new_multicut = MULTICUT_6x4X2;
-			new_h = 2498;
-			gap_bytes = 18;
+	if (job1->cutter == 120) {
+		if (job1->multicut == MULTICUT_6x4 && job2->multicut == MULTICUT_6x4)
+			imp = &dnp_imposition_6x4_2inch;
+	} else {
+		for (i = 0 ; i < (int)(sizeof(dnp_impositions) / sizeof(dnp_impositions[0])) ; i++) {
+			if (dnp_impositions[i].first == job1->multicut &&
+			    dnp_impositions[i].second == job2->multicut) {
+				imp = &dnp_impositions[i];
+				break;
+			}
+			if (dnp_impositions[i].first == job2->multicut &&
+			    dnp_impositions[i].second == job1->multicut) {
+				imp = &dnp_impositions[i];
+				swap = 1;
+				break;
+			}
 		}
-		new_w = 1920;
-		break;
-	case MULTICUT_6x4_5:
-		new_multicut = MULTICUT_6x4_5X2;
-		new_w = 1920;
-		new_h = 2802;
-		gap_bytes = 30;
-		break;
-	case MULTICUT_8x4:
-		new_multicut = MULTICUT_8x4X2;
-		new_w = 2560;
-		new_h = 2502;
-		gap_bytes = 30;
-		break;
-	case MULTICUT_8x5:
-		new_multicut = MULTICUT_8x5X2;
-		new_w = 2560;
-		new_h = 3102;
-		gap_bytes = 30;
-		break;
-	case MULTICUT_A4x5:
-		new_multicut = MULTICUT_A4x5X2;
-		new_w = 2560;
-		new_h = 3102;
-		gap_bytes = 30;
-		break;
-	case MULTICUT_A5:
-		new_multicut = MULTICUT_A5X2;
-		new_w = 2560;
-		new_h = 3598;
-		gap_bytes = 30;
-		break;
-	case MULTICUT_8x6:
-		new_multicut = MULTICUT_8x6X2;
-		new_w = 2560;
-		new_h = 3702;
-		gap_bytes = 30;
-		break;
-	default:
-		/* Everything else is NOT handled */
-		goto done;
 	}
-	gap_bytes *= new_w;
+	/* Everything else is NOT handled */
+	if (!imp)
+		goto done;
+
+	new_w = imp->cols;
+	new_h = imp->rows;
+	gap_bytes = imp->gap * new_w;
 	if (job1->dpi == 600) {
 		gap_bytes *= 2;
 		new_h *= 2;
 	}
 
-	DEBUG("Combining jobs to save media\n");
+	DEBUG("Combining jobs to save media (%u + %u -> %u)\n",
+	      job1->multicut, job2->multicut, imp->multicut);
 
 	/* Okay, it's kosher to proceed */
 
@@ -332,82 +463,133 @@ static void *dnp_combine_jobs(const void *vjob1,
 		goto done;
 	}
 	memcpy(newjob, job1, sizeof(*newjob));
+	newjob->databuf = NULL;
+	memset(&newjob->segs, 0, sizeof(newjob->segs));
+	newjob->shared[0] = newjob->shared[1] = NULL;
+
+	/* Either job may itself be a combined one */
+	data1 = dnp_job_data(job1, &len1);
+	newjob->shared[0] = data1;
+	data2 = dnp_job_data(job2, &len2);
+	newjob->shared[1] = data2;
+	if (!data1 || !data2)
+		goto fail;
+
+	/* Our own buffer only needs to hold job1's commands and plane
+	   headers, the image data is referenced from the source jobs */
+	const uint8_t *ptr;
+	char buf[11];  /* Extra padding to shut up GCC */
+	int hdrlen = 0;
+
+	ptr = data1;
+	while(ptr < (data1 + len1)) {
+		buf[8] = 0;
+		memcpy(buf, ptr + 24, 8);
+		i = atoi(buf) + 32;
+		if (!memcmp("PLANE", ptr + 9, 5))
+			hdrlen += 32 + 1088;
+		else
+			hdrlen += i;
+		ptr += i;
+	}
 
-	newjob->databuf = malloc(((new_w*new_h+1024+54+10))*3+1024 + abs(gap_bytes));
+	newjob->buflen = hdrlen;
+	newjob->databuf = dyesub_buf_alloc(newjob->buflen);
 	newjob->datalen = 0;
-	newjob->multicut = new_multicut;
+	newjob->multicut = imp->multicut;
 	newjob->can_rewind = 0;
-	newjob->common.can_combine = 0;
+	newjob->common.can_combine = dnp_can_stack(job1->media, imp->multicut);
 	if (!newjob->databuf) {
-		dnpds40_cleanup_job(newjob);
-		newjob = NULL;
 		ERROR("Memory allocation failure!\n");
-		goto done;
+		goto fail;
 	}
 
+	/* The combined size may need more buffers than either half */
+	newjob->buf_needed = dnpds40_bufs_needed(job1->type, newjob->dpi,
+						 newjob->matte, imp->multicut);
+
 	/* Copy data blocks from job1 */
-	uint8_t *ptr, *ptr2;
-	char buf[9];
-	ptr = job1->databuf;
-	while(ptr && ptr < (job1->databuf + job1->datalen)) {
-		int i;
+	ptr = data1;
+	while(ptr < (data1 + len1)) {
+		uint8_t *hdr = newjob->databuf + newjob->datalen;
+		int ret;
 		buf[8] = 0;
 		memcpy(buf, ptr + 24, 8);
 		i = atoi(buf) + 32;
-		memcpy(newjob->databuf + newjob->datalen, ptr, i);
 
 		/* If we're on a plane data block... */
-		if (!memcmp("PLANE", newjob->databuf + newjob->datalen + 9, 5)) {
+		if (!memcmp("PLANE", ptr + 9, 5)) {
 			long planelen = (new_w * new_h) + 1088;
+			const uint8_t *ptr2, *pix_a, *pix_b;
+			int pixlen1 = i - 32 - 1088;
+			int pixlen2, len_a, len_b;
 			uint32_t newlen;
 
+			/* Locate job2's matching PLANE */
+			ptr2 = dnp_find_plane(data2, len2, ptr[8], &pixlen2);
+			if (!ptr2 || pixlen1 + pixlen2 + gap_bytes != new_w * new_h) {
+				DEBUG("Plane sizes don't add up, not combining\n");
+				goto fail;
+			}
+
+			memcpy(hdr, ptr, 32 + 1088);
+
 			/* Fix up length in command */
 			snprintf(buf, sizeof(buf), "%08ld", planelen);
-			memcpy(newjob->databuf + newjob->datalen + 24, buf, 8);
+			memcpy(hdr + 24, buf, 8);
 
 			/* Alter BMP header */
 			newlen = cpu_to_le32(planelen);
-			memcpy(newjob->databuf + newjob->datalen + 32 + 2, &newlen, 4);
+			memcpy(hdr + 32 + 2, &newlen, 4);
 
 			/* alter DIB header */
 			newlen = cpu_to_le32(new_h);
-			memcpy(newjob->databuf + newjob->datalen + 32 + 22, &newlen, 4);
-
-			if (gap_bytes > 0) {
-				/* Insert gap/padding after first image */
-				memset(newjob->databuf + newjob->datalen + i, 0xff, gap_bytes);
-				newjob->datalen += gap_bytes;
-			} else {
-//				uint8_t *ptrA = newjob->databuf + newjob->datalen + 1088;
-//				/* Back off by 1/2 the gap */
-//				memmove(ptrA, ptrA - (gap_bytes / 2), (i - 1088) + gap_bytes/2);
-				/* And chop the end off by half the gap */
-				newjob->datalen += gap_bytes / 2;
+			memcpy(hdr + 32 + 22, &newlen, 4);
+
+			newjob->datalen += 32 + 1088;
+
+			/* Image 'a' goes first */
+			pix_a = ptr + 32 + 1088;
+			len_a = pixlen1;
+			pix_b = ptr2 + 32 + 1088;
+			len_b = pixlen2;
+			if (swap) {
+				pix_a = ptr2 + 32 + 1088;
+				len_a = pixlen2;
+				pix_b = ptr + 32 + 1088;
+				len_b = pixlen1;
 			}
 
-			/* Locate job2's PLANE -- Assume it's in the same place! */
-			ptr2 = job2->databuf + (ptr - job1->databuf);
-
-			/* Copy over job2's image data */
-			memcpy(newjob->databuf + newjob->datalen + i,
-			        ptr2 + 32 + 1088, i - 32 - 1088);
-
-			if (gap_bytes < 0) {
-				uint8_t *ptrA = newjob->databuf + newjob->datalen + i;
-				/* Back off by 1/2 the gap */
-				memmove(ptrA, ptrA - (gap_bytes / 2), (i - 1088) + gap_bytes/2);
-				/* And chop the end off by half the gap */
-				newjob->datalen += gap_bytes / 2;
+			ret = dyesub_seglist_add(&newjob->segs, hdr, 32 + 1088);
+			if (gap_bytes >= 0) {
+				/* Insert gap/padding between the two images */
+				ret |= dyesub_seglist_add(&newjob->segs, pix_a, len_a);
+				ret |= dyesub_seglist_fill(&newjob->segs, 0xff, gap_bytes);
+				ret |= dyesub_seglist_add(&newjob->segs, pix_b, len_b);
+			} else {
+				/* Chop half the gap off the end of the first
+				   image, and half off the start of the second */
+				ret |= dyesub_seglist_add(&newjob->segs, pix_a, len_a + gap_bytes / 2);
+				ret |= dyesub_seglist_add(&newjob->segs, pix_b - gap_bytes / 2, len_b + gap_bytes / 2);
 			}
-			newjob->datalen += i - 32 - 1088;  /* add in job2 length */
+			if (ret)
+				goto fail;
+		} else {
+			memcpy(hdr, ptr, i);
+			newjob->datalen += i;
+			if (dyesub_seglist_add(&newjob->segs, hdr, i))
+				goto fail;
 		}
 
-		newjob->datalen += i;
 		ptr += i;
 	}
 
 done:
 	return newjob;
+
+fail:
+	dnpds40_cleanup_job(newjob);
+	return NULL;
 }
 
 #undef JOB_EQUIV
@@ -1402,7 +1584,9 @@ static void dnpds40_cleanup_job(const void *vjob) {
 	const struct dnpds40_printjob *job = vjob;
 
 	if (job->databuf)
-		free(job->databuf);
+		dyesub_buf_free(job->databuf);
+	dyesub_buf_free(job->shared[0]);
+	dyesub_buf_free(job->shared[1]);
 
 	free((void*)job);
 }
@@ -1458,64 +1642,59 @@ static int dnpds40_query_status(struct dnpds40_ctx *ctx)
 
 #define MAX_PRINTJOB_LEN (((ctx->native_width*ctx->max_height+1024+54+10))*3+1024) /* Worst-case, YMC */
 
-static int dnpds40_read_parse(void *vctx, const void **vjob, int data_fd, int copies) {
-	struct dnpds40_ctx *ctx = vctx;
-	int run = 1;
-	char buf[9] = { 0 };
+/* When streaming, only the commands up to the first image plane are
+   held in memory, along with enough of that plane to validate it. */
+#define STREAM_HDR_LEN   (64*1024)
+#define STREAM_PEEK_LEN  1088  /* BMP header + palette */
+#define STREAM_CHUNK_LEN (256*1024)
 
-	struct dnpds40_printjob *job = NULL;
+static int dnpds40_job_reserve(struct dnpds40_ctx *ctx, struct dnpds40_printjob *job, int len)
+{
+	uint8_t *buf;
 
-	if (!ctx)
-		return CUPS_BACKEND_FAILED;
+	if (job->datalen + len <= job->buflen)
+		return CUPS_BACKEND_OK;
 
-	job = malloc(sizeof(*job));
-	if (!job) {
-		ERROR("Memory allocation failure!\n");
-		return CUPS_BACKEND_RETRY_CURRENT;
+	if (job->datalen + len > (int)MAX_PRINTJOB_LEN) {
+		ERROR("Print job too large! (%d/%d)\n", job->datalen + len, (int)MAX_PRINTJOB_LEN);
+		return CUPS_BACKEND_CANCEL;
 	}
-	memset(job, 0, sizeof(*job));
-	job->common.jobsize = sizeof(*job);
-	job->printspeed = -1;
-
-	/* There's no way to figure out the total job length in advance, we
-	   have to parse the stream until we get to the image plane data,
-	   and even then the stream can contain arbitrary commands later.
-
-	   So instead, we allocate a buffer of the maximum possible length,
-	   then parse the incoming stream until we hit the START command at
-	   the end of the job.
-	*/
 
-	job->databuf = malloc(MAX_PRINTJOB_LEN);
-	if (!job->databuf) {
-		dnpds40_cleanup_job(job);
+	buf = dyesub_buf_realloc(job->databuf, MAX_PRINTJOB_LEN);
+	if (!buf) {
 		ERROR("Memory allocation failure!\n");
 		return CUPS_BACKEND_RETRY_CURRENT;
 	}
+	job->databuf = buf;
+	job->buflen = MAX_PRINTJOB_LEN;
+
+	return CUPS_BACKEND_OK;
+}
+
+/* Parse the incoming stream until we hit the START command at the end of
+   the job.  If the job is being streamed, stop once we've seen the start
+   of the first image plane instead. */
+static int dnpds40_parse_cmds(struct dnpds40_ctx *ctx, struct dnpds40_printjob *job, int data_fd)
+{
+	int run = 1;
+	char buf[9] = { 0 };
 
 	while (run) {
-		int remain, i, j;
+		int remain, i, j, want;
+
+		if ((i = dnpds40_job_reserve(ctx, job, sizeof(struct dnpds40_cmd)))) {
+			dnpds40_cleanup_job(job);
+			return i;
+		}
+
 		/* Read in command header */
-		i = read(data_fd, job->databuf + job->datalen,
-			 sizeof(struct dnpds40_cmd));
+		i = dyesub_read_full(data_fd, job->databuf + job->datalen,
+				     sizeof(struct dnpds40_cmd));
 		if (i < 0) {
 			dnpds40_cleanup_job(job);
 			return i;
 		} else if (i == 0) {
 			break;
-		} else if (i < (int) sizeof(struct dnpds40_cmd)) {
-			int r = i;
-			i = read(data_fd, job->databuf + job->datalen + r, sizeof(struct dnpds40_cmd) - r);
-			if (i < 0) {
-				dnpds40_cleanup_job(job);
-				return i;
-			} else if (i == 0) {
-				break;
-			} else if (i < (int)(sizeof(struct dnpds40_cmd) - r)) {
-				ERROR("Double short read (%d + %d vs %d)\n", r, i, (int)sizeof(struct dnpds40_cmd));
-				dnpds40_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
 		}
 
 		/* Special case handling for beginning of job */
@@ -1523,6 +1702,13 @@ static int dnpds40_read_parse(void *vctx, const void **vjob, int data_fd, int co
 			/* See if job lacks the standard ESC-P start sequence */
 			if (job->databuf[job->datalen + 0] != 0x1b ||
 			    job->databuf[job->datalen + 1] != 0x50) {
+				/* Legacy formats are always fully buffered */
+				job->common.owns_input = 0;
+				if ((j = dnpds40_job_reserve(ctx, job, MAX_PRINTJOB_LEN))) {
+					dnpds40_cleanup_job(job);
+					return j;
+				}
+
 				switch(ctx->conn->type) {
 				case P_DNP_QW410:
 					i = legacy_qw410_read_parse(job, data_fd, i);
@@ -1545,36 +1731,45 @@ static int dnpds40_read_parse(void *vctx, const void **vjob, int data_fd, int co
 					break;
 				}
 
-				if (i == CUPS_BACKEND_OK) {
-					goto parsed;
-				}
-				dnpds40_cleanup_job(job);
+				if (i != CUPS_BACKEND_OK)
+					dnpds40_cleanup_job(job);
 				return i;
 			}
 		}
+		if (i < (int) sizeof(struct dnpds40_cmd)) {
+			ERROR("Short read (%d vs %d)\n", i, (int)sizeof(struct dnpds40_cmd));
+			dnpds40_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
 
 		/* Parse out length of data chunk, if any */
 		memcpy(buf, job->databuf + job->datalen + 24, 8);
 		j = atoi(buf);
 
+		if ((i = dnpds40_job_reserve(ctx, job, sizeof(struct dnpds40_cmd) + j))) {
+			dnpds40_cleanup_job(job);
+			return i;
+		}
+
+		/* When streaming, only peek at the image plane header */
+		want = j;
+		if (job->common.owns_input && j > STREAM_PEEK_LEN &&
+		    !memcmp("PLANE", job->databuf + job->datalen + 9, 5))
+			want = STREAM_PEEK_LEN;
+
 		/* Read in data chunk as quickly as possible */
-		remain = j;
-		while (remain > 0) {
-			i = read(data_fd, job->databuf + job->datalen + sizeof(struct dnpds40_cmd),
-				 remain);
-			if (i < 0) {
-				ERROR("Data Read Error: %d (%d/%d @%d/%d)\n", i, remain, j, job->datalen,MAX_PRINTJOB_LEN);
-				dnpds40_cleanup_job(job);
-				return i;
-			}
-			if (i == 0) {
-				dnpds40_cleanup_job(job);
-				return 1;
-			}
-			job->datalen += i;
-			remain -= i;
+		remain = want;
+		i = dyesub_read_full(data_fd, job->databuf + job->datalen + sizeof(struct dnpds40_cmd),
+				     remain);
+		if (i < 0) {
+			ERROR("Data Read Error: %d (%d/%d @%d/%d)\n", i, remain, j, job->datalen, job->buflen);
+			dnpds40_cleanup_job(job);
+			return i;
+		}
+		if (i != remain) {
+			dnpds40_cleanup_job(job);
+			return 1;
 		}
-		job->datalen -= j; /* Back it off */
 
 		/* Check for some offsets */
 		if(!memcmp("CNTRL QTY", job->databuf + job->datalen+2, 9)) {
@@ -1690,9 +1885,87 @@ static int dnpds40_read_parse(void *vctx, const void **vjob, int data_fd, int co
 			run = 0;
 
 		/* Add in the size of this chunk */
-		job->datalen += sizeof(struct dnpds40_cmd) + j;
+		job->datalen += sizeof(struct dnpds40_cmd) + want;
+
+		/* Leave the rest of the payload for the main loop */
+		if (want != j) {
+			job->stream_remain = j - want;
+			break;
+		}
+	}
+
+	return CUPS_BACKEND_OK;
+}
+
+/* Pull the remainder of a partially-parsed job into memory */
+static int dnpds40_buffer_rest(struct dnpds40_ctx *ctx, struct dnpds40_printjob *job, int data_fd)
+{
+	int ret;
+
+	job->common.owns_input = 0;
+	if (!job->stream_remain)
+		return CUPS_BACKEND_OK;
+
+	if ((ret = dnpds40_job_reserve(ctx, job, job->stream_remain))) {
+		dnpds40_cleanup_job(job);
+		return ret;
+	}
+
+	ret = dyesub_read_full(data_fd, job->databuf + job->datalen, job->stream_remain);
+	if (ret != (int)job->stream_remain) {
+		ERROR("Data Read Error: %d (%u @%d)\n", ret, job->stream_remain, job->datalen);
+		dnpds40_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
+	}
+	job->datalen += ret;
+	job->stream_remain = 0;
+
+	return dnpds40_parse_cmds(ctx, job, data_fd);
+}
+
+static int dnpds40_read_parse(void *vctx, const void **vjob, int data_fd, int copies) {
+	struct dnpds40_ctx *ctx = vctx;
+	int ret;
+
+	struct dnpds40_printjob *job = NULL;
+
+	if (!ctx)
+		return CUPS_BACKEND_FAILED;
+
+	job = malloc(sizeof(*job));
+	if (!job) {
+		ERROR("Memory allocation failure!\n");
+		return CUPS_BACKEND_RETRY_CURRENT;
+	}
+	memset(job, 0, sizeof(*job));
+	job->common.jobsize = sizeof(*job);
+	job->printspeed = -1;
+	ctx->streamed = NULL;
+
+	/* There's no way to figure out the total job length in advance, we
+	   have to parse the stream until we get to the image plane data,
+	   and even then the stream can contain arbitrary commands later.
+
+	   So unless we can stream the image data directly to the printer,
+	   we grow the buffer to the maximum possible length, then parse
+	   the incoming stream until we hit the START command at the end of
+	   the job.
+	*/
+	job->in_fd = data_fd;
+	if (test_mode < TEST_MODE_NOPRINT && !(collate && ncopies > 1))
+		job->common.owns_input = 1;
+
+	job->buflen = (job->common.owns_input) ? STREAM_HDR_LEN : (int)MAX_PRINTJOB_LEN;
+	job->databuf = dyesub_buf_alloc(job->buflen);
+	if (!job->databuf) {
+		dnpds40_cleanup_job(job);
+		ERROR("Memory allocation failure!\n");
+		return CUPS_BACKEND_RETRY_CURRENT;
 	}
-parsed:
+
+	if ((ret = dnpds40_parse_cmds(ctx, job, data_fd)))
+		return ret;
+
 	/* If we have no data.. don't bother */
 	if (!job->datalen) {
 		dnpds40_cleanup_job(job);
@@ -1782,69 +2055,9 @@ parsed:
 	}
 
 	/* Figure out the number of buffers we need. */
-	job->buf_needed = 1;
-
-	if (job->dpi == 600) {
-		switch(ctx->conn->type) {
-		case P_DNP_DS620:
-			if (job->multicut == MULTICUT_6x9 ||
-			    job->multicut == MULTICUT_6x4_5X2)
-				job->buf_needed = 2;
-			break;
-		case P_DNP_DS80:  /* DS80/CX-W */
-			if (job->matte && (job->multicut == MULTICUT_8xA4LEN ||
-					   job->multicut == MULTICUT_8x4X3 ||
-					   job->multicut == MULTICUT_8x8_8x4 ||
-					   job->multicut == MULTICUT_8x6X2 ||
-					   job->multicut == MULTICUT_8x12))
-				job->buf_needed = 2;
-			break;
-		case P_DNP_DS80D:
-			if (job->matte) {
-				int mcut = job->multicut;
-
-				if (mcut > MULTICUT_S_BACK)
-					mcut -= MULTICUT_S_BACK;
-				else if (mcut > MULTICUT_S_FRONT)
-					mcut -= MULTICUT_S_FRONT;
-
-				if (mcut == MULTICUT_8xA4LEN ||
-				    mcut == MULTICUT_8x4X3 ||
-				    mcut == MULTICUT_8x8_8x4 ||
-				    mcut == MULTICUT_8x6X2 ||
-				    mcut == MULTICUT_8x12)
-					job->buf_needed = 2;
-
-				if (mcut == MULTICUT_S_8x12 ||
-				    mcut == MULTICUT_S_8x6X2 ||
-				    mcut == MULTICUT_S_8x4X3)
-					job->buf_needed = 2;
-			}
-			break;
-		case P_DNP_DS820:
-			// Nothing; all sizes only need 1 buffer
-			break;
-		case P_CITIZEN_CW01:
-			job->buf_needed = 2;
-			break;
-		default: /* DS40/CX/RX1/CY/everything else */
-			if (job->matte) {
-				if (job->multicut == MULTICUT_6x8 ||
-				    job->multicut == MULTICUT_6x9 ||
-				    job->multicut == MULTICUT_6x4X2 ||
-				    job->multicut == MULTICUT_5x7 ||
-				    job->multicut == MULTICUT_5x3_5X2)
-					job->buf_needed = 2;
+	job->buf_needed = dnpds40_bufs_needed(ctx->conn->type, job->dpi,
+					      job->matte, job->multicut);
 
-			} else {
-				if (job->multicut == MULTICUT_6x8 ||
-				    job->multicut == MULTICUT_6x9 ||
-				    job->multicut == MULTICUT_6x4X2)
-					job->buf_needed = 1;
-			}
-			break;
-		}
-	}
 	if (job->dpi == 334 && ctx->conn->type != P_CITIZEN_CW01)
 	{
 		ERROR("Illegal resolution (%u) for printer!\n", job->dpi);
@@ -2103,13 +2316,121 @@ skip_checks:
 	DEBUG("job->dpi %u matte %d mcut %u cutter %d/%d, bufs %d spd %d\n",
 	      job->dpi, job->matte, job->multicut, job->cutter, job->fullcut, job->buf_needed, job->printspeed);
 
-	job->common.can_combine = job->can_rewind; /* Any rewindable size can be stacked */
+	/* Any rewindable size can be stacked, as can anything that leaves
+	   enough room on the media for another print */
+	job->media = ctx->media;
+	job->type = ctx->conn->type;
+	job->common.can_combine = job->can_rewind ||
+		dnp_can_stack(job->media, job->multicut);
+
+	/* Jobs we might combine, or need to resend, have to be in memory */
+	if (job->common.owns_input &&
+	    (job->common.can_combine || job->cutter == 120)) {
+		if ((ret = dnpds40_buffer_rest(ctx, job, data_fd)))
+			return ret;
+	}
+	if (!job->stream_remain)
+		job->common.owns_input = 0;
+
+	/* Repeats of this job can become printer copies, unless it's still
+	   streaming or part of a multi-pass lamination */
+	job->common.can_fold = (!job->common.owns_input && job->matte <= 100 &&
+				!ctx->partialmatte);
 
 	*vjob = job;
 
 	return CUPS_BACKEND_OK;
 }
 
+/* Forward the remainder of a streamed job to the printer, validating
+   each command header as we go. */
+static int dnpds40_stream_rest(struct dnpds40_ctx *ctx, const struct dnpds40_printjob *job)
+{
+	uint8_t *chunk;
+	uint32_t remain = job->stream_remain;
+	int last = 0;
+	int ret = CUPS_BACKEND_OK;
+	char buf[17] = { 0 };
+
+	/* Whatever happens from here on, this job's input is gone */
+	ctx->streamed = job;
+
+	chunk = malloc(STREAM_CHUNK_LEN);
+	if (!chunk) {
+		ERROR("Memory allocation failure!\n");
+		return CUPS_BACKEND_RETRY_CURRENT;
+	}
+
+	while (1) {
+		int len;
+
+		/* Finish off the current command's payload */
+		while (remain) {
+			len = dyesub_read(job->in_fd, chunk, min(remain, STREAM_CHUNK_LEN));
+			if (len <= 0) {
+				ERROR("Data Read Error: %d (%u)\n", len, remain);
+				ret = CUPS_BACKEND_CANCEL;
+				goto done;
+			}
+			if (send_data(ctx->conn, chunk, len)) {
+				ret = CUPS_BACKEND_FAILED;
+				goto done;
+			}
+			remain -= len;
+		}
+
+		if (last)
+			break;
+
+		/* Read in the next command header */
+		len = dyesub_read_full(job->in_fd, chunk, sizeof(struct dnpds40_cmd));
+		if (len < 0) {
+			ERROR("Data Read Error: %d\n", len);
+			ret = CUPS_BACKEND_CANCEL;
+			goto done;
+		}
+		if (len == 0)
+			break;  /* No START command, but nothing more to send */
+		if (len < (int) sizeof(struct dnpds40_cmd) ||
+		    chunk[0] != 0x1b || chunk[1] != 0x50) {
+			ERROR("Unrecognized command in data stream!\n");
+			ret = CUPS_BACKEND_CANCEL;
+			goto done;
+		}
+
+		memcpy(buf, chunk + 24, 8);
+		remain = atoi(buf);
+
+		/* We already sent our own versions of these, and it's too
+		   late to change them now.  Don't print it wrong. */
+		if (!memcmp("CNTRL QTY", chunk + 2, 9) ||
+		    !memcmp("CNTRL CUTTER", chunk + 2, 12) ||
+		    !memcmp("CNTRL BUFFCNTRL", chunk + 2, 15) ||
+		    !memcmp("CNTRL OVERCOAT", chunk + 2, 14) ||
+		    !memcmp("CNTRL PRINTSPEED", chunk + 2, 16) ||
+		    !memcmp("IMAGE MULTICUT", chunk + 2, 14)) {
+			memcpy(buf, chunk + 2, 16);
+			buf[16] = 0;
+			ERROR("Job setting (%s) follows image data, aborting job\n", buf);
+			ret = CUPS_BACKEND_CANCEL;
+			goto done;
+		}
+
+		/* This is the last block.. */
+		if (!memcmp("CNTRL START", chunk + 2, 11))
+			last = 1;
+
+		if (send_data(ctx->conn, chunk, sizeof(struct dnpds40_cmd))) {
+			ret = CUPS_BACKEND_FAILED;
+			goto done;
+		}
+	}
+
+done:
+	free(chunk);
+	return ret;
+}
+
 static int dnpds40_main_loop(void *vctx, const void *vjob, int wait_on_return) {
 	struct dnpds40_ctx *ctx = vctx;
 	int ret;
@@ -2180,6 +2501,11 @@ static int dnpds40_main_loop(void *vctx, const void *vjob, int wait_on_return) {
 	}
 
 top:
+	/* The input of a streamed job can only be sent once */
+	if (ctx->streamed == job) {
+		ERROR("Can't resend a job streamed from the input!\n");
+		return CUPS_BACKEND_CANCEL;
+	}
 
 	/* Query status */
 	status = dnpds40_query_status(ctx);
@@ -2364,19 +2690,33 @@ top:
 	}
 
 	/* Finally, send the stream over as individual data chunks */
-	ptr = job->databuf;
+	if (job->segs.num) {
+		if ((ret = send_seglist(ctx->conn, &job->segs)))
+			return CUPS_BACKEND_FAILED;
+	}
+	ptr = job->segs.num ? NULL : job->databuf;
 	while(ptr && ptr < (job->databuf + job->datalen)) {
 		int i;
 		buf[8] = 0;
 		memcpy(buf, ptr + 24, 8);
 		i = atoi(buf) + 32;
 
+		/* Streamed jobs end partway through a chunk */
+		if (ptr + i > job->databuf + job->datalen)
+			i = job->databuf + job->datalen - ptr;
+
 		if ((ret = send_data(ctx->conn,
 				     ptr, i)))
 			return CUPS_BACKEND_FAILED;
 
 		ptr += i;
 	}
+
+	/* And the rest, if it's coming straight from the input */
+	if (job->common.owns_input) {
+		if ((ret = dnpds40_stream_rest(ctx, job)))
+			return ret;
+	}
 	sleep(1);  /* Give things a moment */
 
 	/* Reset partial matte state if necessary */
@@ -3375,6 +3715,8 @@ static int dnpds40_query_markers(void *vctx, struct marker **markers, int *count
 		}
 	}
 
+	dyesub_status_touch();
+
 	return CUPS_BACKEND_OK;
 }
 
@@ -3483,7 +3825,7 @@ static const char *dnpds40_prefixes[] = {
 
 const struct dyesub_backend dnpds40_backend = {
 	.name = "DNP DS-series / Citizen C-series",
-	.version = "0.145",
+	.version = "0.153",
 	.uri_prefixes = dnpds40_prefixes,
 	.cmdline_usage = dnpds40_cmdline,
 	.cmdline_arg = dnpds40_cmdline_arg,
@@ -3546,17 +3888,12 @@ static int legacy_spool_helper(struct dnpds40_printjob *job, int data_fd,
 	remain -= j;
 
 	/* Read in the remaining spool data */
-	while (remain) {
-		i = read(data_fd, buf + j, remain);
-
-		if (i < 0) {
-			free(buf);
-			return i;
-		}
-
-		remain -= i;
-		j += i;
+	i = dyesub_read_full(data_fd, buf + j, remain);
+	if (i != remain) {
+		free(buf);
+		return (i < 0) ? i : CUPS_BACKEND_CANCEL;
 	}
+	j += i;
 
 	if (parse_dpi) {
 		/* Parse out Y DPI */
@@ -308,6 +308,9 @@ struct hiti_gpjobhdr {
 #define PAYLOAD_FLAG_YMCPLANAR 0x01
 #define PAYLOAD_FLAG_NOCORRECT 0x02
 
+/* Rows of YMC planar data sent to the printer are padded to 4 bytes */
+#define YMC_STRIDE(__cols) (((__cols) + 3) & ~3)
+
 #define HDR_COOKIE 0x54485047
 
 /* CMD_EFD_SF for non-CS systems */
@@ -391,6 +394,14 @@ struct hiti_matrix {
 /* @100 */
 } __attribute__((packed));
 
+/* Cached correction/heat table file contents */
+struct hiti_tablecache {
+	const char *fname;
+	uint16_t ribbonvendor;
+	uint8_t *buf;
+	int len;
+};
+
 /* Private data structure */
 struct hiti_printjob {
 	struct dyesub_job_common common;
@@ -435,6 +446,13 @@ struct hiti_ctx {
 		uint32_t len;
 	} *heattable_v2;
 	uint8_t num_heattable_entries;
+
+	struct hiti_tablecache corrdata;
+	struct hiti_tablecache heatdata;
+
+	/* Spare image buffer, recycled between jobs */
+	uint8_t *spare_buf;
+	uint32_t spare_len;
 };
 
 /* Prototypes */
@@ -964,6 +982,27 @@ static void *hiti_init(void)
 	return ctx;
 }
 
+static void hiti_teardown(void *vctx)
+{
+	struct hiti_ctx *ctx = vctx;
+
+	if (!ctx)
+		return;
+
+	if (ctx->corrdata.buf)
+		free(ctx->corrdata.buf);
+	if (ctx->heatdata.buf)
+		free(ctx->heatdata.buf);
+	if (ctx->heattable_buf)
+		free(ctx->heattable_buf);
+	if (ctx->heattable_v2)
+		free(ctx->heattable_v2);
+	if (ctx->spare_buf)
+		free(ctx->spare_buf);
+
+	free(ctx);
+}
+
 static int hiti_attach(void *vctx, struct dyesub_connection *conn, uint8_t jobid)
 {
 	struct hiti_ctx *ctx = vctx;
@@ -1060,13 +1099,54 @@ static void hiti_cleanup_job(const void *vjob) {
 	free((void*)job);
 }
 
+/* Returns the contents of the requested table file, which stay valid until
+   the next lookup using the same cache.  As long as the filename and the
+   loaded media are unchanged the previously-read data is reused as-is. */
+static const uint8_t *hiti_get_cached_table(struct hiti_ctx *ctx,
+					    struct hiti_tablecache *cache,
+					    const char *fname, int maxlen,
+					    int *len)
+{
+	char full[2048];
+	int ret;
+
+	if (cache->buf && cache->fname &&
+	    cache->ribbonvendor == ctx->ribbonvendor &&
+	    !strcmp(cache->fname, fname)) {
+		*len = cache->len;
+		return cache->buf;
+	}
+
+	/* All users of a given cache share the same maximum length */
+	if (!cache->buf) {
+		cache->buf = malloc(maxlen);
+		if (!cache->buf) {
+			WARNING("Memory allocation failure!\n");
+			return NULL;
+		}
+	}
+	cache->fname = NULL;
+
+	snprintf(full, sizeof(full), "%s/%s", corrtable_path, fname);
+
+	ret = dyesub_read_file(full, cache->buf, maxlen, &cache->len);
+	if (ret)
+		return NULL;
+
+	cache->fname = fname;
+	cache->ribbonvendor = ctx->ribbonvendor;
+
+	*len = cache->len;
+	return cache->buf;
+}
+
 #define CORRECTION_FILE_SIZE (33*33*33*3 + 2)
 
-static uint8_t *hiti_get_correction_data(struct hiti_ctx *ctx, uint8_t mode)
+static const uint8_t *hiti_get_correction_data(struct hiti_ctx *ctx, uint8_t mode)
 {
 	const char *fname = NULL;
-	uint8_t *buf;
-	int ret, len;
+	const uint8_t *buf;
+	int len;
 
 	int mediaver = ctx->ribbonvendor & 0x3f;
 	int mediatype = ctx->ribbonvendor & 0xf000;
@@ -1263,23 +1343,13 @@ static uint8_t *hiti_get_correction_data(struct hiti_ctx *ctx, uint8_t mode)
 	if (!fname)
 		return NULL;
 
-	buf = malloc(CORRECTION_FILE_SIZE);
-	if (!buf) {
-		WARNING("Memory allocation failure!\n");
-		return NULL;
-	}
-
-	char full[2048];
-	snprintf(full, sizeof(full), "%s/%s", corrtable_path, fname);
-
-	ret = dyesub_read_file(full, buf, CORRECTION_FILE_SIZE, &len);
-	if (ret) {
-		free(buf);
+	buf = hiti_get_cached_table(ctx, &ctx->corrdata, fname,
+				    CORRECTION_FILE_SIZE, &len);
+	if (!buf)
 		return NULL;
-	}
 	if (len != CORRECTION_FILE_SIZE) {
 		WARNING("Read len mismatch\n");
-		free(buf);
+		ctx->corrdata.fname = NULL;
 		return NULL;
 	}
 
@@ -1287,7 +1357,7 @@ static uint8_t *hiti_get_correction_data(struct hiti_ctx *ctx, uint8_t mode)
 }
 
 static int hiti_seht2(struct hiti_ctx *ctx, uint8_t plane,
-		      uint8_t *buf, uint32_t buf_len)
+		      const uint8_t *buf, uint32_t buf_len)
 {
 	uint8_t cmdbuf[sizeof(struct hiti_seht2)];
 	struct hiti_seht2 *cmd = (struct hiti_seht2 *)cmdbuf;
@@ -1328,7 +1398,7 @@ static int hiti_seht2(struct hiti_ctx *ctx, uint8_t plane,
 	return ret;
 }
 
-static int hiti_cvd(struct hiti_ctx *ctx, uint8_t *buf, uint32_t buf_len)
+static int hiti_cvd(struct hiti_ctx *ctx, const uint8_t *buf, uint32_t buf_len)
 {
 	uint8_t cmdbuf[sizeof(struct hiti_cmd)];
 	struct hiti_cmd *cmd = (struct hiti_cmd *)cmdbuf;
@@ -1493,71 +1563,71 @@ static const char* hiti_get_heat_file(struct hiti_ctx *ctx, uint8_t mode)
 static int hiti_send_heat_data(struct hiti_ctx *ctx, uint8_t mode, uint8_t matte)
 {
 	const char *fname = NULL;
-	union {
+	union hiti_heattable_v1 {
 		struct hiti_heattable_v1a v1a;
-		struct hiti_heattable_v1a v1b;
-	} table;
-	uint8_t *y, *m, *c, *o, *om, *cvd;
+		struct hiti_heattable_v1b v1b;
+	} blank;
+	const union hiti_heattable_v1 *table;
+	const uint8_t *y, *m, *c, *o, *om, *cvd;
 
 	int ret, len;
 
 	fname = hiti_get_heat_file(ctx, mode);
 
 	if (fname) {
-		char full[2048];
-		snprintf(full, sizeof(full), "%s/%s", corrtable_path, fname);
-
-		ret = dyesub_read_file(full, (uint8_t*) &table, sizeof(table), &len);
-		if (ret) {
-			return ret;
+		table = (const union hiti_heattable_v1 *) hiti_get_cached_table(ctx, &ctx->heatdata, fname, sizeof(*table), &len);
+		if (!table) {
+			return CUPS_BACKEND_FAILED;
 		}
 		switch(len) {
 		case sizeof(struct hiti_heattable_v1a):
-			y = table.v1a.y;
-			m = table.v1a.m;
-			c = table.v1a.c;
-			o = table.v1a.o;
-			om = table.v1a.om;
-			cvd = table.v1a.cvd;
+			y = table->v1a.y;
+			m = table->v1a.m;
+			c = table->v1a.c;
+			o = table->v1a.o;
+			om = table->v1a.om;
+			cvd = table->v1a.cvd;
 			break;
 		case sizeof(struct hiti_heattable_v1b):
-			y = table.v1b.y;
-			m = table.v1b.m;
-			c = table.v1b.c;
-			o = table.v1b.o;
-			om = table.v1b.om;
-			cvd = table.v1b.cvd;
+			y = table->v1b.y;
+			m = table->v1b.m;
+			c = table->v1b.c;
+			o = table->v1b.o;
+			om = table->v1b.om;
+			cvd = table->v1b.cvd;
 			break;
 		default:
 			ERROR("Heattable len mismatch (%d)\n", len);
+			ctx->heatdata.fname = NULL;
 			return CUPS_BACKEND_FAILED;
 		}
 	} else {
-		memset(&table, 0, sizeof(table));
-		y = table.v1a.y;
-		m = table.v1a.m;
-		c = table.v1a.c;
-		o = table.v1a.o;
-		om = table.v1a.om;
-		cvd = table.v1a.cvd;
+		memset(&blank, 0, sizeof(blank));
+		table = &blank;
+		y = table->v1a.y;
+		m = table->v1a.m;
+		c = table->v1a.c;
+		o = table->v1a.o;
+		om = table->v1a.om;
+		cvd = table->v1a.cvd;
 	}
 
 	/* Send over the heat tables */
-	ret = hiti_seht2(ctx, 0, y, sizeof(table.v1a.om));
+	ret = hiti_seht2(ctx, 0, y, sizeof(table->v1a.om));
 	if (!ret)
-		ret = hiti_seht2(ctx, 1, m, sizeof(table.v1a.om));
+		ret = hiti_seht2(ctx, 1, m, sizeof(table->v1a.om));
 	if (!ret)
-		ret = hiti_seht2(ctx, 2, c, sizeof(table.v1a.om));
+		ret = hiti_seht2(ctx, 2, c, sizeof(table->v1a.om));
 	if (!ret) {
 		if (matte)
-			ret = hiti_seht2(ctx, 3, om, sizeof(table.v1a.om));
+			ret = hiti_seht2(ctx, 3, om, sizeof(table->v1a.om));
 		else
-			ret = hiti_seht2(ctx, 3, o, sizeof(table.v1a.o));
+			ret = hiti_seht2(ctx, 3, o, sizeof(table->v1a.o));
 	}
 
 	/* And finally, send over the CVD data */
 	if (!ret)
-		ret = hiti_cvd(ctx, cvd, sizeof(table.v1a.cvd));
+		ret = hiti_cvd(ctx, cvd, sizeof(table->v1a.cvd));
 
 	return ret;
 }
@@ -1601,7 +1671,7 @@ static void hiti_interp_init(void)
 }
 
 /* src and dst are RGB tuples */
-static void hiti_interp33_256(uint8_t *dst, uint8_t *src, const uint8_t *pTable)
+static void hiti_interp33_256(uint8_t *dst, const uint8_t *src, const uint8_t *pTable)
 {
 	struct rgb p1_pos, p2_pos, p3_pos, p4_pos;
 	struct rgb p1_val, p2_val, p3_val, p4_val;
@@ -1743,6 +1813,106 @@ static void hiti_interp33_256(uint8_t *dst, uint8_t *src, const uint8_t *pTable)
 
 }
 
+/* Hand out the spare image buffer if it's large enough, otherwise
+   allocate a fresh one. */
+static uint8_t *hiti_get_buffer(struct hiti_ctx *ctx, uint32_t len)
+{
+	uint8_t *buf;
+
+	if (ctx->spare_buf && ctx->spare_len >= len) {
+		buf = ctx->spare_buf;
+		ctx->spare_buf = NULL;
+		ctx->spare_len = 0;
+		return buf;
+	}
+
+	return malloc(len);
+}
+
+/* Stash a no-longer-needed image buffer for the next job */
+static void hiti_put_buffer(struct hiti_ctx *ctx, uint8_t *buf, uint32_t len)
+{
+	if (ctx->spare_buf)
+		free(ctx->spare_buf);
+
+	ctx->spare_buf = buf;
+	ctx->spare_len = len;
+}
+
+struct hiti_convert {
+	const uint8_t *src;
+	uint8_t *dst;
+	const uint8_t *corrdata;
+	uint32_t cols;
+	uint32_t rows;
+	uint32_t stride;
+	int planar;  /* Source is already YMC planar, just needs padding */
+};
+
+/* Converts a band of rows from packed BGR into padded YMC planes, running
+   everything through the correction tables along the way. */
+static void hiti_convert_band(void *arg, uint32_t start, uint32_t end)
+{
+	const struct hiti_convert *conv = arg;
+	uint32_t i, j;
+
+	for (i = start ; i < end ; i++) {
+		uint8_t *rowY = conv->dst + conv->stride * i;
+		uint8_t *rowM = conv->dst + conv->stride * (conv->rows + i);
+		uint8_t *rowC = conv->dst + conv->stride * (conv->rows * 2 + i);
+
+		if (conv->planar) {
+			memcpy(rowY, conv->src + conv->cols * i, conv->cols);
+			memcpy(rowM, conv->src + conv->cols * (conv->rows + i), conv->cols);
+			memcpy(rowC, conv->src + conv->cols * (conv->rows * 2 + i), conv->cols);
+		} else {
+			const uint8_t *bgr = conv->src + conv->cols * i * 3;
+
+			/* Simple optimization; runs of identical pixels are common */
+			uint8_t oldrgb[3] = { 255, 255, 255 };
+			uint8_t destrgb[3] = { 255, 255, 255 };
+
+			if (conv->corrdata)
+				hiti_interp33_256(destrgb, oldrgb, conv->corrdata);
+
+			for (j = 0 ; j < conv->cols ; j++, bgr += 3) {
+				uint8_t rgb[3];
+
+				/* Input data is BGR */
+				rgb[2] = bgr[0];
+				rgb[1] = bgr[1];
+				rgb[0] = bgr[2];
+
+				if (conv->corrdata) {
+					if (rgb[0] != oldrgb[0] ||
+					    rgb[1] != oldrgb[1] ||
+					    rgb[2] != oldrgb[2]) {
+						oldrgb[0] = rgb[0];
+						oldrgb[1] = rgb[1];
+						oldrgb[2] = rgb[2];
+						hiti_interp33_256(destrgb, rgb, conv->corrdata);
+					}
+					rgb[0] = destrgb[0];
+					rgb[1] = destrgb[1];
+					rgb[2] = destrgb[2];
+				}
+
+				/* Finally convert to YMC */
+				rowY[j] = 255 - rgb[2];
+				rowM[j] = 255 - rgb[1];
+				rowC[j] = 255 - rgb[0];
+			}
+		}
+
+		/* Padding is left blank */
+		for (j = conv->cols ; j < conv->stride ; j++) {
+			rowY[j] = 0;
+			rowM[j] = 0;
+			rowC[j] = 0;
+		}
+	}
+}
+
 static int hiti_read_parse(void *vctx, const void **vjob, int data_fd, int copies)
 {
 	struct hiti_ctx *ctx = vctx;
@@ -1762,7 +1932,7 @@ static int hiti_read_parse(void *vctx, const void **vjob, int data_fd, int copie
 	job->common.copies = copies;
 
 	/* Read in header */
-	ret = read(data_fd, &job->hdr, sizeof(job->hdr));
+	ret = dyesub_read_full(data_fd, &job->hdr, sizeof(job->hdr));
 	if (ret < 0 || ret != sizeof(job->hdr)) {
 		hiti_cleanup_job(job);
 		if (ret == 0)
@@ -1771,7 +1941,7 @@ static int hiti_read_parse(void *vctx, const void **vjob, int data_fd, int copie
 		ERROR("Read failed (%d/%d)\n",
 		      ret, (int)sizeof(job->hdr));
 		perror("ERROR: Read failed");
-		return ret;
+		return (ret < 0) ? ret : CUPS_BACKEND_CANCEL;
 	}
 
 	/* Byteswap everything */
@@ -1838,18 +2008,15 @@ static int hiti_read_parse(void *vctx, const void **vjob, int data_fd, int copie
 
 	/* Read in data */
 	uint32_t remain = job->hdr.payload_len;
-	while (remain) {
-		ret = read(data_fd, job->databuf + job->datalen, remain);
-		if (ret < 0) {
-			ERROR("Read failed (%d/%u/%u)\n",
-			      ret, remain, job->datalen);
-			perror("ERROR: Read failed");
-			hiti_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		job->datalen += ret;
-		remain -= ret;
+	ret = dyesub_read_full(data_fd, job->databuf, remain);
+	if (ret != (int)remain) {
+		ERROR("Read failed (%d/%u/%u)\n",
+		      ret, remain, job->datalen);
+		perror("ERROR: Read failed");
+		hiti_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
 	}
+	job->datalen = remain;
 
 	/* Sanity check against paper */
 	switch (ctx->supplies2[0]) {
@@ -1925,86 +2092,50 @@ static int hiti_read_parse(void *vctx, const void **vjob, int data_fd, int copie
 		return CUPS_BACKEND_CANCEL;
 	}
 
-	/* Convert input packed BGR data into YMC planar, if needed */
-	if (!(job->hdr.payload_flag & PAYLOAD_FLAG_YMCPLANAR)) {
+	/* Convert input packed BGR data into (padded) YMC planar, if needed */
+	if (!(job->hdr.payload_flag & PAYLOAD_FLAG_YMCPLANAR) ||
+	    YMC_STRIDE(job->hdr.cols) != job->hdr.cols) {
+		struct hiti_convert conv;
+		uint32_t ymclen;
+
+		conv.cols = job->hdr.cols;
+		conv.rows = job->hdr.rows;
+		conv.stride = YMC_STRIDE(job->hdr.cols);
+		conv.planar = job->hdr.payload_flag & PAYLOAD_FLAG_YMCPLANAR;
+		conv.corrdata = NULL;
+
+		if (job->datalen < conv.cols * conv.rows * 3) {
+			ERROR("Short payload (%u/%u)\n", job->datalen, conv.cols * conv.rows * 3);
+			hiti_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
 
 		/* Load up correction data, if requested */
-		uint8_t *corrdata = NULL;
-		if (!(job->hdr.payload_flag & PAYLOAD_FLAG_NOCORRECT))
-			corrdata = hiti_get_correction_data(ctx, job->hdr.quality);
-		if (corrdata) {
+		if (!conv.planar && !(job->hdr.payload_flag & PAYLOAD_FLAG_NOCORRECT))
+			conv.corrdata = hiti_get_correction_data(ctx, job->hdr.quality);
+		if (conv.corrdata) {
 			INFO("Running input data through correction tables\n");
 			hiti_interp_init();
 		}
 
-		int stride = ((job->hdr.cols * 4) + 3) / 4;
-		uint8_t *ymcbuf = malloc(job->hdr.rows * stride * 3);
-		uint32_t i, j;
-
-		if (!ymcbuf) {
+		ymclen = conv.stride * conv.rows * 3;
+		conv.dst = hiti_get_buffer(ctx, ymclen);
+		if (!conv.dst) {
 			hiti_cleanup_job(job);
 			ERROR("Memory Allocation Failure!\n");
 			return CUPS_BACKEND_FAILED;
 		}
+		conv.src = job->databuf;
 
-		for (i = 0 ; i < job->hdr.rows ; i++) {
-			uint8_t *rowY = ymcbuf + stride * i;
-			uint8_t *rowM = ymcbuf + stride * (job->hdr.rows + i);
-			uint8_t *rowC = ymcbuf + stride * (job->hdr.rows * 2 + i);
-
-			/* Simple optimization */
-			uint8_t oldrgb[3] = { 255, 255, 255 };
-			uint8_t destrgb[3];
-
-			if (corrdata) {
-				hiti_interp33_256(oldrgb, destrgb, corrdata);
-			}
-
-			for (j = 0 ; j < job->hdr.cols ; j++) {
-				uint8_t rgb[3];
-				uint32_t base = (job->hdr.cols * i + j) * 3;
-
-				/* Input data is BGR */
-				rgb[2] = job->databuf[base];
-				rgb[1] = job->databuf[base + 1];
-				rgb[0] = job->databuf[base + 2];
-
-				if (corrdata) {
-					if (rgb[0] == oldrgb[0] &&
-					    rgb[1] == oldrgb[1] &&
-					    rgb[2] == oldrgb[2]) {
-						rgb[0] = destrgb[0];
-						rgb[1] = destrgb[1];
-						rgb[2] = destrgb[2];
-					} else {
-						oldrgb[0] = rgb[0];
-						oldrgb[1] = rgb[1];
-						oldrgb[2] = rgb[2];
-						hiti_interp33_256(rgb, rgb, corrdata);
-						destrgb[0] = rgb[0];
-						destrgb[1] = rgb[1];
-						destrgb[2] = rgb[2];
-					}
-				}
-
-				/* Finally convert to YMC */
-				rowY[j] = 255 - rgb[2];
-				rowM[j] = 255 - rgb[1];
-				rowC[j] = 255 - rgb[0];
-			}
-		}
-
-		/* Nuke the old BGR buffer and replace it with YMC buffer */
-		free(job->databuf);
-		job->databuf = ymcbuf;
-		job->datalen = stride * 3 * job->hdr.cols;
+		dyesub_process_bands(conv.rows, 64, hiti_convert_band, &conv);
 
-		if (corrdata)
-			free(corrdata);
+		/* Recycle the old buffer and replace it with YMC buffer */
+		hiti_put_buffer(ctx, job->databuf, job->hdr.payload_len);
+		job->databuf = conv.dst;
+		job->datalen = ymclen;
 	}
 
-	// XXX YMC planar may need STRIDE correction!
-
+	job->common.can_fold = 1;
 	*vjob = job;
 
 	return CUPS_BACKEND_OK;
@@ -2064,7 +2195,7 @@ static int hiti_main_loop(void *vctx, const void *vjob, int wait_for_return)
 
 	uint16_t resplen = 0;
 	uint16_t rows = job->hdr.rows;
-	uint16_t cols = ((4*job->hdr.cols) + 3) / 4;
+	uint16_t cols = YMC_STRIDE(job->hdr.cols);
 
 	// XXX these two only need to change if rows > 3000
 	uint16_t startLine = 0;
@@ -2594,6 +2725,7 @@ static int hiti_query_markers(void *vctx, struct marker **markers, int *count)
 		return ret;
 
 	ctx->marker.levelnow = ctx->media_remain;
+	dyesub_status_touch();
 
 	return CUPS_BACKEND_OK;
 }
@@ -2698,12 +2830,13 @@ static const char *hiti_prefixes[] = {
 
 const struct dyesub_backend hiti_backend = {
 	.name = "HiTi Photo Printers",
-	.version = "0.41",
+	.version = "0.45",
 	.uri_prefixes = hiti_prefixes,
 	.cmdline_usage = hiti_cmdline,
 	.cmdline_arg = hiti_cmdline_arg,
 	.init = hiti_init,
 	.attach = hiti_attach,
+	.teardown = hiti_teardown,
 	.cleanup_job = hiti_cleanup_job,
 	.read_parse = hiti_read_parse,
 	.main_loop = hiti_main_loop,
@@ -343,7 +343,7 @@ static int kodak1400_read_parse(void *vctx, const void **vjob, int data_fd, int
 	job->common.copies = copies;
 
 	/* Read in then validate header */
-	ret = read(data_fd, &job->hdr, sizeof(job->hdr));
+	ret = dyesub_read_full(data_fd, &job->hdr, sizeof(job->hdr));
 	if (ret < 0 || ret != sizeof(job->hdr)) {
 		if (ret == 0) {
 			kodak1400_cleanup_job(job);
@@ -388,18 +388,14 @@ static int kodak1400_read_parse(void *vctx, const void **vjob, int data_fd, int
 				ptr = NULL;
 
 			remain = job->hdr.columns;
-			do {
-				ret = read(data_fd, ptr, remain);
-				if (ret < 0) {
-					ERROR("Read failed (%d/%d/%u) (%d/%u @ %d)\n",
-					      ret, remain, job->hdr.columns,
-					      i, job->hdr.rows, j);
-					perror("ERROR: Read failed");
-					return CUPS_BACKEND_CANCEL;
-				}
-				ptr += ret;
-				remain -= ret;
-			} while (remain);
+			ret = dyesub_read_full(data_fd, ptr, remain);
+			if (ret != remain) {
+				ERROR("Read failed (%d/%d/%u) (%d/%u @ %d)\n",
+				      ret, remain, job->hdr.columns,
+				      i, job->hdr.rows, j);
+				perror("ERROR: Read failed");
+				return CUPS_BACKEND_CANCEL;
+			}
 		}
 	}
 
@@ -468,7 +464,7 @@ top:
 		return CUPS_BACKEND_STOP;  // HOLD/CANCEL/FAILED?
 	}
 
-	fflush(logger);
+	dyesub_log_flush();
 
 	switch (state) {
 	case S_IDLE:
@@ -424,6 +424,7 @@ static int kodak605_read_parse(void *vctx, const void **vjob, int data_fd, int c
 	/* Use larger of our copy counts */
 	if (job->common.copies < copies)
 		job->common.copies = copies;
+	job->common.can_fold = 1;
 
 	*vjob = job;
 
@@ -473,6 +474,7 @@ static int kodak605_main_loop(void *vctx, const void *vjob, int wait_for_return)
 			ctx->marker.levelnow = sts.donor;
 			dump_markers(&ctx->marker, 1, 0);
 		}
+		dyesub_status_touch();
 
 		if (sts.hdr.result != RESULT_SUCCESS) {
 			ERROR("Printer Status:  %02x (%s)\n", sts.hdr.status,
@@ -611,6 +613,7 @@ retry_print:
 			ctx->marker.levelnow = sts.donor;
 			dump_markers(&ctx->marker, 1, 0);
 		}
+		dyesub_status_touch();
 
 		INFO("Printer Status:  %02x (%s)\n", sts.hdr.status,
 		     sinfonia_status_str(sts.hdr.status));
@@ -895,7 +898,7 @@ static const char *kodak605_prefixes[] = {
 /* Exported */
 const struct dyesub_backend kodak605_backend = {
 	.name = "Kodak 605/70xx",
-	.version = "0.56" " (lib " LIBSINFONIA_VER ")",
+	.version = "0.58" " (lib " LIBSINFONIA_VER ")",
 	.uri_prefixes = kodak605_prefixes,
 	.cmdline_usage = kodak605_cmdline,
 	.cmdline_arg = kodak605_cmdline_arg,
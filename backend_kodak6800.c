@@ -715,6 +715,19 @@ static int kodak6800_attach(void *vctx, struct dyesub_connection *conn, uint8_t
 
 		ctx->media_type = media_code;
 		ctx->supports_sub4x6 = 1;
+
+		/* Stand in for what the printer reports for 6R media, so
+		   size checks and 2-up combining get exercised too */
+		if (media_code == KODAK6_MEDIA_6R ||
+		    media_code == KODAK6_MEDIA_6TR2) {
+			static const struct sinfonia_mediainfo_item sizes_6r[] = {
+				{ .columns = 1844, .rows = 1240, .method = 0x01 },
+				{ .columns = 1844, .rows = 2434, .method = 0x00 },
+				{ .columns = 1844, .rows = 2490, .method = 0x02 },
+			};
+			memcpy(ctx->sizes, sizes_6r, sizeof(sizes_6r));
+			ctx->media_count = sizeof(sizes_6r) / sizeof(sizes_6r[0]);
+		}
 	}
 
 	ctx->marker.color = "#00FFFF#FF00FF#FFFF00";
@@ -742,9 +755,10 @@ static int kodak6800_read_parse(void *vctx, const void **vjob, int data_fd, int
 		return CUPS_BACKEND_RETRY_CURRENT;
 	}
 	memset(job, 0, sizeof(*job));
+	job->common.jobsize = sizeof(*job);
 
 	/* Read in then validate header */
-	ret = read(data_fd, &hdr, sizeof(hdr));
+	ret = dyesub_read_full(data_fd, &hdr, sizeof(hdr));
 	if (ret < 0 || ret != sizeof(hdr)) {
 		if (ret == 0) {
 			sinfonia_cleanup_job(job);
@@ -791,19 +805,14 @@ static int kodak6800_read_parse(void *vctx, const void **vjob, int data_fd, int
 	/* Read in the spool data */
 	{
 		int remain = job->datalen;
-		uint8_t *ptr = job->databuf;
-		do {
-			ret = read(data_fd, ptr, remain);
-			if (ret < 0) {
-				ERROR("Read failed (%d/%d/%d)\n",
-				      ret, remain, job->datalen);
-				perror("ERROR: Read failed");
-				sinfonia_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			ptr += ret;
-			remain -= ret;
-		} while (remain);
+		ret = dyesub_read_full(data_fd, job->databuf, remain);
+		if (ret != remain) {
+			ERROR("Read failed (%d/%d/%d)\n",
+			      ret, remain, job->datalen);
+			perror("ERROR: Read failed");
+			sinfonia_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
 	}
 
 	/* Undo the Windows workaround... */
@@ -849,11 +858,35 @@ static int kodak6800_read_parse(void *vctx, const void **vjob, int data_fd, int
 	job->jp.oc_mode = hdr.laminate;
 	job->jp.method = hdr.method;
 
+	/* See if the loaded media can take two of these at once.  4x6
+	   prints on 8x6 media come through as method 0x01. */
+	if (job->jp.method == PRINT_METHOD_STD || job->jp.method == 0x01) {
+		job->combo = sinfonia_find_2up(ctx->sizes, ctx->media_count, job);
+		job->common.can_combine = !!job->combo;
+	}
+	job->common.can_fold = 1;
+
 	*vjob = job;
 
 	return CUPS_BACKEND_OK;
 }
 
+static void *kodak6800_combine_jobs(const void *vjob1,
+				    const void *vjob2)
+{
+	const struct sinfonia_printjob *job1 = vjob1;
+	struct sinfonia_printjob *newjob;
+
+	newjob = sinfonia_combine_2up(vjob1, vjob2, 0, 0xff);
+	if (!newjob)
+		return NULL;
+
+	/* Print size (ie 8x6) stays the same, only the method changes */
+	newjob->jp.method = job1->combo->method;
+
+	return newjob;
+}
+
 static int kodak6800_main_loop(void *vctx, const void *vjob, int wait_for_return) {
 	struct kodak6800_ctx *ctx = vctx;
 
@@ -891,6 +924,7 @@ static int kodak6800_main_loop(void *vctx, const void *vjob, int wait_for_return
 			ctx->marker.levelnow = ctx->sts.donor;
 			dump_markers(&ctx->marker, 1, 0);
 		}
+		dyesub_status_touch();
 
 		if (ctx->sts.status1 == STATE_STATUS1_ERROR) {
 			INFO("Printer State: %s # %02x %08x %02x\n",
@@ -967,6 +1001,7 @@ static int kodak6800_main_loop(void *vctx, const void *vjob, int wait_for_return
 			ctx->marker.levelnow = ctx->sts.donor;
 			dump_markers(&ctx->marker, 1, 0);
 		}
+		dyesub_status_touch();
 
 		if (ctx->sts.status1 == STATE_STATUS1_ERROR) {
 			INFO("Printer State: %s # %02x %08x %02x\n",
@@ -1063,7 +1098,7 @@ static const char *kodak6800_prefixes[] = {
 /* Exported */
 const struct dyesub_backend kodak6800_backend = {
 	.name = "Kodak 6800/6850",
-	.version = "0.81" " (lib " LIBSINFONIA_VER ")",
+	.version = "0.87" " (lib " LIBSINFONIA_VER ")",
 	.uri_prefixes = kodak6800_prefixes,
 	.cmdline_usage = kodak6800_cmdline,
 	.cmdline_arg = kodak6800_cmdline_arg,
@@ -1075,6 +1110,7 @@ const struct dyesub_backend kodak6800_backend = {
 	.query_serno = kodak6800_query_serno,
 	.query_markers = kodak6800_query_markers,
 	.query_stats = kodak6800_query_stats,
+	.combine_jobs = kodak6800_combine_jobs,
 	.devices = {
 		{ 0x040a, 0x4021, P_KODAK_6800, "Kodak", "kodak-6800"},
 		{ 0x040a, 0x402b, P_KODAK_6850, "Kodak", "kodak-6850"},
@@ -182,13 +182,18 @@ struct rosetta_block {
 
 /* Private data structure */
 struct kodak8800_printjob {
-	size_t jobsize;
-	int copies;
+	struct dyesub_job_common common;
 
-	int copies_offset;
 	uint8_t *databuf;
+	uint32_t datalen;
+	uint32_t copies_offset; /* Of the FlsPgCopies payload, if buffered */
+
+	int in_fd;     /* Where the rest comes from, if common.owns_input */
+	uint32_t stream_remain; /* Payload bytes left in the current block */
 };
 
+#define STREAM_CHUNK_LEN (1024*1024)
+
 struct kodak8800_ctx {
 	struct dyesub_connection *conn;
 
@@ -537,6 +542,7 @@ static void *kodak8800_init(void)
 }
 
 static int kodak8800_query_mfgmodel(struct kodak8800_ctx *ctx);
+static int kodak8800_stream_rest(struct kodak8800_ctx *ctx, const struct kodak8800_printjob *job);
 
 static int kodak8800_attach(void *vctx, struct dyesub_connection *conn, uint8_t jobid)
 {
@@ -602,6 +608,18 @@ static void kodak8800_cleanup_job(const void *vjob)
 	free((void*)job);
 }
 
+static void kodak8800_patch_copies(uint8_t *payload, int copies)
+{
+	uint32_t tmp = 0;
+
+	memcpy(&tmp, payload, sizeof(tmp));
+	tmp = be32_to_cpu(tmp);
+	if ((int)tmp < copies) {
+		tmp = cpu_to_be32(copies);
+		memcpy(payload, &tmp, sizeof(tmp));
+	}
+}
+
 static int kodak8800_read_parse(void *vctx, const void **vjob, int data_fd, int copies) {
 	struct kodak8800_ctx *ctx = vctx;
 	int ret;
@@ -617,6 +635,15 @@ static int kodak8800_read_parse(void *vctx, const void **vjob, int data_fd, int
 		return CUPS_BACKEND_RETRY_CURRENT;
 	}
 	memset(job, 0, sizeof(*job));
+	job->common.jobsize = sizeof(*job);
+	job->common.copies = copies;
+
+	/* Unless the job has to be resent, only the settings blocks are
+	   read in here; the image planes are forwarded straight from
+	   the input as they arrive. */
+	job->in_fd = data_fd;
+	if (!(collate && ncopies > 1))
+		job->common.owns_input = 1;
 
 	/* Read Rosetta data */
 	job->databuf = malloc(sizeof(struct rosetta_header));
@@ -627,7 +654,7 @@ static int kodak8800_read_parse(void *vctx, const void **vjob, int data_fd, int
 	}
 
 	/* Read rosetta header */
-	ret = read(data_fd, job->databuf, sizeof(struct rosetta_header));
+	ret = dyesub_read_full(data_fd, job->databuf, sizeof(struct rosetta_header));
 	if (ret < 0 || ret != sizeof(struct rosetta_header)) {
 		if (ret != 0) {
 			perror("ERROR: read failed");
@@ -635,7 +662,7 @@ static int kodak8800_read_parse(void *vctx, const void **vjob, int data_fd, int
 		kodak8800_cleanup_job(job);
 		return CUPS_BACKEND_CANCEL;
 	}
-	job->jobsize += sizeof(struct rosetta_header);
+	job->datalen += sizeof(struct rosetta_header);
 
 	/* Sanity check header */
 	if (memcmp(job->databuf, "\x1bMndROSETTA V001", 16)) {
@@ -644,20 +671,24 @@ static int kodak8800_read_parse(void *vctx, const void **vjob, int data_fd, int
 		return CUPS_BACKEND_CANCEL;
 	}
 
-	/* Reallocate databuf */
-	job->databuf = realloc(job->databuf, 2624*3624*3+4*1024); // XXX better solution here?
-	if (!job->databuf) {
-		ERROR("Memmory allocation failure!\n");
-		kodak8800_cleanup_job(job);
-		return CUPS_BACKEND_RETRY;
-	}
 	/* Read in the data blocks */
 	while (1) {
-		struct rosetta_block *block = (struct rosetta_block *)(job->databuf + job->jobsize);
+		struct rosetta_block *block;
 		uint32_t payload_len = 0;
+		uint8_t *buf;
+
+		/* Make room for the block header */
+		buf = realloc(job->databuf, job->datalen + sizeof(struct rosetta_block));
+		if (!buf) {
+			ERROR("Memmory allocation failure!\n");
+			kodak8800_cleanup_job(job);
+			return CUPS_BACKEND_RETRY;
+		}
+		job->databuf = buf;
+		block = (struct rosetta_block *)(job->databuf + job->datalen);
 
 		/* Read in block header */
-		ret = read(data_fd, block, sizeof(struct rosetta_block));
+		ret = dyesub_read_full(data_fd, (uint8_t*)block, sizeof(struct rosetta_block));
 		if (ret < 0 || ret != sizeof(struct rosetta_block)) {
 			if (ret != 0) {
 				perror("ERROR: read failed");
@@ -665,11 +696,32 @@ static int kodak8800_read_parse(void *vctx, const void **vjob, int data_fd, int
 			kodak8800_cleanup_job(job);
 			return CUPS_BACKEND_CANCEL;
 		}
+		if (block->esc != 0x1b) {
+			ERROR("Invalid ROSETTA block\n");
+			kodak8800_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
 		payload_len = be32_to_cpu(block->payload_len);
-//		INFO("block %d @ %d \n", payload_len + sizeof(struct rosetta_block), job->jobsize);
+//		INFO("block %d @ %d \n", payload_len + sizeof(struct rosetta_block), job->datalen);
+
+		/* Leave the image data to be streamed */
+		if (job->common.owns_input && !memcmp(block->cmd, "FlsData", 7)) {
+			job->datalen += sizeof(struct rosetta_block);
+			job->stream_remain = payload_len;
+			break;
+		}
 
 		/* Read in block payload */
-		ret = read(data_fd, block->payload, payload_len);
+		buf = realloc(job->databuf, job->datalen + sizeof(struct rosetta_block) + payload_len);
+		if (!buf) {
+			ERROR("Memmory allocation failure!\n");
+			kodak8800_cleanup_job(job);
+			return CUPS_BACKEND_RETRY;
+		}
+		job->databuf = buf;
+		block = (struct rosetta_block *)(job->databuf + job->datalen);
+
+		ret = dyesub_read_full(data_fd, block->payload, payload_len);
 		if (ret < 0 || ret != (int) payload_len) {
 			if (ret != 0) {
 				perror("ERROR: read failed");
@@ -677,35 +729,175 @@ static int kodak8800_read_parse(void *vctx, const void **vjob, int data_fd, int
 			kodak8800_cleanup_job(job);
 			return CUPS_BACKEND_CANCEL;
 		}
-		job->jobsize += sizeof(struct rosetta_block);
-		job->jobsize += payload_len;
-
-		/* Work out our copies offset */
-		if (!memcmp(block->cmd, "FlsPgCopies", 11)) {
-			job->copies_offset = job->jobsize - payload_len;
+		job->datalen += sizeof(struct rosetta_block);
+		job->datalen += payload_len;
+
+		/* Use the larger copy count; it gets filled in when we print */
+		if (!memcmp(block->cmd, "FlsPgCopies", 11) && payload_len >= 4) {
+			uint32_t tmp;
+			memcpy(&tmp, block->payload, sizeof(tmp));
+			tmp = be32_to_cpu(tmp);
+			if (job->common.copies < (int)tmp)
+				job->common.copies = tmp;
+			job->copies_offset = block->payload - job->databuf;
 		}
+
 		/* If this is the last block, we're done! */
-		if (!memcmp(block->cmd, "MndEndJob", 9))
+		if (!memcmp(block->cmd, "MndEndJob", 9)) {
+			job->common.owns_input = 0;
 			break;
+		}
 	}
 
-	/* Handle copies */
-	if (job->copies_offset) {
-		uint32_t tmp = 0;
-		memcpy(&tmp, job->databuf + job->copies_offset, sizeof(tmp));
-		tmp = be32_to_cpu(tmp);
-		if ((int)tmp < copies) {
-			tmp = be32_to_cpu(copies);
-			memcpy(job->databuf + job->copies_offset, &tmp, sizeof(tmp));
+	/* Only fully buffered jobs can be folded into copies */
+	job->common.can_fold = (!job->common.owns_input);
+
+	/* Nothing gets sent in test mode, but run the rest of the job
+	   through the stream parser anyway so it gets checked */
+	if (job->common.owns_input && test_mode >= TEST_MODE_NOPRINT) {
+		ret = kodak8800_stream_rest(ctx, job);
+		job->common.owns_input = 0;
+		if (ret) {
+			kodak8800_cleanup_job(job);
+			return ret;
 		}
 	}
 
-	job->copies = copies;
 	*vjob = job;
 
 	return CUPS_BACKEND_OK;
 }
 
+/* Send a chunk of the job over, in pieces the printer can accept */
+static int kodak8800_send_buf(struct kodak8800_ctx *ctx, const uint8_t *buf, uint32_t len)
+{
+	uint32_t offset = 0;
+	struct rtp1_sts sts;
+	int ret;
+
+	if (test_mode >= TEST_MODE_NOPRINT)
+		return CUPS_BACKEND_OK;
+
+	while (offset < len) {
+		uint32_t max_blocksize;
+		ret = rtp1_getmaxxfer(ctx, &max_blocksize);
+		if (ret)
+			return ret;
+		if (!max_blocksize) {
+			ERROR("Printer not accepting data\n");
+			return CUPS_BACKEND_FAILED;
+		}
+
+		if (len - offset < max_blocksize)
+			max_blocksize = len - offset;
+
+		ret = rtp1_docmd(ctx, rtp_sendimagedata,
+				 buf + offset, max_blocksize,
+				 0, NULL, &sts);
+		if (ret)
+			return ret;
+		if (sts.err) {
+			ERROR("Printer reports error: %s (%04x)\n",
+			      kodak8800_errorstrs(sts.err), sts.err);
+			return CUPS_BACKEND_FAILED;
+		}
+
+		offset += max_blocksize;
+	}
+
+	return CUPS_BACKEND_OK;
+}
+
+/* Forward the remainder of a streamed job to the printer, parsing
+   the block headers as they go past. */
+static int kodak8800_stream_rest(struct kodak8800_ctx *ctx, const struct kodak8800_printjob *job)
+{
+	uint8_t *chunk;
+	uint32_t fill = 0;
+	uint32_t remain = job->stream_remain;
+	int last = 0;
+	int ret = CUPS_BACKEND_OK;
+
+	chunk = malloc(STREAM_CHUNK_LEN);
+	if (!chunk) {
+		ERROR("Memory allocation failure!\n");
+		return CUPS_BACKEND_RETRY_CURRENT;
+	}
+
+	while (1) {
+		struct rosetta_block *block;
+		uint32_t payload_len;
+		int len;
+
+		/* Finish off the current block's payload */
+		while (remain) {
+			len = STREAM_CHUNK_LEN - fill;
+			if ((uint32_t)len > remain)
+				len = remain;
+			len = dyesub_read(job->in_fd, chunk + fill, len);
+			if (len <= 0) {
+				ERROR("Data Read Error: %d (%u)\n", len, remain);
+				ret = CUPS_BACKEND_CANCEL;
+				goto done;
+			}
+			fill += len;
+			remain -= len;
+
+			if (fill == STREAM_CHUNK_LEN) {
+				if ((ret = kodak8800_send_buf(ctx, chunk, fill)))
+					goto done;
+				fill = 0;
+			}
+		}
+
+		if (last)
+			break;
+
+		/* Leave room for the next block header, plus its payload
+		   if it's one we need to patch */
+		if (fill + sizeof(struct rosetta_block) + 4 > STREAM_CHUNK_LEN) {
+			if ((ret = kodak8800_send_buf(ctx, chunk, fill)))
+				goto done;
+			fill = 0;
+		}
+
+		/* Read in the next block header */
+		block = (struct rosetta_block *)(chunk + fill);
+		len = dyesub_read_full(job->in_fd, (uint8_t*)block, sizeof(struct rosetta_block));
+		if (len != sizeof(struct rosetta_block) || block->esc != 0x1b) {
+			ERROR("Invalid ROSETTA block in data stream!\n");
+			ret = CUPS_BACKEND_CANCEL;
+			goto done;
+		}
+		payload_len = be32_to_cpu(block->payload_len);
+		fill += sizeof(struct rosetta_block);
+		remain = payload_len;
+
+		if (!memcmp(block->cmd, "FlsPgCopies", 11) && payload_len == 4) {
+			len = dyesub_read_full(job->in_fd, chunk + fill, 4);
+			if (len != 4) {
+				ERROR("Data Read Error: %d\n", len);
+				ret = CUPS_BACKEND_CANCEL;
+				goto done;
+			}
+			kodak8800_patch_copies(chunk + fill, job->common.copies);
+			fill += 4;
+			remain = 0;
+		}
+
+		/* This is the last block.. */
+		if (!memcmp(block->cmd, "MndEndJob", 9))
+			last = 1;
+	}
+
+	if (fill)
+		ret = kodak8800_send_buf(ctx, chunk, fill);
+
+done:
+	free(chunk);
+	return ret;
+}
+
 static int kodak8800_main_loop(void *vctx, const void *vjob, int wait_for_return) {
 	struct kodak8800_ctx *ctx = vctx;
 
@@ -751,30 +943,20 @@ static int kodak8800_main_loop(void *vctx, const void *vjob, int wait_for_return
 	}
 	INFO("Printer assigned Job ID: %d\n", (int) jobid);
 
-	/* Sent over data blocks */
-	uint32_t offset = 0;
-	while (offset < job->jobsize) {
-		uint32_t max_blocksize;
-		ret = rtp1_getmaxxfer(ctx, &max_blocksize);
-		if (ret)
-			return ret;
-
-		if (job->jobsize - offset < max_blocksize)
-			max_blocksize = job->jobsize - offset;
+	if (job->copies_offset)
+		kodak8800_patch_copies(job->databuf + job->copies_offset, job->common.copies);
 
-		ret = rtp1_docmd(ctx, rtp_sendimagedata,
-				 job->databuf + offset, max_blocksize,
-				 0, NULL, &sts);
-		if (ret)
-			return ret;
-		if (sts.err) {
-			ERROR("Printer reports error: %s (%04x)\n",
-			      kodak8800_errorstrs(sts.err), sts.err);
-			return CUPS_BACKEND_FAILED;
-		}
+	/* Sent over data blocks */
+	ret = kodak8800_send_buf(ctx, job->databuf, job->datalen);
 
-		offset += max_blocksize;
+	/* And the rest, if it's coming straight from the input */
+	if (!ret && job->common.owns_input)
+		ret = kodak8800_stream_rest(ctx, job);
+	if (ret) {
+		kodak8800_canceljob(ctx, jobid);
+		return ret;
 	}
+
 	/* Send payload footer */
 	ret = rtp1_docmd(ctx, rtp_closejob,
 			 NULL, 0, 0, NULL, &sts);
@@ -920,7 +1102,7 @@ static const char *kodak8800_prefixes[] = {
 /* Exported */
 const struct dyesub_backend kodak8800_backend = {
 	.name = "Kodak 8800/9810",
-	.version = "0.07",
+	.version = "0.11",
 	.uri_prefixes = kodak8800_prefixes,
 	.cmdline_usage = kodak8800_cmdline,
 	.cmdline_arg = kodak8800_cmdline_arg,
@@ -99,10 +99,30 @@ struct magicard_printjob {
 	int hdr_len;
 };
 
+/* Variable-data card template, see X-GP-TPL */
+struct magicard_template {
+	uint32_t pixels;   /* Per plane */
+	int gamma;
+	uint8_t rk;
+
+	uint8_t *src;      /* 8bpp Y/M/C planes, each followed by terminator */
+	uint8_t *scratch;  /* Copy of 'src' that regions are pasted into */
+	uint8_t *out;      /* Converted plane data, as sent to the printer */
+	uint32_t out_len;
+};
+
+#define MAX_REGIONS 16
+
+struct magicard_region {
+	uint32_t x, y, w, h;
+};
+
 /* Private data structure */
 struct magicard_ctx {
 	struct dyesub_connection *conn;
 	struct marker marker;
+
+	struct magicard_template tpl;
 };
 
 struct magicard_cmd_header {
@@ -424,6 +444,30 @@ static void* magicard_init(void)
 	return ctx;
 }
 
+static void magicard_free_template(struct magicard_template *tpl)
+{
+	if (tpl->src)
+		free(tpl->src);
+	if (tpl->scratch)
+		free(tpl->scratch);
+	if (tpl->out)
+		free(tpl->out);
+
+	memset(tpl, 0, sizeof(*tpl));
+}
+
+static void magicard_teardown(void *vctx)
+{
+	struct magicard_ctx *ctx = vctx;
+
+	if (!ctx)
+		return;
+
+	magicard_free_template(&ctx->tpl);
+
+	free(ctx);
+}
+
 static int magicard_attach(void *vctx, struct dyesub_connection *conn, uint8_t jobid)
 {
 	struct magicard_ctx *ctx = vctx;
@@ -451,70 +495,202 @@ static void magicard_cleanup_job(const void *vjob)
 	free((void*)job);
 }
 
-static void downscale_and_extract(int gamma, uint32_t pixels,
-				  uint8_t *y_i, uint8_t *m_i, uint8_t *c_i,
-				  uint8_t *y_o, uint8_t *m_o, uint8_t *c_o, uint8_t *k_o)
+#define CARD_ROW_PIXELS 672
+#define CARD_ROW_BYTES  (CARD_ROW_PIXELS / 8)
+
+struct magicard_extract {
+	uint8_t lut[256];	/* 8bpp -> 6bpp, including gamma */
+	const uint8_t *y_i, *m_i, *c_i;
+	uint8_t *y_o, *m_o, *c_o, *k_o;
+};
+
+/* Gather bit 'bit' of each of the eight bytes packed into 'v', with
+   the first (least significant) byte's bit ending up in the MSB. */
+static inline uint8_t pack_bitplane(uint64_t v, int bit)
 {
-	uint32_t i;
+	v = (v >> bit) & 0x0101010101010101ULL;
+	return (v * 0x8040201008040201ULL) >> 56;
+}
 
-	for (i = 0 ; i < pixels; i++)
-	{
-		uint8_t y, m, c;
+/* Each card row is 672 pixels, output as six 1bpp sub-rows (one per bit,
+   LSB first) per colour, 84 bytes each.  The optional resin black plane
+   is a single 84-byte sub-row.  Only the first 'pixels' of the row are
+   converted; any remaining bits of the last output byte are left clear. */
+static void downscale_and_extract_row(const struct magicard_extract *ex,
+				      uint32_t row, uint32_t pixels)
+{
+	const uint8_t *y_i = ex->y_i + row * CARD_ROW_PIXELS;
+	const uint8_t *m_i = ex->m_i + row * CARD_ROW_PIXELS;
+	const uint8_t *c_i = ex->c_i + row * CARD_ROW_PIXELS;
+	uint8_t *y_o = ex->y_o + row * CARD_ROW_BYTES * 6;
+	uint8_t *m_o = ex->m_o + row * CARD_ROW_BYTES * 6;
+	uint8_t *c_o = ex->c_o + row * CARD_ROW_BYTES * 6;
+	uint8_t *k_o = ex->k_o ? ex->k_o + row * CARD_ROW_BYTES : NULL;
+	uint32_t b;
+	int j;
+
+	/* Eight pixels at a time, ie one output byte per sub-row */
+	for (b = 0 ; b * 8 < pixels ; b++) {
+		uint64_t y = 0, m = 0, c = 0;
 		uint8_t k = 0;
-		uint32_t j;
-		uint32_t row;
-		uint32_t col;
-		uint32_t b_offset;
-		uint8_t b_shift;
-
-		/* Downscale color planes from 8bpp -> 6bpp; */
-		if (gamma) {
-			if (gamma > 2)
-				gamma = 2;
-			gamma--;
-			y = gammas[gamma][*y_i++];
-			m = gammas[gamma][*m_i++];
-			c = gammas[gamma][*c_i++];
-		} else {
-			y = *y_i++ >> 2;
-			m = *m_i++ >> 2;
-			c = *c_i++ >> 2;
+		int n = (pixels - b * 8 < 8) ? (int)(pixels - b * 8) : 8;
+
+		for (j = 0 ; j < n ; j++) {
+			uint64_t py = ex->lut[*y_i++];
+			uint64_t pm = ex->lut[*m_i++];
+			uint64_t pc = ex->lut[*c_i++];
+
+			/* Extract "true black" from ymc data, if enabled */
+			if (k_o && (py & pm & pc) == 0x3f) {
+				k |= 0x80 >> j;
+				continue;
+			}
+
+			y |= py << (j * 8);
+			m |= pm << (j * 8);
+			c |= pc << (j * 8);
 		}
 
-		/* Extract "true black" from ymc data, if enabled */
-		if (k_o && y == 0x3f && m == 0x3f && c == 0x3f) {
-			k = 1;
-			y = m = c = 0;
+		for (j = 0 ; j < 6 ; j++) {
+			y_o[j * CARD_ROW_BYTES + b] = pack_bitplane(y, j);
+			m_o[j * CARD_ROW_BYTES + b] = pack_bitplane(m, j);
+			c_o[j * CARD_ROW_BYTES + b] = pack_bitplane(c, j);
 		}
+		if (k_o)
+			k_o[b] = k;
+	}
+}
 
-		/* Compute row number and offsets */
-		row = i / 672;
-		col = i - (row * 672);
-		b_offset = col / 8;
-		b_shift = 7 - (col - (b_offset * 8));
+static void downscale_and_extract_rows(void *arg, uint32_t start, uint32_t end)
+{
+	const struct magicard_extract *ex = arg;
+	uint32_t row;
 
-		/* Now, for each row, break it down into sub-chunks */
-		for (j = 0 ; j < 6 ; j++) {
-			if (b_shift == 7) {
-				y_o[row * 504 + j * 84 + b_offset] = 0;
-				m_o[row * 504 + j * 84 + b_offset] = 0;
-				c_o[row * 504 + j * 84 + b_offset] = 0;
+	for (row = start ; row < end ; row++)
+		downscale_and_extract_row(ex, row, CARD_ROW_PIXELS);
+}
+
+static void downscale_and_extract(int gamma, uint32_t pixels,
+				  const uint8_t *y_i, const uint8_t *m_i, const uint8_t *c_i,
+				  uint8_t *y_o, uint8_t *m_o, uint8_t *c_o, uint8_t *k_o)
+{
+	struct magicard_extract ex;
+	int i;
+
+	/* Downscale color planes from 8bpp -> 6bpp */
+	if (gamma > 2)
+		gamma = 2;
+	else if (gamma < 0)
+		gamma = 0;
+	for (i = 0 ; i < 256 ; i++)
+		ex.lut[i] = gamma ? gammas[gamma - 1][i] : i >> 2;
+
+	ex.y_i = y_i;
+	ex.m_i = m_i;
+	ex.c_i = c_i;
+	ex.y_o = y_o;
+	ex.m_o = m_o;
+	ex.c_o = c_o;
+	ex.k_o = k_o;
+
+	dyesub_process_bands(pixels / CARD_ROW_PIXELS, 32,
+			     downscale_and_extract_rows, &ex);
+
+	/* Trailing partial row, if any */
+	if (pixels % CARD_ROW_PIXELS)
+		downscale_and_extract_row(&ex, pixels / CARD_ROW_PIXELS,
+					  pixels % CARD_ROW_PIXELS);
+}
+
+/* Hang onto a fully-converted card so later cards only need to supply
+   the regions that differ.  Takes ownership of 'srcbuf'. */
+static void magicard_store_template(struct magicard_ctx *ctx,
+				    const struct magicard_printjob *job,
+				    uint8_t *srcbuf, uint32_t pixels,
+				    int gamma, uint8_t rk)
+{
+	struct magicard_template *tpl = &ctx->tpl;
+	uint32_t srclen = (pixels + 3) * 3;
+
+	magicard_free_template(tpl);
+
+	if (pixels % CARD_ROW_PIXELS) {
+		WARNING("Template card has partial rows, ignoring\n");
+		free(srcbuf);
+		return;
+	}
+
+	tpl->src = srcbuf;
+	tpl->scratch = malloc(srclen);
+	tpl->out_len = job->datalen - job->hdr_len;
+	tpl->out = malloc(tpl->out_len);
+	if (!tpl->scratch || !tpl->out) {
+		WARNING("Memory allocation failure, not caching template\n");
+		magicard_free_template(tpl);
+		return;
+	}
+
+	memcpy(tpl->scratch, tpl->src, srclen);
+	memcpy(tpl->out, job->databuf + job->hdr_len, tpl->out_len);
+	tpl->pixels = pixels;
+	tpl->gamma = gamma;
+	tpl->rk = rk;
+
+	INFO("Cached template card\n");
+}
+
+/* Generate a card from the template, plus updated 8bpp data for each of the
+   supplied regions (concatenated row-major in each plane of 'srcbuf') */
+static void magicard_apply_regions(struct magicard_ctx *ctx,
+				   struct magicard_printjob *job,
+				   const uint8_t *srcbuf, uint32_t len,
+				   const struct magicard_region *regions,
+				   int num_regions)
+{
+	struct magicard_template *tpl = &ctx->tpl;
+	uint32_t src_plane = tpl->pixels + 3;
+	uint32_t out_plane = (tpl->pixels * 6 / 8) + 3;
+	uint8_t *out = job->databuf + job->datalen;
+	uint32_t row;
+	int p, i;
+
+	/* Start with the already-converted template */
+	memcpy(out, tpl->out, tpl->out_len);
+	job->datalen += tpl->out_len;
+
+	/* Paste the new regions over the template's source data */
+	for (p = 0 ; p < 3 ; p++) {
+		const uint8_t *in = srcbuf + p * (len + 3);
+		uint8_t *plane = tpl->scratch + p * src_plane;
+
+		for (i = 0 ; i < num_regions ; i++) {
+			for (row = regions[i].y ; row < regions[i].y + regions[i].h ; row++) {
+				memcpy(plane + row * CARD_ROW_PIXELS + regions[i].x,
+				       in, regions[i].w);
+				in += regions[i].w;
 			}
-			if (y & (1 << j))
-				y_o[row * 504 + j * 84 + b_offset] |= (1 << b_shift);
-			if (m & (1 << j))
-				m_o[row * 504 + j * 84 + b_offset] |= (1 << b_shift);
-			if (c & (1 << j))
-				c_o[row * 504 + j * 84 + b_offset] |= (1 << b_shift);
 		}
+	}
 
-		/* And resin black, if enabled */
-		if (k_o) {
-			if (b_shift == 7) {
-				k_o[row * 84 + b_offset] = 0;
-			}
-			if (k)
-				k_o[row * 84 + b_offset] |= (1 << b_shift);
+	/* Re-convert only the affected rows, then restore the template */
+	for (i = 0 ; i < num_regions ; i++) {
+		uint32_t src_off = regions[i].y * CARD_ROW_PIXELS;
+		uint32_t out_off = regions[i].y * CARD_ROW_BYTES * 6;
+
+		downscale_and_extract(tpl->gamma, regions[i].h * CARD_ROW_PIXELS,
+				      tpl->scratch + src_off,
+				      tpl->scratch + src_plane + src_off,
+				      tpl->scratch + src_plane * 2 + src_off,
+				      out + out_off,
+				      out + out_plane + out_off,
+				      out + out_plane * 2 + out_off,
+				      tpl->rk ? out + out_plane * 3 + regions[i].y * CARD_ROW_BYTES : NULL);
+	}
+	for (i = 0 ; i < num_regions ; i++) {
+		for (p = 0 ; p < 3 ; p++) {
+			uint32_t off = p * src_plane + regions[i].y * CARD_ROW_PIXELS;
+			memcpy(tpl->scratch + off, tpl->src + off,
+			       regions[i].h * CARD_ROW_PIXELS);
 		}
 	}
 }
@@ -525,7 +701,9 @@ static void downscale_and_extract(int gamma, uint32_t pixels,
 static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int copies) {
 	struct magicard_ctx *ctx = vctx;
 	uint8_t initial_buf[INITIAL_BUF_LEN + 1];
+	const uint8_t *peek;
 	uint32_t buf_offset = 0;
+	int avail;
 	int i;
 
 	uint8_t *in_y, *in_m, *in_c;
@@ -535,8 +713,12 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 
 	uint8_t x_gp_8bpp;
 	uint8_t x_gp_rk;
+	uint8_t x_gp_tpl = 0;
 	uint8_t k_only;
 
+	struct magicard_region regions[MAX_REGIONS];
+	int num_regions = 0;
+
 	struct magicard_printjob *job = NULL;
 
 	if (!ctx)
@@ -551,21 +733,22 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 	job->common.jobsize = sizeof(*job);
 	job->common.copies = copies;
 
-	/* Read in the first chunk */
-	i = read(data_fd, initial_buf, INITIAL_BUF_LEN);
-	if (i < 0) {
+	/* Look at the first chunk; we only consume the header itself, as
+	   small cards may be followed directly by the next one. */
+	avail = dyesub_peek(data_fd, &peek, INITIAL_BUF_LEN);
+	if (avail < 0) {
 		magicard_cleanup_job(job);
-		return i;
-	} else if (i == 0) {
+		return avail;
+	} else if (avail == 0) {
 		magicard_cleanup_job(job);
 		return CUPS_BACKEND_CANCEL;  /* Ie no data, we're done */
-	} else if (i < INITIAL_BUF_LEN) {
-		magicard_cleanup_job(job);
-		return CUPS_BACKEND_CANCEL;
 	}
+	memcpy(initial_buf, peek, avail);
+	memset(initial_buf + avail, 0, INITIAL_BUF_LEN + 1 - avail);
 
 	/* Basic Sanity Check */
-	if (initial_buf[0] != 0x05 ||
+	if (avail < 66 ||
+	    initial_buf[0] != 0x05 ||
 	    initial_buf[64] != 0x01 ||
 	    initial_buf[65] != 0x2c) {
 		ERROR("Unrecognized header data format @%d!\n", job->datalen);
@@ -573,8 +756,6 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 		return CUPS_BACKEND_CANCEL;
 	}
 
-	initial_buf[INITIAL_BUF_LEN] = 0;
-
 	/* We can start allocating! */
 	if (job->databuf) {
 		free(job->databuf);
@@ -599,8 +780,8 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 	char *ptr;
 	ptr = strtok((char*)initial_buf + ++buf_offset, ",\x1c");
 	while (ptr
-	       && ((ptr - (char*)initial_buf) < INITIAL_BUF_LEN)
-	       && ((ptr - (char*)initial_buf) + strnlen(ptr, INITIAL_BUF_LEN) < INITIAL_BUF_LEN)
+	       && ((ptr - (char*)initial_buf) < avail)
+	       && ((ptr - (char*)initial_buf) + strnlen(ptr, avail) < (size_t)avail)
 	       && *ptr != 0x1c) {
 		if (!strcmp("X-GP-8", ptr)) {
 			x_gp_8bpp = 1;
@@ -612,6 +793,17 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 //			/* Strip out copies */
 		} else if (!strcmp("X-GP-RK", ptr)) {
 			x_gp_rk = 1;
+		} else if (!strcmp("X-GP-TPL", ptr)) {
+			x_gp_tpl = 1;
+		} else if (!strncmp("X-GP-RGN", ptr, 8)) {
+			struct magicard_region *rgn = &regions[num_regions];
+			if (num_regions >= MAX_REGIONS ||
+			    sscanf(ptr + 8, "%u:%u:%u:%u", &rgn->x, &rgn->y, &rgn->w, &rgn->h) != 4) {
+				ERROR("Invalid or too many regions (%s)!\n", ptr);
+				magicard_cleanup_job(job);
+				return CUPS_BACKEND_CANCEL;
+			}
+			num_regions++;
 		} else if (!strncmp("ICC", ptr,3)) {
 			/* Gamma curve is not handled by printer,
 			   strip it out and use it! */
@@ -664,6 +856,41 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 		return CUPS_BACKEND_CANCEL;
 	}
 
+	/* Cards built from a template inherit its settings */
+	if (num_regions) {
+		uint32_t pixels = 0;
+
+		if (!x_gp_8bpp || k_only || len_k || x_gp_tpl) {
+			ERROR("Regions are only supported on 8bpp color cards!\n");
+			magicard_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
+		if (!ctx->tpl.src) {
+			ERROR("No template card to apply regions to!\n");
+			magicard_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
+		for (i = 0 ; i < num_regions ; i++) {
+			uint32_t rows = ctx->tpl.pixels / CARD_ROW_PIXELS;
+			if (!regions[i].w || !regions[i].h ||
+			    regions[i].w > CARD_ROW_PIXELS || regions[i].x > CARD_ROW_PIXELS - regions[i].w ||
+			    regions[i].h > rows || regions[i].y > rows - regions[i].h) {
+				ERROR("Region %d out of bounds (%u:%u:%u:%u)!\n", i,
+				      regions[i].x, regions[i].y, regions[i].w, regions[i].h);
+				magicard_cleanup_job(job);
+				return CUPS_BACKEND_CANCEL;
+			}
+			pixels += regions[i].w * regions[i].h;
+		}
+		if (pixels != len_y) {
+			ERROR("Region sizes do not match plane lengths! %u/%u!\n", pixels, len_y);
+			magicard_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
+		x_gp_rk = ctx->tpl.rk;
+		gamma = ctx->tpl.gamma;
+	}
+
 	/* Generate a timestamp */
 	job->datalen += sprintf((char*)job->databuf + job->datalen, ",TDT%08X", (uint32_t) time(NULL));
 
@@ -680,15 +907,17 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 
 	/* Insert SZB/G/R/K length descriptors */
 	if (x_gp_8bpp) {
+		uint32_t pixels = num_regions ? ctx->tpl.pixels : len_c;
+
 		if (k_only == 1) {
-			job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZK%u", len_c / 8);
+			job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZK%u", pixels / 8);
 		} else {
-			job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZB%u", len_y * 6 / 8);
-			job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZG%u", len_m * 6 / 8);
-			job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZR%u", len_c * 6 / 8);
+			job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZB%u", pixels * 6 / 8);
+			job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZG%u", pixels * 6 / 8);
+			job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZR%u", pixels * 6 / 8);
 			/* Add in a SZK length indication if requested */
 			if (x_gp_rk == 1) {
-				job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZK%u", len_c / 8);
+				job->datalen += sprintf((char*)job->databuf + job->datalen, ",SZK%u", pixels / 8);
 			}
 		}
 	} else {
@@ -713,15 +942,19 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 		if (len_k)
 			remain += len_k + 3;
 	}
-	/* Offset the stuff we already read in. */
-	remain -= INITIAL_BUF_LEN - buf_offset;
 	remain++;  /* Add in a byte for the end of job marker. This is our final value. */
 
+	/* Now consume the header we parsed; the image data follows it */
+	if (!dyesub_read_span(data_fd, buf_offset)) {
+		ERROR("Short read!\n");
+		magicard_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
+	}
+
 	/* This is how much of the initial buffer is the header length. */
 	job->hdr_len = job->datalen;
 
 	if (x_gp_8bpp) {
-		uint32_t srcbuf_offset = INITIAL_BUF_LEN - buf_offset;
 		uint8_t *srcbuf = malloc(MAX_PRINTJOB_LEN);
 		if (!srcbuf) {
 			magicard_cleanup_job(job);
@@ -729,29 +962,31 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 			return CUPS_BACKEND_RETRY_CURRENT;
 		}
 
-		memcpy(srcbuf, initial_buf + buf_offset, srcbuf_offset);
-
 		/* Finish loading the data */
-		while (remain > 0) {
-			i = read(data_fd, srcbuf + srcbuf_offset, remain);
-			if (i < 0) {
-				ERROR("Data Read Error: %d (%u) @%u)\n", i, remain, srcbuf_offset);
-				magicard_cleanup_job(job);
-				free(srcbuf);
-				return i;
-			}
-			if (i == 0) {
-				ERROR("Short read! (%d/%u)\n", i, remain);
-				magicard_cleanup_job(job);
-				free(srcbuf);
-				return CUPS_BACKEND_CANCEL;
-			}
-			srcbuf_offset += i;
-			remain -= i;
+		i = dyesub_read_full(data_fd, srcbuf, remain);
+		if (i < 0) {
+			ERROR("Data Read Error: %d (%u)\n", i, remain);
+			magicard_cleanup_job(job);
+			free(srcbuf);
+			return i;
+		}
+		if (i != (int)remain) {
+			ERROR("Short read! (%d/%u)\n", i, remain);
+			magicard_cleanup_job(job);
+			free(srcbuf);
+			return CUPS_BACKEND_CANCEL;
 		}
 
 		// XXX handle conversion of K-only jobs.  if needed.
 
+		if (num_regions) {
+			INFO("Applying %d regions to template card\n", num_regions);
+			magicard_apply_regions(ctx, job, srcbuf, len_y,
+					       regions, num_regions);
+			free(srcbuf);
+			goto done;
+		}
+
 		/* set up source pointers */
 		in_y = srcbuf;
 		in_m = in_y + len_y + 3;
@@ -790,30 +1025,27 @@ static int magicard_read_parse(void *vctx, const void **vjob, int data_fd, int c
 		/* Terminate the entire stream */
 		job->databuf[job->datalen++] = 0x03;
 
-		free(srcbuf);
+		if (x_gp_tpl)
+			magicard_store_template(ctx, job, srcbuf, len_y, gamma, x_gp_rk);
+		else
+			free(srcbuf);
 	} else {
-		uint32_t srcbuf_offset = INITIAL_BUF_LEN - buf_offset;
-		memcpy(job->databuf + job->datalen, initial_buf + buf_offset, srcbuf_offset);
-		job->datalen += srcbuf_offset;
-
 		/* Finish loading the data */
-		while (remain > 0) {
-			i = read(data_fd, job->databuf + job->datalen, remain);
-			if (i < 0) {
-				ERROR("Data Read Error: %d (%u) @%d)\n", i, remain, job->datalen);
-				magicard_cleanup_job(job);
-				return i;
-			}
-			if (i == 0) {
-				magicard_cleanup_job(job);
-				ERROR("Short read! (%d/%u)\n", i, remain);
-				return CUPS_BACKEND_CANCEL;
-			}
-			job->datalen += i;
-			remain -= i;
+		i = dyesub_read_full(data_fd, job->databuf + job->datalen, remain);
+		if (i < 0) {
+			ERROR("Data Read Error: %d (%u) @%d)\n", i, remain, job->datalen);
+			magicard_cleanup_job(job);
+			return i;
+		}
+		if (i != (int)remain) {
+			magicard_cleanup_job(job);
+			ERROR("Short read! (%d/%u)\n", i, remain);
+			return CUPS_BACKEND_CANCEL;
 		}
+		job->datalen += i;
 	}
 
+done:
 	*vjob = job;
 
 	return CUPS_BACKEND_OK;
@@ -923,12 +1155,13 @@ static const char *magicard_prefixes[] = {
 
 const struct dyesub_backend magicard_backend = {
 	.name = "Magicard family",
-	.version = "0.18",
+	.version = "0.22",
 	.uri_prefixes = magicard_prefixes,
 	.cmdline_arg = magicard_cmdline_arg,
 	.cmdline_usage = magicard_cmdline,
 	.init = magicard_init,
 	.attach = magicard_attach,
+	.teardown = magicard_teardown,
 	.cleanup_job = magicard_cleanup_job,
 	.read_parse = magicard_read_parse,
 	.main_loop = magicard_main_loop,
@@ -957,6 +1190,11 @@ const struct dyesub_backend magicard_backend = {
       * IMF -- Image format (BGR/BGRK/K)
       * X-GP-8 -- Tells backend to convert from Gutenprint's 8bpp data
       * X-GP-RK -- Tells backend to extract K channel from color data
+      * X-GP-TPL -- Tells backend to cache this (X-GP-8) card as a template
+      * X-GP-RGNx:y:w:h -- Card is the template with this region replaced.
+                   May be repeated.  Plane data (and SZ# lengths) only cover
+                   the regions, concatenated row-major, in 8bpp.  The
+                   template's ICC and X-GP-RK settings are used.
   * Command sequence ends with 0x1c
   * Image plane data follows, in the order of the SZ# entries
     * Plane lengths are specified by the SZ# entry.
@@ -1082,6 +1320,8 @@ const struct dyesub_backend magicard_backend = {
   ICC%d    Gamma curve (0, 1, 2) -- off, 2.2, or 1.8 respectively.
   X-GP-8   Raw data is 8bpp. needs to be converted.
   X-GP-RK  Extract K channel from color data.
+  X-GP-TPL Cache converted card as a template for later cards.
+  X-GP-RGNx:y:w:h  Only this region differs from the template.
 
    Open questions:
 
@@ -99,8 +99,10 @@ int mitsu_loadlib(struct mitsu_lib *lib, int type)
 			return CUPS_BACKEND_FAILED;
 		} else {
 			DEBUG("Image processing library successfully loaded\n");
-			if (!stats_only && lib->DumpAnnounce)
+			if (!stats_only && lib->DumpAnnounce) {
+				dyesub_log_flush();
 				lib->DumpAnnounce(logger);
+			}
 		}
 	}
 
@@ -130,8 +132,20 @@ int mitsu_loadlib(struct mitsu_lib *lib, int type)
 #endif
 }
 
+static void mitsu_lamplane_free(struct mitsu_lamplane *plane)
+{
+	free(plane->fname);
+	free(plane->data);
+	memset(plane, 0, sizeof(*plane));
+}
+
 int mitsu_destroylib(struct mitsu_lib *lib)
 {
+	int i;
+
+	for (i = 0 ; i < MITSU_LAMCACHE_ENTRIES ; i++)
+		mitsu_lamplane_free(&lib->lamcache[i]);
+
 #if defined(WITH_DYNAMIC)
 	if (lib->dl_handle) {
 		if (lib->cpcdata)
@@ -228,12 +242,17 @@ int mitsu_apply3dlut_plane(struct mitsu_lib *lib, const char *lutfname,
 	return CUPS_BACKEND_OK;
 }
 
-int mitsu_readlamdata(const char *fname, uint16_t lamstride,
-		      uint8_t *databuf, uint32_t *datalen,
-		      uint16_t rows, uint16_t cols, uint8_t bpp)
+/* The lamination file is treated as an endless stream of 'lamstride'
+   wide rows, of which we use the first 'cols' pixels of each. */
+static int mitsu_expandlamdata(const char *fname, uint16_t lamstride,
+			       uint16_t rows, uint16_t cols, uint8_t bpp,
+			       uint8_t **plane)
 {
-	int i, j, fd;
 	char full[2048];
+	struct stat st;
+	uint8_t *raw, *out;
+	uint32_t rawlen, rowlen, pos;
+	int i, j, fd;
 
 	snprintf(full, sizeof(full), "%s/%s", corrtable_path, fname);
 
@@ -243,28 +262,104 @@ int mitsu_readlamdata(const char *fname, uint16_t lamstride,
 		ERROR("Unable to open matte lamination data file '%s'\n", full);
 		return CUPS_BACKEND_CANCEL;
 	}
+	if (fstat(fd, &st) || st.st_size <= 0) {
+		ERROR("Unable to read matte lamination data file '%s'\n", full);
+		close(fd);
+		return CUPS_BACKEND_CANCEL;
+	}
+
+	rawlen = st.st_size;
+	rowlen = cols * bpp;
+	raw = malloc(rawlen);
+	out = malloc(rowlen * rows);
+	if (!raw || !out) {
+		ERROR("Memory allocation failure!\n");
+		free(raw);
+		free(out);
+		close(fd);
+		return CUPS_BACKEND_RETRY_CURRENT;
+	}
+
+	/* Slurp in the whole file */
+	for (pos = 0 ; pos < rawlen ; pos += i) {
+		i = read(fd, raw + pos, rawlen - pos);
+		if (i <= 0) {
+			ERROR("Unable to read matte lamination data file '%s'\n", full);
+			free(raw);
+			free(out);
+			close(fd);
+			return CUPS_BACKEND_CANCEL;
+		}
+	}
+	close(fd);
 
-	/* Read in the matte data plane */
+	/* And expand it out, wrapping around as needed */
 	for (j = 0 ; j < rows ; j++) {
-		int remain = lamstride * bpp;
-
-		/* Read one row of lamination data at a time */
-		while (remain) {
-			i = read(fd, databuf + *datalen, remain);
-			if (i < 0)
-				return CUPS_BACKEND_CANCEL;
-			if (i == 0) {
-				/* We hit EOF, restart from beginning */
-				lseek(fd, 0, SEEK_SET);
-				continue;
-			}
-			*datalen += i;
-			remain -= i;
+		uint32_t done = 0;
+
+		pos = ((uint64_t)j * lamstride * bpp) % rawlen;
+		while (done < rowlen) {
+			uint32_t chunk = rowlen - done;
+			if (chunk > rawlen - pos)
+				chunk = rawlen - pos;
+			memcpy(out + j * rowlen + done, raw + pos, chunk);
+			done += chunk;
+			pos = 0;
+		}
+	}
+	free(raw);
+
+	*plane = out;
+
+	return CUPS_BACKEND_OK;
+}
+
+int mitsu_readlamdata(struct mitsu_lib *lib, const char *fname, uint16_t lamstride,
+		      uint8_t *databuf, uint32_t *datalen,
+		      uint16_t rows, uint16_t cols, uint8_t bpp)
+{
+	struct mitsu_lamplane plane;
+	int i, ret;
+
+	/* See if we've already expanded this one */
+	for (i = 0 ; i < MITSU_LAMCACHE_ENTRIES ; i++) {
+		struct mitsu_lamplane *entry = &lib->lamcache[i];
+		if (entry->data && !strcmp(entry->fname, fname) &&
+		    entry->lamstride == lamstride && entry->rows == rows &&
+		    entry->cols == cols && entry->bpp == bpp)
+			break;
+	}
+
+	if (i < MITSU_LAMCACHE_ENTRIES) {
+		plane = lib->lamcache[i];
+	} else {
+		/* Nope, toss out the least recently used one */
+		i = MITSU_LAMCACHE_ENTRIES - 1;
+		mitsu_lamplane_free(&lib->lamcache[i]);
+
+		memset(&plane, 0, sizeof(plane));
+		ret = mitsu_expandlamdata(fname, lamstride, rows, cols, bpp, &plane.data);
+		if (ret)
+			return ret;
+		plane.fname = strdup(fname);
+		if (!plane.fname) {
+			ERROR("Memory allocation failure!\n");
+			free(plane.data);
+			return CUPS_BACKEND_RETRY_CURRENT;
 		}
-		/* Back off the buffer so we "wrap" on the print row. */
-		*datalen -= ((lamstride - cols) * bpp);
+		plane.lamstride = lamstride;
+		plane.rows = rows;
+		plane.cols = cols;
+		plane.bpp = bpp;
 	}
 
+	/* Move it to the front of the list */
+	memmove(&lib->lamcache[1], &lib->lamcache[0], i * sizeof(plane));
+	lib->lamcache[0] = plane;
+
+	memcpy(databuf + *datalen, plane.data, rows * cols * bpp);
+	*datalen += rows * cols * bpp;
+
 	return CUPS_BACKEND_OK;
 }
 
@@ -96,11 +96,24 @@ typedef int (*CPD30_DoConvertFN)(const struct mitsu_cpd30_data *table,
 
 #define REQUIRED_LIB_APIVERSION 8
 
-#define LIBMITSU_VER "0.09"
+#define LIBMITSU_VER "0.10"
 
 /* Image processing library function prototypes */
 #define LIB_NAME_RE "libMitsuD70ImageReProcess" DLL_SUFFIX
 
+/* Fully expanded lamination planes, so matte jobs don't have to go
+   back to disk every time */
+#define MITSU_LAMCACHE_ENTRIES 4
+
+struct mitsu_lamplane {
+	char *fname;
+	uint16_t lamstride;
+	uint16_t rows;
+	uint16_t cols;
+	uint8_t bpp;
+	uint8_t *data;
+};
+
 struct mitsu_lib {
 	void *dl_handle;
 	lib70x_getapiversionFN GetAPIVersion;
@@ -133,6 +146,8 @@ struct mitsu_lib {
 	struct CColorConv3D *lut;
 	struct CPCData *cpcdata;
 	struct CPCData *ecpcdata;
+
+	struct mitsu_lamplane lamcache[MITSU_LAMCACHE_ENTRIES]; /* Most recent first */
 };
 
 int mitsu_loadlib(struct mitsu_lib *lib, int type);
@@ -143,7 +158,7 @@ int mitsu_apply3dlut_packed(struct mitsu_lib *lib, const char *lutfname, uint8_t
 int mitsu_apply3dlut_plane(struct mitsu_lib *lib, const char *lutfname,
 			   uint8_t *data_r, uint8_t *data_g, uint8_t *data_b,
 			   uint16_t cols, uint16_t rows);
-int mitsu_readlamdata(const char *fname, uint16_t lamstride,
+int mitsu_readlamdata(struct mitsu_lib *lib, const char *fname, uint16_t lamstride,
 		      uint8_t *databuf, uint32_t *datalen,
 		      uint16_t rows, uint16_t cols, uint8_t bpp);
 
@@ -45,6 +45,10 @@ struct mitsu70x_printjob {
 	uint8_t *spoolbuf;
 	int spoolbuflen;
 
+	/* Combined jobs reference their sources' spool data */
+	struct dyesub_seglist spool_segs;
+	const void *shared[2];
+
 	uint16_t rows;
 	uint16_t cols;
 	uint32_t planelen;
@@ -62,6 +66,15 @@ struct mitsu70x_printjob {
 	const char *lutfname;
 	const char *cpcfname;
 	const char *ecpcfname;
+
+	int prepared;
+	struct BandImage output;
+};
+
+struct mitsu70x_deck {
+	uint64_t busy_until; /* Estimated completion of last job sent (ms) */
+	uint64_t cool_until; /* Simulation only */
+	uint32_t jobs;       /* Jobs dispatched to this deck */
 };
 
 struct mitsu70x_ctx {
@@ -79,6 +92,12 @@ struct mitsu70x_ctx {
 	uint16_t last_u;
 	int num_decks;
 
+	/* D707 deck scheduler state */
+	struct mitsu70x_deck decks[2];
+	int last_deck;
+	int deck_sim;     /* Simulated deck timing (test mode only) */
+	uint64_t sim_now; /* ms */
+
 	char serno[7]; /* 6+null */
 	char fwver[7]; /* 6+null */
 
@@ -86,8 +105,6 @@ struct mitsu70x_ctx {
 
 	const char *last_cpcfname;
 	const char *last_ecpcfname;
-
-	struct BandImage output;
 };
 
 /* Printer data structures */
@@ -621,6 +638,8 @@ static int mitsu70x_attach(void *vctx, struct dyesub_connection *conn, uint8_t j
 		int media_code = 0xf;
 		if (getenv("MEDIA_CODE"))
 			media_code = atoi(getenv("MEDIA_CODE")) & 0xf;
+		if (getenv("DECK_SIM"))
+			ctx->deck_sim = atoi(getenv("DECK_SIM"));
 
 		resp.upper.mecha_status[0] = MECHA_STATUS_INIT;
 		resp.lower.mecha_status[0] = MECHA_STATUS_INIT;
@@ -721,8 +740,9 @@ static void mitsu70x_cleanup_job(const void *vjob) {
 
 	if (job->databuf)
 		free(job->databuf);
-	if (job->spoolbuf)
-		free(job->spoolbuf);
+	dyesub_buf_free(job->spoolbuf);
+	dyesub_buf_free(job->shared[0]);
+	dyesub_buf_free(job->shared[1]);
 
 	free((void*)job);
 }
@@ -811,6 +831,9 @@ static void *mitsu70x_combine_jobs(const void *vjob1,
         memcpy(newjob, job1, sizeof(*newjob));
 
 	newjob->spoolbuf = NULL;
+	newjob->spool_segs.num = 0;
+	newjob->spool_segs.len = 0;
+	newjob->shared[0] = newjob->shared[1] = NULL;
 	newjob->rows = newrows;
 	newjob->cols = newcols;
 	newjob->planelen = (((newrows * newcols * 2) + 511) /512) * 512;
@@ -841,32 +864,17 @@ static void *mitsu70x_combine_jobs(const void *vjob1,
 	newhdr->multicut = 1;
 	newhdr->deck = 0;  /* Let printer decide */
 
-	newjob->spoolbuf = malloc(newrows * newcols * 3);
+	/* Reference both spooled images instead of copying them; the
+	   processing library needs them contiguous, so they only get
+	   gathered together in the main loop right before it runs. */
+	newjob->shared[0] = dyesub_buf_ref(job1->spoolbuf);
+	newjob->shared[1] = dyesub_buf_ref(job2->spoolbuf);
 	newjob->spoolbuflen = 0;
-	if (!newjob->spoolbuf) {
-		mitsu70x_cleanup_job(newjob);
-		newjob = NULL;
-                ERROR("Memory allocation failure!\n");
-                goto done;
-	}
-
-	/* Fill in padding */
-	memset(newjob->spoolbuf + newjob->spoolbuflen, 0xff, finalpad * 3);
-	newjob->spoolbuflen += finalpad * 3;
 
-	/* Copy image payload */
-	memcpy(newjob->spoolbuf + newjob->spoolbuflen, job1->spoolbuf,
-	       job1->spoolbuflen);
-	newjob->spoolbuflen += job1->spoolbuflen;
-
-	/* Fill in padding */
-	memset(newjob->spoolbuf + newjob->spoolbuflen, 0xff, newpad * 3);
-	newjob->spoolbuflen += newpad * 3;
-
-	/* Copy image payload */
-	memcpy(newjob->spoolbuf + newjob->spoolbuflen, job2->spoolbuf,
-	       job2->spoolbuflen);
-	newjob->spoolbuflen += job2->spoolbuflen;
+	dyesub_seglist_fill(&newjob->spool_segs, 0xff, finalpad * 3);
+	dyesub_seglist_add(&newjob->spool_segs, job1->spoolbuf, job1->spoolbuflen);
+	dyesub_seglist_fill(&newjob->spool_segs, 0xff, newpad * 3);
+	dyesub_seglist_add(&newjob->spool_segs, job2->spoolbuf, job2->spoolbuflen);
 
 	/* Okay, we're done. */
 
@@ -896,18 +904,10 @@ static int mitsu70x_read_parse(void *vctx, const void **vjob, int data_fd, int c
 
 repeat:
 	/* Read in initial header */
-	remain = sizeof(mhdr);
-	while (remain > 0) {
-		i = read(data_fd, ((uint8_t*)&mhdr) + sizeof(mhdr) - remain, remain);
-		if (i == 0) {
-			mitsu70x_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		if (i < 0) {
-			mitsu70x_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		remain -= i;
+	i = dyesub_read_full(data_fd, &mhdr, sizeof(mhdr));
+	if (i != sizeof(mhdr)) {
+		mitsu70x_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
 	}
 
 	/* Skip over wakeup header if it's present. */
@@ -1076,19 +1076,12 @@ repeat:
 		      job->matte ? "L " : " ");
 
 		/* Read in the spool data */
-		while(remain) {
-			i = read(data_fd, job->databuf + job->datalen, remain);
-			if (i == 0) {
-				mitsu70x_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			if (i < 0) {
-				mitsu70x_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			job->datalen += i;
-			remain -= i;
+		i = dyesub_read_full(data_fd, job->databuf + job->datalen, remain);
+		if (i != remain) {
+			mitsu70x_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
 		}
+		job->datalen += i;
 		goto bypass_raw;
 	}
 
@@ -1097,7 +1090,7 @@ repeat:
 	DEBUG("Reading in %d bytes of 8bpp BGR data\n", remain);
 
 	job->spoolbuflen = 0;
-	job->spoolbuf = malloc(remain);
+	job->spoolbuf = dyesub_buf_alloc(remain);
 	if (!job->spoolbuf) {
 		ERROR("Memory allocation failure!\n");
 		mitsu70x_cleanup_job(job);
@@ -1105,19 +1098,12 @@ repeat:
 	}
 
 	/* Read in the BGR data */
-	while (remain) {
-		i = read(data_fd, job->spoolbuf + job->spoolbuflen, remain);
-		if (i == 0) {
-			mitsu70x_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		if (i < 0) {
-			mitsu70x_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		job->spoolbuflen += i;
-		remain -= i;
+	i = dyesub_read_full(data_fd, job->spoolbuf + job->spoolbuflen, remain);
+	if (i != remain) {
+		mitsu70x_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
 	}
+	job->spoolbuflen += i;
 
 	if (!ctx->lib.dl_handle) {
 		ERROR("!!! Image Processing Library not found, aborting!\n");
@@ -1209,6 +1195,8 @@ bypass_raw:
 		}
 	}
 
+	job->common.can_fold = 1;
+
 	/* Return what we found */
 	*vjob = job;
 
@@ -1724,36 +1712,23 @@ static int d70_library_callback(void *context, void *buffer, uint32_t len)
 	return ret;
 }
 
-static int mitsu70x_main_loop(void *vctx, const void *vjob, int wait_for_return)
+static int mitsu70x_prepare_job(void *vctx, const void *vjob)
 {
 	struct mitsu70x_ctx *ctx = vctx;
-	struct mitsu70x_jobstatus jobstatus;
-	struct mitsu70x_printerstatus_resp resp;
+	struct mitsu70x_printjob *job = (struct mitsu70x_printjob *) vjob;
 	struct mitsu70x_hdr *hdr;
-	uint8_t last_status[4] = {0xff, 0xff, 0xff, 0xff};
-
+	struct BandImage input;
+	uint8_t rew[2] = { 1, 1 }; /* 1 for rewind ok (default!) */
+	uint64_t key;
 	int ret;
-	int copies;
-	int deck, legal, reqdeck;
 
-	struct mitsu70x_printjob *job = (struct mitsu70x_printjob *) vjob;
-
-	if (!ctx)
+	if (!ctx || !job)
 		return CUPS_BACKEND_FAILED;
-	if (!job)
-		return CUPS_BACKEND_FAILED;
-
-	copies = job->common.copies;
-	hdr = (struct mitsu70x_hdr*) job->databuf;
-
-	/* Keep track of deck requested */
-	reqdeck = hdr->deck;
 
-	if (job->raw_format)
-		goto bypass;
+	if (job->raw_format || job->prepared)
+		return CUPS_BACKEND_OK;
 
-	struct BandImage input;
-	uint8_t rew[2] = { 1, 1 }; /* 1 for rewind ok (default!) */
+	hdr = (struct mitsu70x_hdr*) job->databuf;
 
 	/* Load in the CPC file, if needed */
 	if (job->cpcfname && job->cpcfname != ctx->last_cpcfname) {
@@ -1791,6 +1766,22 @@ static int mitsu70x_main_loop(void *vctx, const void *vjob, int wait_for_return)
 		}
 	}
 
+	/* Gather up combined jobs' image data */
+	if (job->spool_segs.num) {
+		job->spoolbuf = dyesub_buf_alloc(job->spool_segs.len);
+		if (!job->spoolbuf) {
+			ERROR("Memory allocation failure!\n");
+			return CUPS_BACKEND_RETRY_CURRENT;
+		}
+		dyesub_seglist_gather(&job->spool_segs, job->spoolbuf);
+		job->spoolbuflen = job->spool_segs.len;
+		job->spool_segs.num = 0;
+		job->spool_segs.len = 0;
+		dyesub_buf_free(job->shared[0]);
+		dyesub_buf_free(job->shared[1]);
+		job->shared[0] = job->shared[1] = NULL;
+	}
+
 	/* Convert using image processing library */
 	input.origin_rows = input.origin_cols = 0;
 	input.rows = job->rows;
@@ -1798,17 +1789,49 @@ static int mitsu70x_main_loop(void *vctx, const void *vjob, int wait_for_return)
 	input.imgbuf = job->spoolbuf;
 	input.bytes_per_row = job->cols * 3;
 
-	ctx->output.origin_rows = ctx->output.origin_cols = 0;
-	ctx->output.rows = job->rows;
-	ctx->output.cols = job->cols;
-	ctx->output.imgbuf = job->databuf + job->datalen;
-	ctx->output.bytes_per_row = job->cols * 3 * 2;
+	job->output.origin_rows = job->output.origin_cols = 0;
+	job->output.rows = job->rows;
+	job->output.cols = job->cols;
+	job->output.imgbuf = job->databuf + job->datalen;
+	job->output.bytes_per_row = job->cols * 3 * 2;
+
+	/* The output depends on the image, everything we feed the
+	   library alongside it, and the library itself */
+	key = dyesub_hash(DYESUB_HASH_INIT, job->spoolbuf, job->spoolbuflen);
+	key = dyesub_hash(key, &ctx->conn->type, sizeof(ctx->conn->type));
+	key = dyesub_hash(key, &job->rows, sizeof(job->rows));
+	key = dyesub_hash(key, &job->cols, sizeof(job->cols));
+	key = dyesub_hash(key, &job->sharpen, sizeof(job->sharpen));
+	key = dyesub_hash(key, &job->reverse, sizeof(job->reverse));
+	if (job->cpcfname) {
+		char full[2048];
+		snprintf(full, sizeof(full), "%s/%s", corrtable_path, job->cpcfname);
+		key = dyesub_hash_file(key, full);
+	}
+	key = dyesub_hash(key, "/", 1);
+	if (job->ecpcfname) {
+		char full[2048];
+		snprintf(full, sizeof(full), "%s/%s", corrtable_path, job->ecpcfname);
+		key = dyesub_hash_file(key, full);
+	}
+	if (ctx->lib.GetAPIVersion) {
+		int api = ctx->lib.GetAPIVersion();
+		key = dyesub_hash(key, &api, sizeof(api));
+	}
+	key = dyesub_hash_lib(key, ctx->lib.dl_handle, (void*)ctx->lib.GetAPIVersion);
 
-	DEBUG("Running print data through processing library\n");
-	if (ctx->lib.DoImageEffect(ctx->lib.cpcdata, ctx->lib.ecpcdata,
-				   &input, &ctx->output, job->sharpen, job->reverse, rew)) {
-		ERROR("Image Processing failed, aborting!\n");
-		return CUPS_BACKEND_CANCEL;
+	if (!dyesub_outcache_get(key, job->output.imgbuf, 3*job->planelen,
+				 rew, sizeof(rew))) {
+		DEBUG("Using previously processed print data\n");
+	} else {
+		DEBUG("Running print data through processing library\n");
+		if (ctx->lib.DoImageEffect(ctx->lib.cpcdata, ctx->lib.ecpcdata,
+					   &input, &job->output, job->sharpen, job->reverse, rew)) {
+			ERROR("Image Processing failed, aborting!\n");
+			return CUPS_BACKEND_CANCEL;
+		}
+		dyesub_outcache_put(key, job->output.imgbuf, 3*job->planelen,
+				    rew, sizeof(rew));
 	}
 
 	/* Twiddle rewind stuff if needed */
@@ -1822,13 +1845,13 @@ static int mitsu70x_main_loop(void *vctx, const void *vjob, int wait_for_return)
 	job->datalen += 3*job->planelen;
 
 	/* Clean up */
-	free(job->spoolbuf);
+	dyesub_buf_free(job->spoolbuf);
 	job->spoolbuf = NULL;
 	job->spoolbuflen = 0;
 
 	/* Now that we've filled everything in, read matte from file */
 	if (job->matte) {
-		ret = mitsu_readlamdata(job->laminatefname, LAMINATE_STRIDE,
+		ret = mitsu_readlamdata(&ctx->lib, job->laminatefname, LAMINATE_STRIDE,
 					job->databuf, &job->datalen,
 					be16_to_cpu(hdr->lamrows), be16_to_cpu(hdr->lamcols), 2);
 		if (ret)
@@ -1839,23 +1862,191 @@ static int mitsu70x_main_loop(void *vctx, const void *vjob, int wait_for_return)
 		memset(job->databuf + job->datalen, 0, job->matte - ret);
 	}
 
-bypass:
+	job->prepared = 1;
+
+	return CUPS_BACKEND_OK;
+}
+
+/* Deck scheduler, for the dual-deck D707.
+
+   The printer tells us whether each deck is idle, busy, cooling down or
+   faulted, but not when a busy deck will come free.  We keep a rough
+   estimate of that ourselves, so we can poll harder when a deck is about
+   to free up, and so the test-mode simulation has something to work with.
+*/
+#define DECK_POLL_FAST     250  /* ms */
+#define DECK_POLL_SLOW    1000  /* ms */
+#define DECK_EST_SLACK    5000  /* ms past estimate before we give up on it */
+
+#define DECK_SIM_COOLJOBS    5  /* Simulated cooldown every N prints.. */
+#define DECK_SIM_COOLTIME 20000 /* ..lasting this long (ms) */
+
+static uint64_t mitsu70x_deck_now(struct mitsu70x_ctx *ctx)
+{
+	struct timespec ts;
+
+	if (ctx->deck_sim)
+		return ctx->sim_now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void mitsu70x_deck_sleep(struct mitsu70x_ctx *ctx, int msec)
+{
+	struct timespec ts = { msec / 1000, (msec % 1000) * 1000000 };
+
+	if (ctx->deck_sim)
+		ctx->sim_now += msec;
+	else
+		nanosleep(&ts, NULL);
+}
+
+/* Very rough; a D70 turns out a 4x6 in ~8s and a 6x8 in ~14s at the
+   default speed.  The slower speeds and the matte pass add to that. */
+static uint32_t mitsu70x_deck_esttime(const struct mitsu70x_printjob *job)
+{
+	const struct mitsu70x_hdr *hdr = (const struct mitsu70x_hdr *) job->databuf;
+	uint32_t msec = 2000 + job->rows * 5;
+
+	if (hdr->speed == 3 || hdr->speed == 4)
+		msec *= 2;
+	if (job->matte)
+		msec += msec / 3;
+
+	return msec;
+}
+
+/* Fake up the deck state from what we've dispatched so far */
+static void mitsu70x_deck_simstatus(struct mitsu70x_ctx *ctx,
+				    struct mitsu70x_jobstatus *resp)
+{
+	uint64_t now = mitsu70x_deck_now(ctx);
+
+	memset(resp, 0, sizeof(*resp));
+
+	if (now < ctx->decks[0].busy_until)
+		resp->mecha_status[0] = MECHA_STATUS_PRINT;
+	else if (now < ctx->decks[0].cool_until)
+		resp->temperature = TEMPERATURE_COOLING;
+
+	if (ctx->num_decks < 2)
+		return;
+
+	if (now < ctx->decks[1].busy_until)
+		resp->mecha_status_up[0] = MECHA_STATUS_PRINT;
+	else if (now < ctx->decks[1].cool_until)
+		resp->temperature_up = TEMPERATURE_COOLING;
+}
+
+/* Pick one of the decks in 'ready', all of which can take the job now */
+static int mitsu70x_deck_pick(struct mitsu70x_ctx *ctx, int ready)
+{
+	if (ready != 3)
+		return ready;
+
+	/* Spread the load so neither deck runs dry while the other
+	   still has plenty of media left.. */
+	if (ctx->marker[0].levelnow > ctx->marker[1].levelnow)
+		return 1;
+	if (ctx->marker[1].levelnow > ctx->marker[0].levelnow)
+		return 2;
+
+	/* ..otherwise just alternate */
+	return (ctx->last_deck == 1) ? 2 : 1;
+}
+
+/* None of the legal decks can take the job right now; wait a bit */
+static void mitsu70x_deck_wait(struct mitsu70x_ctx *ctx, int legal,
+			       const struct mitsu70x_jobstatus *sts)
+{
+	uint64_t now = mitsu70x_deck_now(ctx);
+	int msec = DECK_POLL_SLOW;
+	int i;
+
+	for (i = 0 ; i < ctx->num_decks ; i++) {
+		uint8_t temp = i ? sts->temperature_up : sts->temperature;
+		uint64_t est = ctx->decks[i].busy_until;
+
+		if (!(legal & (1 << i)) || temp == TEMPERATURE_COOLING)
+			continue;
+		/* Poll faster if we expect the deck to come free shortly */
+		if (est && est <= now + DECK_POLL_SLOW &&
+		    now < est + DECK_EST_SLACK)
+			msec = DECK_POLL_FAST;
+	}
+
+	mitsu70x_deck_sleep(ctx, msec);
+}
+
+static void mitsu70x_deck_dispatch(struct mitsu70x_ctx *ctx, int deck,
+				   const struct mitsu70x_printjob *job)
+{
+	struct mitsu70x_deck *d = &ctx->decks[deck - 1];
+	uint32_t msec = mitsu70x_deck_esttime(job);
+
+	d->busy_until = mitsu70x_deck_now(ctx) + msec;
+	d->jobs++;
+	ctx->last_deck = deck;
+
+	if (ctx->deck_sim) {
+		if (!(d->jobs % DECK_SIM_COOLJOBS))
+			d->cool_until = d->busy_until + DECK_SIM_COOLTIME;
+		if (ctx->marker[deck - 1].levelnow > 0)
+			ctx->marker[deck - 1].levelnow--;
+	}
+
+	if (ctx->num_decks > 1)
+		DEBUG("Deck %d: job #%u, busy for ~%ums\n", deck, d->jobs, msec);
+}
+
+static int mitsu70x_main_loop(void *vctx, const void *vjob, int wait_for_return)
+{
+	struct mitsu70x_ctx *ctx = vctx;
+	struct mitsu70x_jobstatus jobstatus;
+	struct mitsu70x_printerstatus_resp resp;
+	struct mitsu70x_hdr *hdr;
+	uint8_t last_status[4] = {0xff, 0xff, 0xff, 0xff};
+
+	int ret;
+	int copies;
+	int deck, legal, reqdeck;
+
+	struct mitsu70x_printjob *job = (struct mitsu70x_printjob *) vjob;
+
+	if (!ctx)
+		return CUPS_BACKEND_FAILED;
+	if (!job)
+		return CUPS_BACKEND_FAILED;
+
+	copies = job->common.copies;
+	hdr = (struct mitsu70x_hdr*) job->databuf;
+
+	/* Keep track of deck requested */
+	reqdeck = hdr->deck;
+
 	/* Bypass */
-	if (test_mode >= TEST_MODE_NOPRINT)
+	if (test_mode >= TEST_MODE_NOPRINT && !ctx->deck_sim)
 		return CUPS_BACKEND_OK;
 
 	INFO("Waiting for printer idle...\n");
 
 	/* Ensure printer is awake */
-	ret = mitsu70x_wakeup(ctx, 1);
-	if (ret)
-		return CUPS_BACKEND_FAILED;
+	if (!ctx->deck_sim) {
+		ret = mitsu70x_wakeup(ctx, 1);
+		if (ret)
+			return CUPS_BACKEND_FAILED;
+	}
 
 top:
 	/* Query job status for jobid 0 (global) */
-	ret = mitsu70x_get_jobstatus(ctx, &jobstatus, 0x0000);
-	if (ret)
-		return CUPS_BACKEND_FAILED;
+	if (ctx->deck_sim) {
+		mitsu70x_deck_simstatus(ctx, &jobstatus);
+	} else {
+		ret = mitsu70x_get_jobstatus(ctx, &jobstatus, 0x0000);
+		if (ret)
+			return CUPS_BACKEND_FAILED;
+	}
 
 	/* Figure out which deck(s) can be used.
 	   This should be in the main loop due to copy retries */
@@ -1940,13 +2131,7 @@ top:
 		}
 	}
 
-	if (deck == 3) {
-		/* Both decks OK to use, pick one at random */
-		if (rand() & 1)
-			deck = 1;
-		else
-			deck = 2;
-	}
+	deck = mitsu70x_deck_pick(ctx, deck);
 
 	if (ctx->num_decks > 1)
 		DEBUG("Deck selected: %d\n", deck);
@@ -1973,10 +2158,19 @@ top:
 		}
 
 		/* Legal decks are busy, retry */
-		sleep(1);
+		mitsu70x_deck_wait(ctx, legal, &jobstatus);
 		goto top;
 	}
 
+	if (ctx->deck_sim) {
+		mitsu70x_deck_dispatch(ctx, deck, job);
+		INFO("Simulated print on deck %d at %ums (%d copies remaining)\n",
+		     deck, (uint32_t)ctx->sim_now, copies - 1);
+		if (copies && --copies)
+			goto top;
+		return CUPS_BACKEND_OK;
+	}
+
 	/* Perform memory status query */
 	{
 		struct mitsu70x_memorystatus_resp memory;
@@ -2037,6 +2231,7 @@ top:
 
 	/* We're clear to send data over! */
 	INFO("Sending Print Job (internal id %u)\n", ctx->jobid);
+	mitsu70x_deck_dispatch(ctx, deck, job);
 
 	if ((ret = send_data(ctx->conn,
 			     job->databuf,
@@ -2044,7 +2239,7 @@ top:
 		return CUPS_BACKEND_FAILED;
 
 	if (ctx->lib.dl_handle && !job->raw_format) {
-		if (ctx->lib.SendImageData(&ctx->output, ctx, d70_library_callback))
+		if (ctx->lib.SendImageData(&job->output, ctx, d70_library_callback))
 			return CUPS_BACKEND_FAILED;
 
 		if (job->matte)
@@ -2083,6 +2278,7 @@ top:
 			ctx->marker[1].levelmax = be16_to_cpu(resp.upper.capacity);
 			ctx->marker[1].levelnow = be16_to_cpu(resp.upper.remain);
 		}
+		dyesub_status_touch();
 		if (ctx->marker[0].levelnow != ctx->last_l ||
 		    ctx->marker[1].levelnow != ctx->last_u) {
 			dump_markers(ctx->marker, ctx->num_decks, 0);
@@ -2584,7 +2780,7 @@ static const char *mitsu70x_prefixes[] = {
 /* Exported */
 const struct dyesub_backend mitsu70x_backend = {
 	.name = "Mitsubishi CP-D70 family",
-	.version = "0.107" " (lib " LIBMITSU_VER ")",
+	.version = "0.116" " (lib " LIBMITSU_VER ")",
 	.flags = BACKEND_FLAG_DUMMYPRINT,
 	.uri_prefixes = mitsu70x_prefixes,
 	.cmdline_usage = mitsu70x_cmdline,
@@ -2595,6 +2791,7 @@ const struct dyesub_backend mitsu70x_backend = {
 	.cleanup_job = mitsu70x_cleanup_job,
 	.read_parse = mitsu70x_read_parse,
 	.main_loop = mitsu70x_main_loop,
+	.prepare_job = mitsu70x_prepare_job,
 	.query_serno = mitsu70x_query_serno,
 	.query_markers = mitsu70x_query_markers,
 	.query_stats = mitsu70x_query_stats,
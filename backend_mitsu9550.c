@@ -108,6 +108,8 @@ struct mitsu9550_printjob {
 	int hdr3_present;
 	struct mitsu9550_hdr4 hdr4;
 	int hdr4_present;
+
+	int prepared;
 };
 
 struct mitsu9550_ctx {
@@ -245,6 +247,7 @@ static const char *cp30_media_types(uint16_t remain)
 		ctx->marker.levelnow = donor;				\
 		dump_markers(&ctx->marker, 1, 0);			\
 	}								\
+	dyesub_status_touch();						\
 	/* Sanity-check media response */				\
 	if ((media->remain == 0 && media->remain2 == 0) || media->max == 0) { \
 		ERROR("Printer out of media!\n");			\
@@ -298,7 +301,7 @@ static const char *cp30_media_types(uint16_t remain)
 		QUERY_STATUS_III;					\
 	}								\
 
-static int mitsu98xx_fillmatte(struct mitsu9550_printjob *job)
+static int mitsu98xx_fillmatte(struct mitsu9550_ctx *ctx, struct mitsu9550_printjob *job)
 {
 	int ret;
 
@@ -314,7 +317,7 @@ static int mitsu98xx_fillmatte(struct mitsu9550_printjob *job)
 	matte->rows = cpu_to_be16(job->hdr1.rows);
 	job->datalen += sizeof(struct mitsu9550_plane);
 
-	ret = mitsu_readlamdata(MITSU_M98xx_LAMINATE_FILE, LAMINATE_STRIDE,
+	ret = mitsu_readlamdata(&ctx->lib, MITSU_M98xx_LAMINATE_FILE, LAMINATE_STRIDE,
 				job->databuf, &job->datalen,
 				job->rows, job->cols, 2);
 	if (ret)
@@ -469,17 +472,10 @@ static int mitsu9550_read_parse(void *vctx, const void **vjob, int data_fd, int
 top:
 	/* Read in initial header */
 	remain = sizeof(buf);
-	while (remain > 0) {
-		i = read(data_fd, buf + sizeof(buf) - remain, remain);
-		if (i == 0) {
-			mitsu9550_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		if (i < 0) {
-			mitsu9550_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		remain -= i;
+	i = dyesub_read_full(data_fd, buf + sizeof(buf) - remain, remain);
+	if (i != remain) {
+		mitsu9550_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
 	}
 
 	/* Sanity check */
@@ -631,30 +627,19 @@ hdr_done:
 		planelen -= sizeof(buf) - sizeof(struct mitsu9550_plane);
 
 		/* Read in the spool data */
-		while(planelen > 0) {
-			i = read(data_fd, job->databuf + job->datalen, planelen);
-			if (i == 0) {
-				mitsu9550_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			if (i < 0) {
-				mitsu9550_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			job->datalen += i;
-			planelen -= i;
+		i = dyesub_read_full(data_fd, job->databuf + job->datalen, planelen);
+		if (i != (int)planelen) {
+			mitsu9550_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
 		}
+		job->datalen += i;
 
 		/* Try to read in the next chunk.  It will be one of:
 		    - Additional block header (12B)
 		    - Job footer (4B)
 		*/
-		i = read(data_fd, buf, ctx->footer_len);
-		if (i == 0) {
-			mitsu9550_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		if (i < 0) {
+		i = dyesub_read_full(data_fd, buf, ctx->footer_len);
+		if (i != ctx->footer_len) {
 			mitsu9550_cleanup_job(job);
 			return CUPS_BACKEND_CANCEL;
 		}
@@ -679,17 +664,10 @@ hdr_done:
 		}
 
 		/* Read in the rest of the header */
-		while (remain > 0) {
-			i = read(data_fd, buf + sizeof(buf) - remain, remain);
-			if (i == 0) {
-				mitsu9550_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			if (i < 0) {
-				mitsu9550_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			remain -= i;
+		i = dyesub_read_full(data_fd, buf + sizeof(buf) - remain, remain);
+		if (i != remain) {
+			mitsu9550_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
 		}
 	}
 
@@ -1004,33 +982,26 @@ static int validate_media(int type, int media, int cols, int rows)
 	return CUPS_BACKEND_OK;
 }
 
-static int mitsu9550_main_loop(void *vctx, const void *vjob, int wait_for_return) {
+static int mitsu9550_prepare_job(void *vctx, const void *vjob)
+{
 	struct mitsu9550_ctx *ctx = vctx;
-	struct mitsu9550_cmd cmd;
-	uint8_t rdbuf[READBACK_LEN];
-	uint8_t *ptr;
-
-	int ret;
-#if 0
-	int copies = 1;
-#endif
-
 	struct mitsu9550_printjob *job = (struct mitsu9550_printjob*) vjob;
+	int sharpness;
 
 	if (!ctx)
 		return CUPS_BACKEND_FAILED;
 	if (!job)
 		return CUPS_BACKEND_FAILED;
 
-	/* Okay, let's do this thing */
-	ptr = job->databuf;
+	if (job->prepared)
+		return CUPS_BACKEND_OK;
 
-	int sharpness = job->hdr2.unkc[7];
+	sharpness = job->hdr2.unkc[7];
 	job->hdr2.unkc[7] = 0;  /* Clear "sharpness" parameter */
 
-	/* Do the 98xx processing here */
+	/* Only the CP98xx needs any processing */
 	if (!ctx->is_98xx || job->is_raw)
-		goto non_98xx;
+		goto done;
 
 	/* Special CP98xx handling code */
 	uint8_t *newbuf;
@@ -1125,16 +1096,41 @@ static int mitsu9550_main_loop(void *vctx, const void *vjob, int wait_for_return
 	free(job->databuf);
 	job->databuf = newbuf;
 	job->datalen = newlen;
-	ptr = job->databuf;
 
 	/* Now handle the matte plane generation */
 	if (job->hdr1.matte) {
-		if ((i = mitsu98xx_fillmatte(job))) {
+		if ((i = mitsu98xx_fillmatte(ctx, job))) {
 			return i;
 		}
 	}
 
-non_98xx:
+done:
+	job->prepared = 1;
+
+	return CUPS_BACKEND_OK;
+}
+
+static int mitsu9550_main_loop(void *vctx, const void *vjob, int wait_for_return) {
+	struct mitsu9550_ctx *ctx = vctx;
+	struct mitsu9550_cmd cmd;
+	uint8_t rdbuf[READBACK_LEN];
+	uint8_t *ptr;
+
+	int ret, planelen;
+#if 0
+	int copies = 1;
+#endif
+
+	struct mitsu9550_printjob *job = (struct mitsu9550_printjob*) vjob;
+
+	if (!ctx)
+		return CUPS_BACKEND_FAILED;
+	if (!job)
+		return CUPS_BACKEND_FAILED;
+
+	/* Okay, let's do this thing */
+	ptr = job->databuf;
+
 	/* Bypass */
 	if (test_mode >= TEST_MODE_NOPRINT)
 		return CUPS_BACKEND_OK;
@@ -1612,7 +1608,7 @@ static const char *mitsu9550_prefixes[] = {
 /* Exported */
 const struct dyesub_backend mitsu9550_backend = {
 	.name = "Mitsubishi CP9xxx family",
-	.version = "0.63" " (lib " LIBMITSU_VER ")",
+	.version = "0.66" " (lib " LIBMITSU_VER ")",
 	.uri_prefixes = mitsu9550_prefixes,
 	.cmdline_usage = mitsu9550_cmdline,
 	.cmdline_arg = mitsu9550_cmdline_arg,
@@ -1622,6 +1618,7 @@ const struct dyesub_backend mitsu9550_backend = {
 	.cleanup_job = mitsu9550_cleanup_job,
 	.read_parse = mitsu9550_read_parse,
 	.main_loop = mitsu9550_main_loop,
+	.prepare_job = mitsu9550_prepare_job,
 	.query_serno = mitsu9550_query_serno,
 	.query_markers = mitsu9550_query_markers,
 	.devices = {
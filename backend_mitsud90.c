@@ -463,6 +463,8 @@ struct mitsud90_printjob {
 
 	int has_footer;
 	struct mitsud90_job_footer footer;
+
+	int prepared;
 };
 
 struct mitsud90_ctx {
@@ -472,8 +474,6 @@ struct mitsud90_ctx {
 	char fwver[7]; /* 6+null */
 
 	/* Used in parsing.. */
-	struct mitsud90_job_footer holdover;
-	int holdover_on;
 
 	int pano_page;
 
@@ -748,13 +748,11 @@ static int mitsud90_panorama_splitjob(struct mitsud90_printjob *injob, struct mi
 		return CUPS_BACKEND_CANCEL;
 	}
 
-	/* Work out which number of rows per panel */
-	if (!panel_rows[0]) {
-		panel_rows[0] = max_rows;
-		panel_rows[1] = inrows - panel_rows[0] + overlap_rows;
-		if (numpanels > 2)
-			panel_rows[2] = inrows - panel_rows[0] - panel_rows[1] + overlap_rows + overlap_rows;
-	}
+	/* Work out how many panels we need, and the rows in each */
+	i = dyesub_pano_panel_rows(inrows, &numpanels, overlap_rows,
+				   max_rows, panel_rows);
+	if (i)
+		return i;
 
 	/* Allocate and set up new jobs and buffers */
 	for (i = 0 ; i < numpanels ; i++) {
@@ -763,7 +761,7 @@ static int mitsud90_panorama_splitjob(struct mitsud90_printjob *injob, struct mi
 			ERROR("Memory allocation failure");
 			return CUPS_BACKEND_RETRY_CURRENT;
 		}
-		panels[i] = malloc(cols * panel_rows[i] * 3) + sizeof(struct mitsud90_plane_hdr);
+		panels[i] = malloc(cols * panel_rows[i] * 3 + sizeof(struct mitsud90_plane_hdr));
 		if (!panels[i]) {
 			ERROR("Memory allocation failure");
 			return CUPS_BACKEND_RETRY_CURRENT;
@@ -771,10 +769,11 @@ static int mitsud90_panorama_splitjob(struct mitsud90_printjob *injob, struct mi
 		/* Fill in job header differences */
 		memcpy(newjobs[i], injob, sizeof(struct mitsud90_printjob));
 		newjobs[i]->databuf = panels[i];
+		newjobs[i]->datalen = cols * panel_rows[i] * 3 + sizeof(struct mitsud90_plane_hdr);
 		newjobs[i]->hdr.rows = cpu_to_be16(panel_rows[i]);
 		newjobs[i]->hdr.pano.on = 1;
 		newjobs[i]->hdr.pano.total = numpanels;
-		newjobs[i]->hdr.pano.page = i;
+		newjobs[i]->hdr.pano.page = i + 1;
 		newjobs[i]->hdr.pano.rows = cpu_to_be16(panel_rows[i]);
 		newjobs[i]->hdr.pano.rows2 = cpu_to_be16(panel_rows[i] - 0x30);
 		newjobs[i]->hdr.pano.overlap = cpu_to_be16(overlap_rows);
@@ -793,14 +792,10 @@ static int mitsud90_panorama_splitjob(struct mitsud90_printjob *injob, struct mi
 	/* Last panel gets the footer, if any */
 	newjobs[numpanels - 1]->has_footer = injob->has_footer;
 
-	dyesub_pano_split_rgb8(injob->databuf, cols, inrows,
-			       numpanels, overlap_rows, max_rows,
-			       panels, panel_rows);
-
-	// XXX process buffers!
-	// pano_process_rgb8(numpanels, cols, overlap_rows, panels, panel_rows);
-
-	return CUPS_BACKEND_OK;
+	return dyesub_pano_split_rgb8(injob->databuf + sizeof(struct mitsud90_plane_hdr),
+				      cols, inrows,
+				      numpanels, overlap_rows, max_rows,
+				      panels, panel_rows);
 }
 
 static int mitsud90_read_parse(void *vctx, const void **vjob, int data_fd, int copies) {
@@ -822,28 +817,10 @@ static int mitsud90_read_parse(void *vctx, const void **vjob, int data_fd, int c
 	job->common.copies = copies;
 
 	/* Read in header */
-	uint8_t *hptr = (uint8_t*) &job->hdr;
-	uint16_t hremain = sizeof(struct mitsud90_job_hdr);
-
-	/* Make sure there's no holdover */
-	if (ctx->holdover_on) {
-		memcpy(hptr, &ctx->holdover, sizeof(ctx->holdover));
-		hremain -= sizeof(ctx->holdover);
-		ctx->holdover_on = 0;
-	}
-	/* Read the rest */
-	while (hremain) {
-		i = read(data_fd, hptr, hremain);
-		if (i == 0) {
-			mitsud90_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		if (i < 0) {
-			mitsud90_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		hremain -= i;
-		hptr += i;
+	i = dyesub_read_full(data_fd, &job->hdr, sizeof(job->hdr));
+	if (i != sizeof(job->hdr)) {
+		mitsud90_cleanup_job(job);
+		return CUPS_BACKEND_CANCEL;
 	}
 
 	/* Sanity check header */
@@ -873,16 +850,16 @@ static int mitsud90_read_parse(void *vctx, const void **vjob, int data_fd, int c
 	}
 
 	/* Sanity check panorama parameters */
-	if (job->hdr.pano.on &&
+	if (job->hdr.pano.on && !job->is_pano &&
 	    ctx->conn->type == P_MITSU_D90) {
-		if ((be16_to_cpu(job->hdr.pano.total) < 2 &&
-		     be16_to_cpu(job->hdr.pano.total) > 3) ||
-		    (be16_to_cpu(job->hdr.pano.page) < 1 &&
-		     be16_to_cpu(job->hdr.pano.page) > 3) ||
-		    be16_to_cpu(job->hdr.pano.page) != (ctx->pano_page + 1) ||
-		    be16_to_cpu(job->hdr.pano.rows != 2428) ||
-		    be16_to_cpu(job->hdr.pano.rows2 != (2428-0x30)) ||
-		    be16_to_cpu(job->hdr.pano.overlap != 600)
+		if (job->hdr.pano.total < 2 ||
+		    job->hdr.pano.total > 3 ||
+		    job->hdr.pano.page < 1 ||
+		    job->hdr.pano.page > job->hdr.pano.total ||
+		    job->hdr.pano.page != (ctx->pano_page + 1) ||
+		    be16_to_cpu(job->hdr.pano.rows) != 2428 ||
+		    be16_to_cpu(job->hdr.pano.rows2) != (2428-0x30) ||
+		    be16_to_cpu(job->hdr.pano.overlap) != 600
 			) {
 			ERROR("Invalid panorama parameters");
 			mitsud90_cleanup_job(job);
@@ -937,42 +914,35 @@ static int mitsud90_read_parse(void *vctx, const void **vjob, int data_fd, int c
 	job->datalen = 0;
 
 	/* Now read in the rest */
-	while(remain) {
-		i = read(data_fd, job->databuf + job->datalen, remain);
-		if (i == 0) {
-			mitsud90_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		if (i < 0) {
-			mitsud90_cleanup_job(job);
-			return CUPS_BACKEND_CANCEL;
-		}
-		job->datalen += i;
-		remain -= i;
-	}
-
-	/* Read in the footer.  Hopefully... */
-	i = read(data_fd, (uint8_t*)&job->footer, sizeof(job->footer));
-	if (i == 0) {
-		mitsud90_cleanup_job(job);
-		return CUPS_BACKEND_CANCEL;
-	}
-	if (i < 0) {
+	i = dyesub_read_full(data_fd, job->databuf + job->datalen, remain);
+	if (i != remain) {
 		mitsud90_cleanup_job(job);
 		return CUPS_BACKEND_CANCEL;
 	}
+	job->datalen += i;
 
-	/* See if this is a job footer.  If it is, keep, else holdover. */
-	if (job->footer.hdr[0] != 0x1b ||
-	    job->footer.hdr[1] != 0x42 ||
-	    job->footer.hdr[2] != 0x51 ||
-	    job->footer.hdr[3] != 0x31) {
-		memcpy(&ctx->holdover, &job->footer, sizeof(job->footer));
-	        ctx->holdover_on = 1;
-		// XXX generate a footer!
-	} else {
-		job->has_footer = 1;
-		ctx->holdover_on = 0;
+	/* Peek at the footer.  Hopefully... */
+	{
+		const uint8_t *peek;
+
+		i = dyesub_peek(data_fd, &peek, sizeof(job->footer));
+		if (i <= 0) {
+			mitsud90_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
+
+		/* See if this is a job footer.  If it is, keep it, otherwise
+		   leave it for the next job. */
+		if (i == sizeof(job->footer) &&
+		    peek[0] == 0x1b &&
+		    peek[1] == 0x42 &&
+		    peek[2] == 0x51 &&
+		    peek[3] == 0x31) {
+			memcpy(&job->footer, dyesub_read_span(data_fd, i), i);
+			job->has_footer = 1;
+		} else {
+			// XXX generate a footer!
+		}
 	}
 
 	/* CP-M1 has... other considerations */
@@ -1018,6 +988,7 @@ static int mitsud90_read_parse(void *vctx, const void **vjob, int data_fd, int c
 
 		return rval;
 	} else {
+		job->common.can_fold = 1;
 		*vjob = job;
 	}
 
@@ -1028,7 +999,7 @@ static int mitsud90_read_parse(void *vctx, const void **vjob, int data_fd, int c
 	return CUPS_BACKEND_OK;
 }
 
-static int cpm1_fillmatte(struct mitsud90_printjob *job)
+static int cpm1_fillmatte(struct mitsud90_ctx *ctx, struct mitsud90_printjob *job)
 {
 	int ret;
 	int rows, cols;
@@ -1039,7 +1010,7 @@ static int cpm1_fillmatte(struct mitsud90_printjob *job)
 	cols = be16_to_cpu(job->hdr.cols);
 
 	/* Fill in matte data */
-	ret = mitsu_readlamdata(CPM1_LAMINATE_FILE, CPM1_LAMINATE_STRIDE,
+	ret = mitsu_readlamdata(&ctx->lib, CPM1_LAMINATE_FILE, CPM1_LAMINATE_STRIDE,
 				job->databuf, &job->datalen,
 				rows, cols, 1);
 
@@ -1053,44 +1024,19 @@ static int cpm1_fillmatte(struct mitsud90_printjob *job)
 	return CUPS_BACKEND_OK;
 }
 
-static int mitsud90_main_loop(void *vctx, const void *vjob, int wait_for_return) {
+static int mitsud90_prepare_job(void *vctx, const void *vjob)
+{
 	struct mitsud90_ctx *ctx = vctx;
-	struct mitsud90_status_resp resp;
-	uint8_t last_status[2] = {0xff, 0xff};
-
-	int sent;
-	int ret;
-	int copies;
-
 	struct mitsud90_printjob *job = (struct mitsud90_printjob *)vjob;
+	int ret;
 
 	if (!ctx)
 		return CUPS_BACKEND_FAILED;
 	if (!job)
 		return CUPS_BACKEND_FAILED;
-	copies = job->common.copies;
 
-	/* Handle panorama state */
-	if (ctx->conn->type == P_MITSU_D90) {
-		if (job->hdr.pano.on) {
-			ctx->pano_page++;
-			if (be16_to_cpu(job->hdr.pano.page) != ctx->pano_page) {
-				ERROR("Invalid panorama state (page %d of %d)\n",
-				      ctx->pano_page, be16_to_cpu(job->hdr.pano.page));
-				return CUPS_BACKEND_FAILED;
-			}
-			if (copies > 1) {
-				WARNING("Cannot print non-collated copies of a panorama job\n");
-				copies = 1;
-			}
-		} else if (ctx->pano_page) {
-			/* Clean up panorama state */
-			WARNING("Dangling panorama state!\n");
-			ctx->pano_page = 0;
-		}
-	} else {
-		ctx->pano_page = 0;
-	}
+	if (job->prepared)
+		return CUPS_BACKEND_OK;
 
 	if ((ctx->conn->type == P_MITSU_M1 ||
 	     ctx->conn->type == P_FUJI_ASK500) && !job->is_raw) {
@@ -1193,11 +1139,9 @@ static int mitsud90_main_loop(void *vctx, const void *vjob, int wait_for_return)
 		/* Deal with lamination settings */
 		if (job->hdr.overcoat == 3) {
 			int pre_matte_len = job->datalen;
-			ret = cpm1_fillmatte(job);
-			if (ret) {
-				mitsud90_cleanup_job(job);
+			ret = cpm1_fillmatte(ctx, job);
+			if (ret)
 				return ret;
-			}
 			job->hdr.oprate = ctx->lib.M1_CalcOpRateMatte(output.rows,
 								      output.cols,
 								      job->databuf + pre_matte_len);
@@ -1207,6 +1151,53 @@ static int mitsud90_main_loop(void *vctx, const void *vjob, int wait_for_return)
 		}
 	}
 
+	job->prepared = 1;
+
+	return CUPS_BACKEND_OK;
+}
+
+static int mitsud90_main_loop(void *vctx, const void *vjob, int wait_for_return) {
+	struct mitsud90_ctx *ctx = vctx;
+	struct mitsud90_status_resp resp;
+	uint8_t last_status[2] = {0xff, 0xff};
+
+	int sent;
+	int ret;
+	int copies;
+
+	struct mitsud90_printjob *job = (struct mitsud90_printjob *)vjob;
+
+	if (!ctx)
+		return CUPS_BACKEND_FAILED;
+	if (!job)
+		return CUPS_BACKEND_FAILED;
+	copies = job->common.copies;
+
+	/* Handle panorama state */
+	if (ctx->conn->type == P_MITSU_D90) {
+		if (job->hdr.pano.on) {
+			ctx->pano_page++;
+			if (job->hdr.pano.page != ctx->pano_page) {
+				ERROR("Invalid panorama state (page %d of %d)\n",
+				      ctx->pano_page, job->hdr.pano.page);
+				return CUPS_BACKEND_FAILED;
+			}
+			/* Last panel completes the panorama */
+			if (job->hdr.pano.page == job->hdr.pano.total)
+				ctx->pano_page = 0;
+			if (copies > 1) {
+				WARNING("Cannot print non-collated copies of a panorama job\n");
+				copies = 1;
+			}
+		} else if (ctx->pano_page) {
+			/* Clean up panorama state */
+			WARNING("Dangling panorama state!\n");
+			ctx->pano_page = 0;
+		}
+	} else {
+		ctx->pano_page = 0;
+	}
+
 	/* Bypass */
 	if (test_mode >= TEST_MODE_NOPRINT)
 		return CUPS_BACKEND_OK;
@@ -1998,7 +1989,7 @@ static const char *mitsud90_prefixes[] = {
 /* Exported */
 const struct dyesub_backend mitsud90_backend = {
 	.name = "Mitsubishi CP-D90/CP-M1",
-	.version = "0.37"  " (lib " LIBMITSU_VER ")",
+	.version = "0.41"  " (lib " LIBMITSU_VER ")",
 	.uri_prefixes = mitsud90_prefixes,
 	.cmdline_arg = mitsud90_cmdline_arg,
 	.cmdline_usage = mitsud90_cmdline,
@@ -2008,6 +1999,7 @@ const struct dyesub_backend mitsud90_backend = {
 	.cleanup_job = mitsud90_cleanup_job,
 	.read_parse = mitsud90_read_parse,
 	.main_loop = mitsud90_main_loop,
+	.prepare_job = mitsud90_prepare_job,
 	.query_serno = mitsud90_query_serno,
 	.query_markers = mitsud90_query_markers,
 	.query_stats = mitsud90_query_stats,
@@ -198,13 +198,8 @@ static int mitsup95d_read_parse(void *vctx, const void **vjob, int data_fd, int
 	job->mem_clr_present = 0;
 
 top:
-	i = read(data_fd, buf, sizeof(buf));
-
-	if (i == 0) {
-		mitsup95d_cleanup_job(job);
-		return CUPS_BACKEND_CANCEL;
-	}
-	if (i < 0) {
+	i = dyesub_read_full(data_fd, buf, sizeof(buf));
+	if (i != sizeof(buf)) {
 		mitsup95d_cleanup_job(job);
 		return CUPS_BACKEND_CANCEL;
 	}
@@ -253,7 +248,7 @@ top:
 	ptr_offset = sizeof(buf);
 
 	while (remain) {
-		i = read(data_fd, ptr + ptr_offset, remain);
+		i = dyesub_read(data_fd, ptr + ptr_offset, remain);
 		if (i == 0) {
 			mitsup95d_cleanup_job(job);
 			return CUPS_BACKEND_CANCEL;
@@ -318,19 +313,12 @@ top:
 		}
 
 		/* Read it in */
-		while (remain) {
-			i = read(data_fd, job->databuf + job->datalen, remain);
-			if (i == 0) {
-				mitsup95d_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			if (i < 0) {
-				mitsup95d_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			remain -= i;
-			job->datalen += i;
+		i = dyesub_read_full(data_fd, job->databuf, remain);
+		if (i != remain) {
+			mitsup95d_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
 		}
+		job->datalen = i;
 	} else if (ptr == job->ftr) {
 
 		/* Update unknown header field to match sniffs */
@@ -1001,10 +1001,33 @@ static int shinkos1245_read_parse(void *vctx, const void **vjob, int data_fd, in
 	if (job->common.copies < copies)
 		job->common.copies = copies;
 
+	/* See if the loaded media can take two of these at once */
+	if (job->jp.method == PRINT_METHOD_STD) {
+		job->combo = sinfonia_find_2up(ctx->medias, ctx->num_medias, job);
+		job->common.can_combine = !!job->combo;
+	}
+	job->common.can_fold = 1;
+
 	*vjob = job;
 	return CUPS_BACKEND_OK;
 }
 
+static void *shinkos1245_combine_jobs(const void *vjob1,
+				      const void *vjob2)
+{
+	const struct sinfonia_printjob *job1 = vjob1;
+	struct sinfonia_printjob *newjob;
+
+	newjob = sinfonia_combine_2up(vjob1, vjob2, 0, 0xff);
+	if (!newjob)
+		return NULL;
+
+	newjob->jp.media = job1->combo->code;
+	newjob->jp.method = job1->combo->method;
+
+	return newjob;
+}
+
 static int shinkos1245_main_loop(void *vctx, const void *vjob, int wait_for_return) {
 	struct shinkos1245_ctx *ctx = vctx;
 	int i, num, last_state = -1, state = S_IDLE;
@@ -1062,7 +1085,7 @@ top:
 
 	last_state = state;
 
-	fflush(logger);
+	dyesub_log_flush();
 
 	switch (state) {
 	case S_IDLE:
@@ -1281,7 +1304,7 @@ static const char *shinkos1245_prefixes[] = {
 
 const struct dyesub_backend shinkos1245_backend = {
 	.name = "Shinko/Sinfonia CHC-S1245/E1",
-	.version = "0.35" " (lib " LIBSINFONIA_VER ")",
+	.version = "0.37" " (lib " LIBSINFONIA_VER ")",
 	.uri_prefixes = shinkos1245_prefixes,
 	.cmdline_usage = shinkos1245_cmdline,
 	.cmdline_arg = shinkos1245_cmdline_arg,
@@ -1293,6 +1316,7 @@ const struct dyesub_backend shinkos1245_backend = {
 	.query_serno = shinkos1245_query_serno,
 	.query_markers = shinkos1245_query_markers,
 	.query_stats = shinkos1245_query_stats,
+	.combine_jobs = shinkos1245_combine_jobs,
 	.devices = {
 		{ 0x10ce, 0x0007, P_SHINKO_S1245, NULL, "shinko-chcs1245"},
 		{ 0x10ce, 0x0007, P_SHINKO_S1245, NULL, "sinfonia-chcs1245"}, /* Duplicate */
@@ -916,11 +916,34 @@ static int shinkos2145_read_parse(void *vctx, const void **vjob, int data_fd, in
 	if (job->common.copies < copies)
 		job->common.copies = copies;
 
+	/* See if the loaded media can take two of these at once */
+	if (job->jp.method == PRINT_METHOD_STD) {
+		job->combo = sinfonia_find_2up(ctx->media.items, ctx->media.count, job);
+		job->common.can_combine = !!job->combo;
+	}
+	job->common.can_fold = 1;
+
 	*vjob = job;
 
 	return CUPS_BACKEND_OK;
 }
 
+static void *shinkos2145_combine_jobs(const void *vjob1,
+				      const void *vjob2)
+{
+	const struct sinfonia_printjob *job1 = vjob1;
+	struct sinfonia_printjob *newjob;
+
+	newjob = sinfonia_combine_2up(vjob1, vjob2, 0, 0xff);
+	if (!newjob)
+		return NULL;
+
+	newjob->jp.media = job1->combo->code;
+	newjob->jp.method = job1->combo->method;
+
+	return newjob;
+}
+
 static int shinkos2145_main_loop(void *vctx, const void *vjob, int wait_for_return) {
 	struct shinkos2145_ctx *ctx = vctx;
 
@@ -985,7 +1008,7 @@ top:
 	}
 	last_state = state;
 
-	fflush(logger);
+	dyesub_log_flush();
 
 	switch (state) {
 	case S_IDLE:
@@ -1222,7 +1245,7 @@ static const char *shinkos2145_prefixes[] = {
 
 const struct dyesub_backend shinkos2145_backend = {
 	.name = "Shinko/Sinfonia CHC-S2145/S2",
-	.version = "0.67" " (lib " LIBSINFONIA_VER ")",
+	.version = "0.69" " (lib " LIBSINFONIA_VER ")",
 	.uri_prefixes = shinkos2145_prefixes,
 	.cmdline_usage = shinkos2145_cmdline,
 	.cmdline_arg = shinkos2145_cmdline_arg,
@@ -1234,6 +1257,7 @@ const struct dyesub_backend shinkos2145_backend = {
 	.query_serno = shinkos2145_query_serno,
 	.query_markers = shinkos2145_query_markers,
 	.query_stats = shinkos2145_query_stats,
+	.combine_jobs = shinkos2145_combine_jobs,
 	.devices = {
 		{ 0x10ce, 0x000e, P_SHINKO_S2145, NULL, "shinko-chcs2145"},
 		{ 0x10ce, 0x000e, P_SHINKO_S2145, NULL, "sinfonia-chcs2145"}, /* Duplicate */
@@ -640,6 +640,7 @@ struct shinkos6145_ctx {
 
 	void *corrdata;  /* Correction table */
 	uint16_t corrdatalen;
+	uint32_t corrgen; /* Bumped whenever corrdata is reloaded */
 };
 
 static const char *s2245_drivermodes(uint8_t val);
@@ -867,6 +868,7 @@ static int shinkos6145_get_imagecorr(struct shinkos6145_ctx *ctx)
 	cmd.cmd = cpu_to_le16(SINFONIA_CMD_GETCORR);
 	cmd.len = 0;
 
+	ctx->corrgen++;
 	if (ctx->corrdata) {
 		free(ctx->corrdata);
 		ctx->corrdata = NULL;
@@ -926,6 +928,7 @@ static int shinkos2245_get_imagecorr(struct shinkos6145_ctx *ctx, uint8_t option
 	cmd.flags = S2245_IMAGECORR_FLAG_CONTOUR_ENH; // XXX make configurable?  or key off a flag in the job?
 	memset(cmd.null, 0, sizeof(cmd.null));
 
+	ctx->corrgen++;
 	if (ctx->corrdata) {
 		free(ctx->corrdata);
 		ctx->corrdata = NULL;
@@ -1221,8 +1224,10 @@ static int shinkos6145_attach(void *vctx, struct dyesub_connection *conn, uint8_
 				ctx->dl_handle = NULL;
 			} else {
 				DEBUG("Image processing library successfully loaded\n");
-				if (!stats_only && ctx->DumpAnnounce)
+				if (!stats_only && ctx->DumpAnnounce) {
+					dyesub_log_flush();
 					ctx->DumpAnnounce(logger);
+				}
 			}
 		}
 #endif
@@ -1247,8 +1252,10 @@ static int shinkos6145_attach(void *vctx, struct dyesub_connection *conn, uint8_
 				ctx->dl_handle = NULL;
 			} else {
 				DEBUG("Image processing library successfully loaded\n");
-				if (!stats_only && ctx->DumpAnnounce)
+				if (!stats_only && ctx->DumpAnnounce) {
+					dyesub_log_flush();
 					ctx->DumpAnnounce(logger);
+				}
 			}
 		}
 #endif
@@ -1307,6 +1314,16 @@ static void shinkos6145_teardown(void *vctx) {
 	free(ctx);
 }
 
+/* 2* 4x6 on 6x8 media; print media and method are filled in when combining */
+static const struct sinfonia_mediainfo_item s6145_4x6_2up = {
+	.columns = 1844,
+	.rows = 2492,
+};
+static const struct sinfonia_mediainfo_item s2245_4x6_2up = {
+	.columns = 1844,
+	.rows = 2492,
+};
+
 static int shinkos6145_read_parse(void *vctx, const void **vjob, int data_fd, int copies) {
 	struct shinkos6145_ctx *ctx = vctx;
 	struct sinfonia_printjob *job = NULL;
@@ -1345,6 +1362,30 @@ static int shinkos6145_read_parse(void *vctx, const void **vjob, int data_fd, in
 	if (job->common.copies < copies)
 		job->common.copies = copies;
 
+	/* EK6900 panoramas need to be split into multiple panels */
+	if (ctx->dev.conn->type == P_KODAK_6900 &&
+	    ((job->jp.columns == 1548 && job->jp.rows > 2136) ||
+	     (job->jp.columns == 1844 && job->jp.rows > 2436))) {
+		if (job->jp.ext_flags & EXT_FLAG_PLANARYMC) {
+			ERROR("Panorama prints must be packed RGB!\n");
+			sinfonia_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
+		if (job->common.copies > 1) {
+			WARNING("Multiple copies of panorama prints is not supported!\n");
+			job->common.copies = 1;
+		}
+
+		ret = sinfonia_panorama_splitjob(job,
+						 job->jp.columns == 1548 ? 2136 : 2436,
+						 (struct sinfonia_printjob**)vjob);
+
+		/* Unconditionally clean up original job regardless */
+		sinfonia_cleanup_job(job);
+
+		return ret;
+	}
+
 	/* S6145 can only combine 2* 4x6 -> 8x6.
 	   2x6 strips and 3.5x5 -> 5x7 can't.
 	   S2245 can combine 2x6 strips too!
@@ -1355,9 +1396,10 @@ static int shinkos6145_read_parse(void *vctx, const void **vjob, int data_fd, in
 	     ctx->media.ribbon_code == RIBBON_6x9)) {
 
 		if (model == 6145 && job->jp.method == PRINT_METHOD_STD)
-			job->common.can_combine = 1;
+			job->combo = &s6145_4x6_2up;
 		else if (model == 2245)
-			job->common.can_combine = 1;
+			job->combo = &s2245_4x6_2up;
+		job->common.can_combine = !!job->combo;
 	}
 
 	/* Extended spool format to re-purpose an unused header field.
@@ -1390,101 +1432,293 @@ static int shinkos6145_read_parse(void *vctx, const void **vjob, int data_fd, in
 		job->databuf = databuf3;
 	}
 
+	job->common.can_fold = 1;
 	*vjob = job;
 
 	return CUPS_BACKEND_OK;
 }
 
-#define JOB_EQUIV(__x)  if (job1->__x != job2->__x) goto done
-
 static void *shinkos6145_combine_jobs(const void *vjob1,
 				      const void *vjob2)
 {
 	const struct sinfonia_printjob *job1 = vjob1;
-	const struct sinfonia_printjob *job2 = vjob2;
-	struct sinfonia_printjob *newjob = NULL;
-
-	uint16_t newrows;
-	uint16_t newpad;
-
-	if (!job1 || !job2)
-		goto done;
-
-	/* Make sure we're okay to proceed */
-	JOB_EQUIV(jp.columns);
-	JOB_EQUIV(jp.rows);
-	JOB_EQUIV(jp.oc_mode);
-	JOB_EQUIV(jp.method);
-	JOB_EQUIV(jp.media);
-	JOB_EQUIV(jp.quality);
-
-	switch (job1->jp.rows) {
-	case 1240:  /* 4x6 */
-		newrows = 2492;
-		newpad = 12;
-		break;
-	default:
-		/* All other sizes, we can't combine */
-		goto done;
-	}
+	struct sinfonia_printjob *newjob;
 
-        newjob = malloc(sizeof(*newjob));
-        if (!newjob) {
-                ERROR("Memory allocation failure!\n");
-                goto done;
-        }
-        memcpy(newjob, job1, sizeof(*newjob));
+	/* The S6145 wants planar YMC, the S2245 works on packed RGB */
+	if (job1->combo == &s6145_4x6_2up)
+		newjob = sinfonia_combine_2up(vjob1, vjob2, 1, 0x00);
+	else
+		newjob = sinfonia_combine_2up(vjob1, vjob2, 0, 0xff);
+	if (!newjob)
+		return NULL;
 
-	newjob->jp.rows = newrows;
 	newjob->jp.media = CODE_6x8;
-
 	if (job1->jp.method == PRINT_METHOD_SPLIT) /* 4x6-div2 -> 8x6-div4 */
 		newjob->jp.method = PRINT_METHOD_COMBO_4;
 	else /* 4x6 -> 8x6-div2 */
 		newjob->jp.method = PRINT_METHOD_SPLIT;
 
-	/* Allocate new buffer */
-	newjob->databuf = malloc(newjob->jp.rows * newjob->jp.columns * 3);
-	newjob->datalen = 0;
-	if (!newjob->databuf) {
-		sinfonia_cleanup_job(newjob);
-		newjob = NULL;
-		goto done;
+	return newjob;
+}
+
+static uint8_t s2245_oc_mode(const struct sinfonia_printjob *job)
+{
+	return (job->jp.oc_mode & SINFONIA_PRINT28_OC_MASK) | (job->jp.quality ? SINFONIA_PRINT28_OPTIONS_HQ : 0);
+}
+
+/* Correction data covers media, overcoat mode and the printer's own
+   calibration, so it goes into the key along with the image itself and
+   whichever processing library was loaded. */
+static uint64_t shinkos6145_outkey(const struct shinkos6145_ctx *ctx,
+				   const struct sinfonia_printjob *job)
+{
+	uint64_t key;
+
+	key = dyesub_hash(DYESUB_HASH_INIT, job->databuf, job->jp.columns * job->jp.rows * 3);
+	key = dyesub_hash(key, &job->jp.columns, sizeof(job->jp.columns));
+	key = dyesub_hash(key, &job->jp.rows, sizeof(job->jp.rows));
+	key = dyesub_hash(key, &ctx->is_2245, sizeof(ctx->is_2245));
+	key = dyesub_hash(key, ctx->corrdata, ctx->corrdatalen);
+	key = dyesub_hash_lib(key, ctx->dl_handle,
+			      ctx->is_2245 ? (void*)ctx->ip_imageProc : (void*)ctx->ImageProcessing);
+
+	return key;
+}
+
+/* Run the image processing library over the job, using the currently
+   loaded correction data.  The job itself is left untouched. */
+static int shinkos6145_process(struct shinkos6145_ctx *ctx,
+			       const struct sinfonia_printjob *job,
+			       uint8_t **outbuf, int *outlen, uint8_t *avg)
+{
+	uint64_t key;
+
+	if (ctx->is_2245) {
+		uint32_t bufSize = 0;
+		uint16_t *newbuf;
+
+		if (!ctx->ip_checkIpp(job->jp.columns, job->jp.rows, ctx->corrdata)) {
+			ERROR("ip_checkIPP Failed!\n");
+			return CUPS_BACKEND_FAILED;
+		}
+		if (!ctx->ip_getMemorySize(&bufSize, job->jp.columns, job->jp.rows, ctx->corrdata)) {
+			ERROR("ip_getMemorySize Failed!\n");
+			return CUPS_BACKEND_FAILED;
+		}
+		newbuf = malloc(bufSize);
+		if (!newbuf) {
+			ERROR("Memory Allocation failure!\n");
+			return CUPS_BACKEND_RETRY;
+		}
+		key = shinkos6145_outkey(ctx, job);
+		if (dyesub_outcache_get(key, newbuf, bufSize, NULL, 0)) {
+			if (!ctx->ip_imageProc(newbuf, job->databuf, job->jp.columns, job->jp.rows, ctx->corrdata)) {
+				ERROR("ip_imageProc Failed!\n");
+				free(newbuf);
+				return CUPS_BACKEND_FAILED;
+			}
+			dyesub_outcache_put(key, newbuf, bufSize, NULL, 0);
+		}
+		*outbuf = (uint8_t*)newbuf;
+		*outlen = bufSize;
+	} else {
+		uint16_t tmp;
+		memcpy(&tmp, (uint8_t*)ctx->corrdata + S6145_CORRDATA_HEADDOTS_OFFSET, sizeof(tmp));
+		tmp = le16_to_cpu(tmp);
+
+		/* Set up library transform... */
+		uint32_t newlen = tmp * job->jp.rows * sizeof(uint16_t) * 4;
+		uint16_t *databuf2 = malloc(newlen);
+		if (!databuf2) {
+			ERROR("Memory Allocation failure!\n");
+			return CUPS_BACKEND_RETRY;
+		}
+		/* Set the size in the correctiondata */
+		tmp = cpu_to_le16(job->jp.columns);
+		memcpy((uint8_t*)ctx->corrdata + S6145_CORRDATA_WIDTH_OFFSET, &tmp, sizeof(tmp));
+		tmp = cpu_to_le16(job->jp.rows);
+		memcpy((uint8_t*)ctx->corrdata + S6145_CORRDATA_HEIGHT_OFFSET, &tmp, sizeof(tmp));
+
+		key = shinkos6145_outkey(ctx, job);
+		if (!dyesub_outcache_get(key, databuf2, newlen, avg, 3)) {
+			*outbuf = (uint8_t*) databuf2;
+			*outlen = newlen;
+			return CUPS_BACKEND_OK;
+		}
+
+		/* Perform the actual library transform */
+		if (ctx->ImageAvrCalc(job->databuf, job->jp.columns, job->jp.rows, avg)) {
+			free(databuf2);
+			ERROR("Library returned error!\n");
+			return CUPS_BACKEND_FAILED;
+		}
+		ctx->ImageProcessing(job->databuf, databuf2, ctx->corrdata);
+		dyesub_outcache_put(key, databuf2, newlen, avg, 3);
+
+		*outbuf = (uint8_t*) databuf2;
+		*outlen = newlen;
 	}
 
-	/* Copy Planar YMC payload into new buffer! */
-	memcpy(newjob->databuf + newjob->datalen,
-	       job1->databuf,
-	       job1->jp.rows * job1->jp.columns);
-	newjob->datalen += job1->jp.rows * job1->jp.columns;
-	memset(newjob->databuf + newjob->datalen, 0xff, newpad * newjob->jp.columns);
-	memcpy(newjob->databuf + newjob->datalen,
-	       job2->databuf,
-	       job2->jp.rows * job2->jp.columns);
-	newjob->datalen += job2->jp.rows * job2->jp.columns;
-
-	memcpy(newjob->databuf + newjob->datalen,
-	       job1->databuf + (job1->jp.rows * job1->jp.columns),
-	       job1->jp.rows * job1->jp.columns);
-	newjob->datalen += job1->jp.rows * job1->jp.columns;
-	memset(newjob->databuf + newjob->datalen, 0xff, newpad * newjob->jp.columns);
-	memcpy(newjob->databuf + newjob->datalen,
-	       job2->databuf + (job2->jp.rows * job2->jp.columns),
-	       job2->jp.rows * job2->jp.columns);
-	newjob->datalen += job2->jp.rows * job2->jp.columns;
-
-	memcpy(newjob->databuf + newjob->datalen,
-	       job1->databuf + 2*(job1->jp.rows * job1->jp.columns),
-	       job1->jp.rows * job1->jp.columns);
-	newjob->datalen += job1->jp.rows * job1->jp.columns;
-	memset(newjob->databuf + newjob->datalen, 0xff, newpad * newjob->jp.columns);
-	memcpy(newjob->databuf + newjob->datalen,
-	       job2->databuf + 2*(job2->jp.rows * job2->jp.columns),
-	       job2->jp.rows * job2->jp.columns);
-	newjob->datalen += job2->jp.rows * job2->jp.columns;
+	return CUPS_BACKEND_OK;
+}
 
-done:
-	return newjob;
+static int shinkos6145_query_ident(struct shinkos6145_ctx *ctx)
+{
+	struct sinfonia_fwinfo_cmd  fcmd;
+	struct sinfonia_fwinfo_resp resp;
+	int num = 0;
+
+	if (!ctx->serial[0] &&
+	    sinfonia_query_serno(ctx->dev.conn,
+				 ctx->serial, sizeof(ctx->serial)))
+		return CUPS_BACKEND_FAILED;
+
+	if (ctx->fwver[0])
+		return CUPS_BACKEND_OK;
+
+	fcmd.hdr.cmd = cpu_to_le16(SINFONIA_CMD_FWINFO);
+	fcmd.hdr.len = cpu_to_le16(1);
+	fcmd.target = FWINFO_TARGET_MAIN_APP;
+
+	if (sinfonia_docmd(&ctx->dev,
+			   (uint8_t*)&fcmd, sizeof(fcmd),
+			   (uint8_t*)&resp, sizeof(resp),
+			   &num))
+		return CUPS_BACKEND_FAILED;
+	snprintf(ctx->fwver, sizeof(ctx->fwver)-1,
+		 "%d.%d", resp.major, resp.minor);
+
+	return CUPS_BACKEND_OK;
+}
+
+/* Image correction data takes several seconds to pull from the printer
+   but only changes if the printer is recalibrated or reflashed, so keep
+   a copy on disk keyed by serial number, firmware version, EEPROM
+   contents and overcoat mode. */
+static int shinkos6145_load_imagecorr(struct shinkos6145_ctx *ctx, uint8_t oc_mode)
+{
+	char key[128] = "";
+	uint32_t hash = 2166136261U; /* FNV-1a */
+	void *buf;
+	int ret, len = 0;
+	size_t i;
+
+	if (!cache_path || !ctx->eeprom || test_mode >= TEST_MODE_NOATTACH ||
+	    shinkos6145_query_ident(ctx))
+		goto fetch;
+
+	for (i = 0 ; i < ctx->eepromlen ; i++) {
+		hash ^= ctx->eeprom[i];
+		hash *= 16777619U;
+	}
+	snprintf(key, sizeof(key), "%s-%s-%s-%08x-%02x.corr",
+		 ctx->is_2245 ? "s2245" : "s6145",
+		 ctx->serial, ctx->fwver, hash, oc_mode);
+
+	buf = dyesub_cache_load(key, ctx->is_2245 ? 0 : S6145_CORRDATA_EXTRA_LEN, &len);
+	if (buf && len <= 0xffff) {
+		INFO("Using cached image correction data\n");
+		ctx->corrgen++;
+		free(ctx->corrdata);
+		ctx->corrdata = buf;
+		ctx->corrdatalen = len;
+		return CUPS_BACKEND_OK;
+	}
+	free(buf);
+
+fetch:
+	if (ctx->is_2245) {
+		ret = shinkos2245_get_imagecorr(ctx, oc_mode);
+	} else {
+		ret = shinkos6145_get_imagecorr(ctx);
+	}
+	if (ret || !ctx->corrdata)
+		return ret;
+
+	if (key[0])
+		dyesub_cache_store(key, ctx->corrdata, ctx->corrdatalen);
+
+	return CUPS_BACKEND_OK;
+}
+
+/* Speculative; runs while the previous job is printing.  If we can't do
+   it now, or the correction data changes before this job gets printed,
+   shinkos6145_ready_job() will (re)process the job itself. */
+static int shinkos6145_prepare_job(void *vctx, const void *vjob)
+{
+	struct shinkos6145_ctx *ctx = vctx;
+	struct sinfonia_printjob *job = (struct sinfonia_printjob*) vjob;
+
+	if (!ctx || !job)
+		return CUPS_BACKEND_FAILED;
+
+	if (job->procbuf || job->processed)
+		return CUPS_BACKEND_OK;
+	if (!ctx->dl_handle || !ctx->corrdata || !ctx->corrdatalen)
+		return CUPS_BACKEND_OK;
+
+	/* S2245 correction data is specific to the overcoat mode */
+	if (ctx->is_2245 &&
+	    (ctx->corrdatalen <= S2245_CORRDATA_HEADER_MODE_OFFSET ||
+	     ((uint8_t*)ctx->corrdata)[S2245_CORRDATA_HEADER_MODE_OFFSET] != s2245_oc_mode(job)))
+		return CUPS_BACKEND_OK;
+
+	DEBUG("Processing image ahead of time\n");
+	if (shinkos6145_process(ctx, job, &job->procbuf, &job->proclen, job->procavg))
+		return CUPS_BACKEND_OK;
+	job->procgen = ctx->corrgen;
+
+	return CUPS_BACKEND_OK;
+}
+
+/* Called with the prepare lock held */
+static int shinkos6145_ready_job(struct shinkos6145_ctx *ctx,
+				 struct sinfonia_printjob *job,
+				 uint32_t oc_mode, int updated)
+{
+	int ret = CUPS_BACKEND_OK;
+
+	/* Get image correction parameters if necessary */
+	if (updated || !ctx->corrdata || !ctx->corrdatalen) {
+		ret = shinkos6145_load_imagecorr(ctx, oc_mode);
+	}
+	if (ret) {
+		ERROR("Failed to execute command\n");
+		return ret;
+	}
+
+	/* Already done (ie collated copies or a retry) */
+	if (job->processed) {
+		memcpy(ctx->image_avg, job->procavg, sizeof(ctx->image_avg));
+		return CUPS_BACKEND_OK;
+	}
+
+	if (!ctx->dl_handle) {
+		ERROR("Image processing library not found!  Cannot print!\n");
+		return CUPS_BACKEND_FAILED;
+	}
+
+	if (job->procbuf && job->procgen == ctx->corrgen) {
+		INFO("Using image processed ahead of time\n");
+	} else {
+		INFO("Calling image processing library...\n");
+		if (job->procbuf) {
+			free(job->procbuf);
+			job->procbuf = NULL;
+		}
+		ret = shinkos6145_process(ctx, job, &job->procbuf, &job->proclen, job->procavg);
+		if (ret)
+			return ret;
+	}
+
+	free(job->databuf);
+	job->databuf = job->procbuf;
+	job->datalen = job->proclen;
+	job->procbuf = NULL;
+	job->processed = 1;
+	memcpy(ctx->image_avg, job->procavg, sizeof(ctx->image_avg));
+
+	return CUPS_BACKEND_OK;
 }
 
 static int shinkos6145_main_loop(void *vctx, const void *vjob, int wait_for_return) {
@@ -1573,6 +1807,7 @@ top:
 				  &num))) {
 		return CUPS_BACKEND_FAILED;
 	}
+	dyesub_status_touch();
 
 	if (memcmp(&sts, &sts2, sizeof(sts))) {
 		memcpy(&sts2, &sts, sizeof(sts));
@@ -1595,7 +1830,7 @@ top:
 	}
 	last_state = state;
 
-	fflush(logger);
+	dyesub_log_flush();
 
 	switch (state) {
 	case S_IDLE:
@@ -1612,7 +1847,7 @@ top:
 		uint32_t updated = 0;
 
 		if (ctx->is_2245) {
-			oc_mode = (job->jp.oc_mode & SINFONIA_PRINT28_OC_MASK) | (job->jp.quality ? SINFONIA_PRINT28_OPTIONS_HQ : 0);
+			oc_mode = s2245_oc_mode(job);
 			if (!ctx->corrdata ||
 			    ctx->corrdatalen <= S2245_CORRDATA_HEADER_MODE_OFFSET ||
 			    ((uint8_t*)ctx->corrdata)[S2245_CORRDATA_HEADER_MODE_OFFSET] != oc_mode)
@@ -1641,87 +1876,22 @@ top:
 			}
 		}
 
-		ret = shinkos6145_get_eeprom(ctx);
-		if (ret) {
-			ERROR("Failed to execute command\n");
-			return ret;
-		}
-
-		/* Get image correction parameters if necessary */
-		if (updated || !ctx->corrdata || !ctx->corrdatalen) {
-			if (ctx->is_2245) {
-				ret = shinkos2245_get_imagecorr(ctx, oc_mode);
-			} else {
-				ret = shinkos6145_get_imagecorr(ctx);
+		/* The EEPROM contents don't change underneath us */
+		if (!ctx->eeprom) {
+			ret = shinkos6145_get_eeprom(ctx);
+			if (ret) {
+				ERROR("Failed to execute command\n");
+				return ret;
 			}
 		}
-		if (ret) {
-			ERROR("Failed to execute command\n");
-			return ret;
-		}
-
-		if (ctx->dl_handle) {
-			INFO("Calling image processing library...\n");
-		} else {
-			ERROR("Image processing library not found!  Cannot print!\n");
-			return CUPS_BACKEND_FAILED;
-		}
-
-		if (ctx->is_2245) {
-			uint32_t bufSize = 0;
-			uint16_t *newbuf;
-
-			if (!ctx->ip_checkIpp(job->jp.columns, job->jp.rows, ctx->corrdata)) {
-				ERROR("ip_checkIPP Failed!\n");
-				return CUPS_BACKEND_FAILED;
-			}
-			if (!ctx->ip_getMemorySize(&bufSize, job->jp.columns, job->jp.rows, ctx->corrdata)) {
-				ERROR("ip_getMemorySize Failed!\n");
-				return CUPS_BACKEND_FAILED;
-			}
-			newbuf = malloc(bufSize);
-			if (!newbuf) {
-				ERROR("Memory Allocation failure!\n");
-				return CUPS_BACKEND_RETRY;
-			}
-			if (!ctx->ip_imageProc(newbuf, job->databuf, job->jp.columns, job->jp.rows, ctx->corrdata)) {
-				ERROR("ip_imageProc Failed!\n");
-				free(newbuf);
-				return CUPS_BACKEND_FAILED;
-			}
-			free(job->databuf);
-			job->databuf = (uint8_t*)newbuf;
-			job->datalen = bufSize;
-		} else {
-			uint16_t tmp;
-			memcpy(&tmp, (uint8_t*)ctx->corrdata + S6145_CORRDATA_HEADDOTS_OFFSET, sizeof(tmp));
-			tmp = le16_to_cpu(tmp);
-
-			/* Set up library transform... */
-			uint32_t newlen = tmp * job->jp.rows * sizeof(uint16_t) * 4;
-			uint16_t *databuf2 = malloc(newlen);
-			if (!databuf2) {
-				ERROR("Memory Allocation failure!\n");
-				return CUPS_BACKEND_RETRY;
-			}
-			/* Set the size in the correctiondata */
-			tmp = cpu_to_le16(job->jp.columns);
-			memcpy((uint8_t*)ctx->corrdata + S6145_CORRDATA_WIDTH_OFFSET, &tmp, sizeof(tmp));
-			tmp = cpu_to_le16(job->jp.rows);
-			memcpy((uint8_t*)ctx->corrdata + S6145_CORRDATA_HEIGHT_OFFSET, &tmp, sizeof(tmp));
-
-			/* Perform the actual library transform */
-			if (ctx->ImageAvrCalc(job->databuf, job->jp.columns, job->jp.rows, ctx->image_avg)) {
-				free(databuf2);
-				ERROR("Library returned error!\n");
-				return CUPS_BACKEND_FAILED;
-			}
-			ctx->ImageProcessing(job->databuf, databuf2, ctx->corrdata);
 
-			free(job->databuf);
-			job->databuf = (uint8_t*) databuf2;
-			job->datalen = newlen;
-		}
+		/* Fetch image correction parameters if needed, and process
+		   the image unless that was already done ahead of time */
+		dyesub_prepare_lock();
+		ret = shinkos6145_ready_job(ctx, job, oc_mode, updated);
+		dyesub_prepare_unlock();
+		if (ret)
+			return ret;
 
 		INFO("Sending print job (internal id %u)\n", ctx->jobid);
 
@@ -1910,30 +2080,13 @@ static int shinkos6145_query_stats(void *vctx,  struct printerstats *stats)
 		break;
 	}
 
-	if (sinfonia_query_serno(ctx->dev.conn,
-				 ctx->serial, sizeof(ctx->serial)))
+	ctx->serial[0] = 0;
+	ctx->fwver[0] = 0;
+	if (shinkos6145_query_ident(ctx))
 		return CUPS_BACKEND_FAILED;
 
 	stats->serial = ctx->serial;
-
-	{
-		struct sinfonia_fwinfo_cmd  fcmd;
-		struct sinfonia_fwinfo_resp resp;
-
-		num = 0;
-		fcmd.hdr.cmd = cpu_to_le16(SINFONIA_CMD_FWINFO);
-		fcmd.hdr.len = cpu_to_le16(1);
-		fcmd.target = FWINFO_TARGET_MAIN_APP;
-
-		if (sinfonia_docmd(&ctx->dev,
-				   (uint8_t*)&fcmd, sizeof(fcmd),
-				   (uint8_t*)&resp, sizeof(resp),
-				   &num))
-			return CUPS_BACKEND_FAILED;
-		snprintf(ctx->fwver, sizeof(ctx->fwver)-1,
-			 "%d.%d", resp.major, resp.minor);
-		stats->fwver = ctx->fwver;
-	}
+	stats->fwver = ctx->fwver;
 
 	stats->decks = 1;
 	stats->mediatype[0] = ctx->marker.name;
@@ -1961,7 +2114,7 @@ static const char *shinkos6145_prefixes[] = {
 
 const struct dyesub_backend shinkos6145_backend = {
 	.name = "Shinko/Sinfonia CHC-S6145/CS2/S2245/S3",
-	.version = "0.49" " (lib " LIBSINFONIA_VER ")",
+	.version = "0.57" " (lib " LIBSINFONIA_VER ")",
 	.uri_prefixes = shinkos6145_prefixes,
 	.cmdline_usage = shinkos6145_cmdline,
 	.cmdline_arg = shinkos6145_cmdline_arg,
@@ -1971,6 +2124,7 @@ const struct dyesub_backend shinkos6145_backend = {
 	.cleanup_job = sinfonia_cleanup_job,
 	.read_parse = shinkos6145_read_parse,
 	.main_loop = shinkos6145_main_loop,
+	.prepare_job = shinkos6145_prepare_job,
 	.query_serno = sinfonia_query_serno,
 	.query_markers = shinkos6145_query_markers,
 	.query_stats = shinkos6145_query_stats,
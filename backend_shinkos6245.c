@@ -1011,6 +1011,13 @@ static int shinkos6245_read_parse(void *vctx, const void **vjob, int data_fd, in
 		return rval;
 	}
 
+	/* See if the loaded media can take two of these at once */
+	if (job->jp.method == PRINT_METHOD_STD) {
+		job->combo = sinfonia_find_2up(ctx->media.items, ctx->media.count, job);
+		job->common.can_combine = !!job->combo;
+	}
+	job->common.can_fold = 1;
+
 	*vjob = job;
 
 	return CUPS_BACKEND_OK;
@@ -1072,6 +1079,22 @@ static struct kodak8810_cutlist cutlist_8x4x3_d = {
 	.cut[5] = 3624,
 };
 
+static void *shinkos6245_combine_jobs(const void *vjob1,
+				      const void *vjob2)
+{
+	const struct sinfonia_printjob *job1 = vjob1;
+	struct sinfonia_printjob *newjob;
+
+	newjob = sinfonia_combine_2up(vjob1, vjob2, 0, 0xff);
+	if (!newjob)
+		return NULL;
+
+	/* The main loop works out the method from this */
+	newjob->jp.media = job1->combo->code;
+
+	return newjob;
+}
+
 static int shinkos6245_main_loop(void *vctx, const void *vjob, int wait_for_return) {
 	struct shinkos6245_ctx *ctx = vctx;
 
@@ -1217,6 +1240,7 @@ top:
 				  &num))) {
 		return CUPS_BACKEND_FAILED;
 	}
+	dyesub_status_touch();
 
 	if (memcmp(&sts2, &sts, sizeof(sts))) {
 		memcpy(&sts2, &sts, sizeof(sts));
@@ -1239,7 +1263,7 @@ top:
 	}
 	last_state = state;
 
-	fflush(logger);
+	dyesub_log_flush();
 
 	switch (state) {
 	case S_IDLE:
@@ -1467,7 +1491,7 @@ static const char *shinkos6245_prefixes[] = {
 
 const struct dyesub_backend shinkos6245_backend = {
 	.name = "Sinfonia CHC-S6245 / Kodak 8810",
-	.version = "0.43" " (lib " LIBSINFONIA_VER ")",
+	.version = "0.47" " (lib " LIBSINFONIA_VER ")",
 	.uri_prefixes = shinkos6245_prefixes,
 	.cmdline_usage = shinkos6245_cmdline,
 	.cmdline_arg = shinkos6245_cmdline_arg,
@@ -1479,6 +1503,7 @@ const struct dyesub_backend shinkos6245_backend = {
 	.query_serno = sinfonia_query_serno,
 	.query_markers = shinkos6245_query_markers,
 	.query_stats = shinkos6245_query_stats,
+	.combine_jobs = shinkos6245_combine_jobs,
 	.devices = {
 		{ 0x10ce, 0x001d, P_SHINKO_S6245, NULL, "sinfonia-chcs6245"},
 		{ 0x10ce, 0x001d, P_SHINKO_S6245, NULL, "shinko-chcs6245"}, /* Duplicate */
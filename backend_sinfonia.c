@@ -37,14 +37,14 @@ int sinfonia_read_parse(int data_fd, uint32_t model,
 	job->common.jobsize = sizeof(*job);
 
 	/* Read in header */
-	ret = read(data_fd, hdr, SINFONIA_HDR_LEN);
+	ret = dyesub_read_full(data_fd, hdr, SINFONIA_HDR_LEN);
 	if (ret < 0 || ret != SINFONIA_HDR_LEN) {
 		if (ret == 0)
 			return CUPS_BACKEND_CANCEL;
 		ERROR("Read failed (%d/%d)\n",
 		      ret, SINFONIA_HDR_LEN);
 		perror("ERROR: Read failed");
-		return ret;
+		return (ret < 0) ? ret : CUPS_BACKEND_CANCEL;
 	}
 
 	/* Byteswap everything */
@@ -81,29 +81,25 @@ int sinfonia_read_parse(int data_fd, uint32_t model,
 	{
 		uint32_t remain = job->datalen;
 		uint8_t *ptr = job->databuf;
-		do {
-			ret = read(data_fd, ptr, remain);
-			if (ret < 0) {
-				ERROR("Read failed (%d/%u/%d)\n",
-				      ret, remain, job->datalen);
-				perror("ERROR: Read failed");
-				free(job->databuf);
-				job->databuf = NULL;
-				return ret;
-			}
-			ptr += ret;
-			remain -= ret;
-		} while (remain);
+		ret = dyesub_read_full(data_fd, ptr, remain);
+		if (ret != (int)remain) {
+			ERROR("Read failed (%d/%u/%d)\n",
+			      ret, remain, job->datalen);
+			perror("ERROR: Read failed");
+			free(job->databuf);
+			job->databuf = NULL;
+			return (ret < 0) ? ret : CUPS_BACKEND_CANCEL;
+		}
 	}
 
 	/* Make sure footer is sane too */
-	ret = read(data_fd, tmpbuf, 4);
+	ret = dyesub_read_full(data_fd, tmpbuf, 4);
 	if (ret != 4) {
 		ERROR("Read failed (%d/%d)\n", ret, 4);
 		perror("ERROR: Read failed");
 		free(job->databuf);
 		job->databuf = NULL;
-		return ret;
+		return (ret < 0) ? ret : CUPS_BACKEND_CANCEL;
 	}
 	if (tmpbuf[0] != 0x04 ||
 	    tmpbuf[1] != 0x03 ||
@@ -147,7 +143,7 @@ int sinfonia_raw10_read_parse(int data_fd, struct sinfonia_printjob *job)
 	job->common.jobsize = sizeof(*job);
 
 	/* Read in header */
-	ret = read(data_fd, &hdr, sizeof(hdr));
+	ret = dyesub_read_full(data_fd, &hdr, sizeof(hdr));
 	if (ret < 0 || ret != sizeof(hdr)) {
 		if (ret == 0)
 			return CUPS_BACKEND_CANCEL;
@@ -188,17 +184,13 @@ int sinfonia_raw10_read_parse(int data_fd, struct sinfonia_printjob *job)
 	{
 		int remain = job->datalen;
 		uint8_t *ptr = job->databuf;
-		do {
-			ret = read(data_fd, ptr, remain);
-			if (ret < 0) {
-				ERROR("Read failed (%d/%d/%d)\n",
-				      ret, remain, job->datalen);
-				perror("ERROR: Read failed");
-				return CUPS_BACKEND_CANCEL;
-			}
-			ptr += ret;
-			remain -= ret;
-		} while (remain);
+		ret = dyesub_read_full(data_fd, ptr, remain);
+		if (ret != (int)remain) {
+			ERROR("Read failed (%d/%d/%d)\n",
+			      ret, remain, job->datalen);
+			perror("ERROR: Read failed");
+			return CUPS_BACKEND_CANCEL;
+		}
 	}
 
 	return CUPS_BACKEND_OK;
@@ -297,13 +289,11 @@ int sinfonia_panorama_splitjob(struct sinfonia_printjob *injob,
 		return CUPS_BACKEND_CANCEL;
 	}
 
-	/* Work out which number of rows per panel */
-	if (!panel_rows[0]) {
-		panel_rows[0] = max_rows;
-		panel_rows[1] = inrows - panel_rows[0] + overlap_rows;
-		if (numpanels > 2)
-			panel_rows[2] = inrows - panel_rows[0] - panel_rows[1] + overlap_rows + overlap_rows;
-	}
+	/* Work out how many panels we need, and the rows in each */
+	i = dyesub_pano_panel_rows(inrows, &numpanels, overlap_rows,
+				   max_rows, panel_rows);
+	if (i)
+		return i;
 
 	/* Allocate and set up new jobs and buffers */
 	for (i = 0 ; i < numpanels ; i++) {
@@ -320,20 +310,111 @@ int sinfonia_panorama_splitjob(struct sinfonia_printjob *injob,
 		/* Fill in header differences */
 		memcpy(newjobs[i], injob, sizeof(struct sinfonia_printjob));
 		newjobs[i]->databuf = panels[i];
+		newjobs[i]->datalen = cols * panel_rows[i] * 3;
 		newjobs[i]->jp.rows = panel_rows[i];
 		// XXX what else?
 	}
 
-	dyesub_pano_split_rgb8(injob->databuf, cols, inrows,
-			       numpanels, overlap_rows, max_rows,
-			       panels, panel_rows);
+	return dyesub_pano_split_rgb8(injob->databuf, cols, inrows,
+				      numpanels, overlap_rows, max_rows,
+				      panels, panel_rows);
+}
 
-	// XXX postprocess buffers!
-	// pano_process_rgb8(numpanels, cols, overlap_rows, panels, panel_rows);
+/* Combined sizes carry a few extra rows for the cut between the two
+   prints; eg 2*1240 -> 2492 for 4x6 on 6x8 media */
+#define MAX_2UP_GAP 64
 
-	return CUPS_BACKEND_OK;
+const struct sinfonia_mediainfo_item *sinfonia_find_2up(const struct sinfonia_mediainfo_item *items,
+							 int count,
+							 const struct sinfonia_printjob *job)
+{
+	int i;
+
+	for (i = 0 ; i < count ; i++) {
+		if (items[i].columns == job->jp.columns &&
+		    items[i].rows >= job->jp.rows * 2 &&
+		    items[i].rows <= job->jp.rows * 2 + MAX_2UP_GAP)
+			return &items[i];
+	}
+
+	return NULL;
+}
+
+#define JOB_EQUIV(__x)  if (job1->__x != job2->__x) return NULL
+
+/* Stacks two identical jobs into the size given by job1->combo, with
+   'blank' filling the gap between them.  Print media/method are left
+   for the caller to fill in.  Does _not_ free the input jobs. */
+struct sinfonia_printjob *sinfonia_combine_2up(const struct sinfonia_printjob *job1,
+					       const struct sinfonia_printjob *job2,
+					       int planar, uint8_t blank)
+{
+	struct sinfonia_printjob *newjob;
+	uint32_t planelen, padlen;
+	uint8_t *ptr;
+	int i, planes;
+
+	if (!job1 || !job2)
+		return NULL;
+
+	/* Make sure we're okay to proceed */
+	JOB_EQUIV(combo);
+	JOB_EQUIV(jp.columns);
+	JOB_EQUIV(jp.rows);
+	JOB_EQUIV(jp.method);
+	JOB_EQUIV(jp.media);
+	JOB_EQUIV(jp.oc_mode);
+	JOB_EQUIV(jp.quality);
+	JOB_EQUIV(jp.mattedepth);
+	JOB_EQUIV(jp.dust);
+	JOB_EQUIV(jp.ext_flags);
+
+	if (!job1->combo)
+		return NULL;
+
+	/* Planar data gets stacked plane by plane, everything else
+	   (packed or line-interleaved) is just stacked row by row */
+	planes = planar ? 3 : 1;
+	planelen = job1->jp.rows * job1->jp.columns * 3 / planes;
+	padlen = (job1->combo->rows - job1->jp.rows * 2) * job1->jp.columns * 3 / planes;
+
+	if (job1->datalen != (int)planelen * planes ||
+	    job2->datalen != (int)planelen * planes)
+		return NULL;
+
+	newjob = malloc(sizeof(*newjob));
+	if (!newjob) {
+		ERROR("Memory allocation failure!\n");
+		return NULL;
+	}
+	memcpy(newjob, job1, sizeof(*newjob));
+
+	newjob->jp.rows = job1->combo->rows;
+	newjob->combo = NULL;
+	newjob->common.can_combine = 0;
+	newjob->datalen = newjob->jp.rows * newjob->jp.columns * 3;
+	newjob->databuf = malloc(newjob->datalen);
+	if (!newjob->databuf) {
+		ERROR("Memory allocation failure!\n");
+		free(newjob);
+		return NULL;
+	}
+
+	ptr = newjob->databuf;
+	for (i = 0 ; i < planes ; i++) {
+		memcpy(ptr, job1->databuf + i * planelen, planelen);
+		ptr += planelen;
+		memset(ptr, blank, padlen);
+		ptr += padlen;
+		memcpy(ptr, job2->databuf + i * planelen, planelen);
+		ptr += planelen;
+	}
+
+	return newjob;
 }
 
+#undef JOB_EQUIV
+
 int sinfonia_raw18_read_parse(int data_fd, struct sinfonia_printjob *job)
 {
 	struct sinfonia_printcmd18_hdr hdr;
@@ -342,7 +423,7 @@ int sinfonia_raw18_read_parse(int data_fd, struct sinfonia_printjob *job)
 	job->common.jobsize = sizeof(*job);
 
 	/* Read in header */
-	ret = read(data_fd, &hdr, sizeof(hdr));
+	ret = dyesub_read_full(data_fd, &hdr, sizeof(hdr));
 	if (ret < 0 || ret != sizeof(hdr)) {
 		if (ret == 0)
 			return CUPS_BACKEND_CANCEL;
@@ -375,17 +456,13 @@ int sinfonia_raw18_read_parse(int data_fd, struct sinfonia_printjob *job)
 	{
 		int remain = job->datalen;
 		uint8_t *ptr = job->databuf;
-		do {
-			ret = read(data_fd, ptr, remain);
-			if (ret < 0) {
-				ERROR("Read failed (%d/%d/%d)\n",
-				      ret, remain, job->datalen);
-				perror("ERROR: Read failed");
-				return CUPS_BACKEND_CANCEL;
-			}
-			ptr += ret;
-			remain -= ret;
-		} while (remain);
+		ret = dyesub_read_full(data_fd, ptr, remain);
+		if (ret != (int)remain) {
+			ERROR("Read failed (%d/%d/%d)\n",
+			      ret, remain, job->datalen);
+			perror("ERROR: Read failed");
+			return CUPS_BACKEND_CANCEL;
+		}
 	}
 
 	return CUPS_BACKEND_OK;
@@ -399,7 +476,7 @@ int sinfonia_raw28_read_parse(int data_fd, struct sinfonia_printjob *job)
 	job->common.jobsize = sizeof(*job);
 
 	/* Read in header */
-	ret = read(data_fd, &hdr, sizeof(hdr));
+	ret = dyesub_read_full(data_fd, &hdr, sizeof(hdr));
 	if (ret < 0 || ret != sizeof(hdr)) {
 		if (ret == 0)
 			return CUPS_BACKEND_CANCEL;
@@ -433,17 +510,13 @@ int sinfonia_raw28_read_parse(int data_fd, struct sinfonia_printjob *job)
 	{
 		int remain = job->datalen;
 		uint8_t *ptr = job->databuf;
-		do {
-			ret = read(data_fd, ptr, remain);
-			if (ret < 0) {
-				ERROR("Read failed (%d/%d/%d)\n",
-				      ret, remain, job->datalen);
-				perror("ERROR: Read failed");
-				return CUPS_BACKEND_CANCEL;
-			}
-			ptr += ret;
-			remain -= ret;
-		} while (remain);
+		ret = dyesub_read_full(data_fd, ptr, remain);
+		if (ret != (int)remain) {
+			ERROR("Read failed (%d/%d/%d)\n",
+			      ret, remain, job->datalen);
+			perror("ERROR: Read failed");
+			return CUPS_BACKEND_CANCEL;
+		}
 	}
 
 	return CUPS_BACKEND_OK;
@@ -455,6 +528,8 @@ void sinfonia_cleanup_job(const void *vjob)
 
 	if (job->databuf)
 		free(job->databuf);
+	if (job->procbuf)
+		free(job->procbuf);
 
 	free((void*)job);
 }
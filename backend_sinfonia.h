@@ -24,7 +24,7 @@
  *
  */
 
-#define LIBSINFONIA_VER "0.19"
+#define LIBSINFONIA_VER "0.23"
 
 #define SINFONIA_HDR1_LEN 0x10
 #define SINFONIA_HDR2_LEN 0x64
@@ -56,6 +56,16 @@ struct sinfonia_printjob {
 
 	uint8_t *databuf;
 	int datalen;
+
+	/* Size on the loaded media that holds two of these, if any */
+	const struct sinfonia_mediainfo_item *combo;
+
+	/* Processed image data, for backends with a prepare_job hook */
+	uint8_t *procbuf;
+	int proclen;
+	uint32_t procgen;
+	uint8_t procavg[3];
+	int processed;
 };
 
 int sinfonia_read_parse(int data_fd, uint32_t model,
@@ -70,6 +80,13 @@ int sinfonia_panorama_splitjob(struct sinfonia_printjob *injob,
                                uint16_t max_rows,
                                struct sinfonia_printjob **newjobs);
 
+const struct sinfonia_mediainfo_item *sinfonia_find_2up(const struct sinfonia_mediainfo_item *items,
+							 int count,
+							 const struct sinfonia_printjob *job);
+struct sinfonia_printjob *sinfonia_combine_2up(const struct sinfonia_printjob *job1,
+					       const struct sinfonia_printjob *job2,
+					       int planar, uint8_t blank);
+
 /* mapping param IDs to names */
 struct sinfonia_param {
 	const uint8_t id;
@@ -85,6 +85,9 @@ struct upd_printjob {
 	uint16_t rows;
 	uint16_t cols;
 	uint32_t imglen;
+
+	uint16_t copy_cmd;  /* If set, send a COPIES command with this count */
+	uint8_t copy_anchor; /* ..just ahead of this command */
 };
 
 struct upd_ctx {
@@ -308,10 +311,36 @@ static void upd_cleanup_job(const void *vjob)
 
 #define MAX_PRINTJOB_LEN (2048*2764*3 + 2048)
 
+/* If a spool file lacks a COPIES (1b ee) command, we can generate one,
+   but only where we know the drivers put it:
+
+   UP-DR150/200:  USB capture below, just ahead of the print
+                  dimensions (1b 15).
+   UP-CR10L/CX1:  Spool format below, just ahead of print start (1b 0a).
+
+   The UP-D895/897 spool files carry it as well, but its semantics there
+   aren't pinned down ("00 for printer selected"), so those resend the
+   whole job for each copy instead.
+
+   Returns the command to put COPIES in front of, or 0 if unknown. */
+static uint8_t upd_copy_anchor(int type)
+{
+	switch (type) {
+	case P_SONY_UPDR150:
+		return 0x15;
+	case P_SONY_UPCR10:
+		return 0x0a;
+	default:
+		return 0;
+	}
+}
+
 static int upd_read_parse(void *vctx, const void **vjob, int data_fd, int copies) {
 	struct upd_ctx *ctx = vctx;
 	int len, run = 1;
 	uint32_t copies_offset = 0;
+	uint8_t anchor = upd_copy_anchor(ctx->conn->type);
+	int anchor_seen = 0;
 	uint32_t param_offset = 0;
 	uint32_t data_offset = 0;
 
@@ -340,13 +369,18 @@ static int upd_read_parse(void *vctx, const void **vjob, int data_fd, int copies
 	while(run) {
 		int i;
 		int keep = 0;
-		i = read(data_fd, job->databuf + job->datalen, 4);
+		i = dyesub_read_full(data_fd, job->databuf + job->datalen, 4);
 		if (i < 0) {
 			upd_cleanup_job(job);
 			return CUPS_BACKEND_CANCEL;
 		}
 		if (i == 0)
 			break;
+		if (i != 4) {
+			ERROR("Short read (%d/%d)\n", i, 4);
+			upd_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
 
 		memcpy(&len, job->databuf + job->datalen, sizeof(len));
 		len = le32_to_cpu(len);
@@ -430,7 +464,7 @@ static int upd_read_parse(void *vctx, const void **vjob, int data_fd, int copies
 
 		/* Read in the data chunk */
 		while(len > 0) {
-			i = read(data_fd, job->databuf + job->datalen, len);
+			i = dyesub_read_full(data_fd, job->databuf + job->datalen, len);
 			if (i < 0) {
 				upd_cleanup_job(job);
 				return CUPS_BACKEND_CANCEL;
@@ -462,6 +496,9 @@ static int upd_read_parse(void *vctx, const void **vjob, int data_fd, int copies
 				default:
 					break;
 				}
+				if (keep && anchor &&
+				    job->databuf[job->datalen + 1] == anchor)
+					anchor_seen = 1;
 			}
 
 			if (keep)
@@ -484,6 +521,12 @@ static int upd_read_parse(void *vctx, const void **vjob, int data_fd, int copies
 			memcpy(job->databuf + copies_offset, &tmp, sizeof(tmp));
 		}
 		job->common.copies = 1;
+	} else if (copies > 1 && anchor_seen) {
+		/* Otherwise ask the printer for copies instead of
+		   sending the whole job over again for each one */
+		job->copy_cmd = copies;
+		job->copy_anchor = anchor;
+		job->common.copies = 1;
 	}
 
 	/* Parse some other stuff */
@@ -516,6 +559,7 @@ static int upd_main_loop(void *vctx, const void *vjob, int wait_for_return) {
 	struct upd_ctx *ctx = vctx;
 	int i, ret;
 	int copies;
+	int copy_sent;
 
 	const struct upd_printjob *job = vjob;
 
@@ -581,6 +625,7 @@ top:
 
 	/* Send over job */
 	i = 0;
+	copy_sent = 0;
 	while (i < job->datalen) {
 		uint32_t len;
 		memcpy(&len, job->databuf + i, sizeof(len));
@@ -588,6 +633,17 @@ top:
 
 		i += sizeof(uint32_t);
 
+		/* Slip in the copy count where the driver would have */
+		if (job->copy_cmd && !copy_sent && len >= 2 &&
+		    job->databuf[i] == 0x1b && job->databuf[i+1] == job->copy_anchor) {
+			uint8_t cpybuf[9] = { 0x1b, 0xee, 0, 0, 0, 0x02, 0,
+					      job->copy_cmd >> 8, job->copy_cmd & 0xff };
+			if ((ret = send_data(ctx->conn,
+					     cpybuf, sizeof(cpybuf))))
+				return CUPS_BACKEND_FAILED;
+			copy_sent = 1;
+		}
+
 		if ((ret = send_data(ctx->conn,
 				     job->databuf + i, len)))
 			return CUPS_BACKEND_FAILED;
@@ -595,9 +651,6 @@ top:
 		i += len;
 	}
 
-	// XXX generate and send copy cmd instead of using the offset.
-	// 1b ee 00 00 00 02 00  NN NN  (BE)
-
 	/* Wait for completion! */
 retry:
 	sleep(1);
@@ -741,7 +794,7 @@ static const char *sonyupd_prefixes[] = {
 
 const struct dyesub_backend sonyupd_backend = {
 	.name = "Sony UP-D",
-	.version = "0.46",
+	.version = "0.48",
 	.uri_prefixes = sonyupd_prefixes,
 	.cmdline_arg = upd_cmdline_arg,
 	.cmdline_usage = upd_cmdline,
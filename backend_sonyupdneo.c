@@ -224,7 +224,7 @@ static int updneo_read_parse(void *vctx, const void **vjob, int data_fd, int cop
 		int i, len, *lenptr;
 
 		/* Read in data block header (256 bytes) */
-		i = read(data_fd, tmpbuf, 256);
+		i = dyesub_read_full(data_fd, tmpbuf, 256);
 		if (i < 0) {
 			ERROR("Read failed (%d)\n", i);
 			updneo_cleanup_job(job);
@@ -232,6 +232,11 @@ static int updneo_read_parse(void *vctx, const void **vjob, int data_fd, int cop
 		}
 		if (i == 0)
 			break;
+		if (i != 256) {
+			ERROR("Short read (%d/%d)\n", i, 256);
+			updneo_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
+		}
 
 		/* Explicitly null terminate just in case */
 		tmpbuf[256] = 0;
@@ -315,18 +320,12 @@ static int updneo_read_parse(void *vctx, const void **vjob, int data_fd, int cop
 		// CR20L: 64,0,0,0
 
 		/* Read in the data chunk */
-		while(len > 0) {
-			i = read(data_fd, ptr + *lenptr, len);
-			if (i < 0) {
-				updneo_cleanup_job(job);
-				return CUPS_BACKEND_CANCEL;
-			}
-			if (i == 0)
-				break;
-
-			*lenptr += i;
-			len -= i;
+		i = dyesub_read_full(data_fd, ptr + *lenptr, len);
+		if (i < 0) {
+			updneo_cleanup_job(job);
+			return CUPS_BACKEND_CANCEL;
 		}
+		*lenptr += i;
 	}
 
 	if (!job->datalen || !job->hdrlen || !job->ftrlen) {
@@ -7,7 +7,8 @@
 # very naive linear manner.
 #
 # Also note that this script will probably go away as its functionality
-# is moved into selphy_print &| gutenprint
+# is moved into selphy_print &| gutenprint.  The backend already splits
+# and blends panoramas natively for the D90, EK8810, and EK69xx.
 #
 infile="$1"
 outfile="$2"
@@ -114,8 +114,24 @@ if ($proc_count > 1 && $kid > 0) {
 	    undef($ENV{"MEDIA_CODE"});
 	}
 
+	# Several testjobs joined with '+' are sent as one multi-page job
+	my @files = split(/\+/, $row[3]);
+	my $input = "testjobs/$files[0]";
+	my @stdin = ();
+	if (scalar(@files) > 1) {
+	    my $data = "";
+	    foreach my $f (@files) {
+		open (my $fh, "<:raw", "testjobs/$f") || die ("can't open $f\n");
+		local $/;
+		$data .= <$fh>;
+		close ($fh);
+	    }
+	    $input = "-";
+	    @stdin = ("<", \$data);
+	}
+
 	foreach my $i (@copies_set) {
-	    my @args = ($backend_exec, "-d", $i, "testjobs/${row[3]}");
+	    my @args = ($backend_exec, "-d", $i, $input);
 	    if ($valgrind) {
 		if ($quiet) {
 		    unshift(@args,"-q");
@@ -127,9 +143,9 @@ if ($proc_count > 1 && $kid > 0) {
 	    }
 
 	    if ($quiet) {
-		$rval = run \@args, ">", "/dev/null", "2>", "/dev/null";
+		$rval = run \@args, @stdin, ">", "/dev/null", "2>", "/dev/null";
 	    } else {
-		$rval = run \@args;
+		$rval = run \@args, @stdin;
 	    }
 	    if (!$rval) {
 		print("***** $row[0] $row[1] $row[2] $row[3] $row[4] $i ***** FAIL: $? \n");